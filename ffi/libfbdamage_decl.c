@@ -0,0 +1,32 @@
+// For use with https://github.com/koreader/ffi-cdecl to re-generate up-to-date FFI declarations ;)
+#include <libfbdamage.h>
+
+#include "ffi-cdecl.h"
+
+// Keep this in the same order as libfbdamage.h
+
+cdecl_func(fbdamage_open)
+cdecl_func(fbdamage_open_path)
+cdecl_func(fbdamage_wait)
+cdecl_func(fbdamage_drain)
+
+cdecl_type(fbdamage_ring)
+cdecl_func(fbdamage_ring_map)
+cdecl_func(fbdamage_ring_unmap)
+cdecl_func(fbdamage_ring_drain)
+cdecl_func(fbdamage_slot_update)
+
+cdecl_type(fbdamage_arena)
+cdecl_func(fbdamage_arena_map)
+cdecl_func(fbdamage_arena_unmap)
+cdecl_func(fbdamage_arena_copy)
+
+cdecl_const(FBDAMAGE_REGION_MAX_RECTS)
+cdecl_type(fbdamage_region)
+cdecl_func(fbdamage_region_init)
+cdecl_func(fbdamage_region_clear)
+cdecl_func(fbdamage_region_add)
+cdecl_func(fbdamage_region_union)
+cdecl_func(fbdamage_region_intersect)
+cdecl_func(fbdamage_region_clip)
+cdecl_func(fbdamage_region_bounds)
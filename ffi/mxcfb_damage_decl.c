@@ -7,6 +7,11 @@
 
 // Enums
 cdecl_type(mxcfb_damage_data_format)
+cdecl_type(mxcfb_damage_overflow_policy)
+cdecl_type(mxcfb_damage_coalesce_flags)
+cdecl_type(mxcfb_damage_record_version)
+cdecl_type(mxcfb_damage_event_mask)
+cdecl_type(mxcfb_damage_pixels_status)
 
 // Structs
 cdecl_type(mxcfb_damage_rect)
@@ -14,3 +19,26 @@ cdecl_type(mxcfb_damage_alt_data)
 cdecl_type(mxcfb_damage_data)
 
 cdecl_type(mxcfb_damage_update)
+
+cdecl_type(mxcfb_damage_ring_header)
+cdecl_type(mxcfb_damage_pixels)
+cdecl_type(mxcfb_damage_call)
+cdecl_type(mxcfb_damage_ring_cursor)
+cdecl_type(mxcfb_damage_geometry)
+cdecl_type(mxcfb_damage_fixed_data)
+cdecl_type(mxcfb_damage_slot)
+
+cdecl_type(mxcfb_damage_overflow_setup)
+cdecl_type(mxcfb_damage_coalesce_setup)
+cdecl_type(mxcfb_damage_tiles_setup)
+cdecl_type(mxcfb_damage_tiles_fetch)
+
+cdecl_type(mxcfb_damage_rect16)
+cdecl_type(mxcfb_damage_update_v2)
+cdecl_type(mxcfb_damage_record_format)
+
+cdecl_type(mxcfb_damage_wakeup_setup)
+
+cdecl_type(mxcfb_damage_inject)
+
+cdecl_type(mxcfb_damage_filter)
@@ -10,16 +10,36 @@
 #	define __KERNEL__
 #endif
 
+#include <linux/capability.h>
 #include <linux/cdev.h>
-#include <linux/circ_buf.h>
+#include <linux/compat.h>
+#include <linux/crc32.h>
 #include <linux/fb.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
 #include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <linux/percpu.h>
 #include <linux/poll.h>
+#include <linux/rculist.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#	include <linux/sched/signal.h>
+#else
+#	include <linux/sched.h>
+#endif
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/time.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 #include <linux/wait.h>
 
 #ifdef CONFIG_ARCH_SUNXI
@@ -29,6 +49,11 @@
 #endif
 
 #include "mxc_epdc_fb_damage.h"
+#include "mxc_epdc_fb_damage_ring.h"
+
+// c.f., /sys/kernel/tracing/events/fbdamage
+#define CREATE_TRACE_POINTS
+#include "mxc_epdc_fb_damage_trace.h"
 
 // Sanity checks that the version checking is okay
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
@@ -49,25 +74,107 @@
 #endif
 
 #ifndef CONFIG_ARCH_SUNXI
-static int fbnode = 0;
-module_param(fbnode, int, 0444);
-MODULE_PARM_DESC(fbnode, "Framebuffer index (Defaults to 0, i.e., fb0)");
+static char* fbnode = "0";
+module_param(fbnode, charp, 0444);
+MODULE_PARM_DESC(fbnode, "Comma-separated list of framebuffer indices, or all (Defaults to 0, i.e., fb0)");
 #endif
 
-static atomic_t overflows = ATOMIC_INIT(0);
-
 // Matches EPDC_V2_MAX_NUM_UPDATES
 #define DMG_BUF_SIZE 64
+// Keep it sane (the upper bound weighs ~1MB)
+#define DMG_BUF_MIN  8U
+#define DMG_BUF_MAX  8192U
+static unsigned int ring_size = DMG_BUF_SIZE;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Amount of damage events the ring can hold, must be a power of two (Defaults to 64)");
+
+// NOTE: Lets anyone with CAP_SYS_ADMIN forge damage events, so, only for testing & benchmarking purposes!
+static bool inject = false;
+module_param(inject, bool, 0444);
+MODULE_PARM_DESC(inject, "Enable the FBDAMAGE_INJECT debugging ioctl (Defaults to false)");
+
+// NOTE: patch swaps the driver's ioctl handler for ours, which only works if its fb_ops are writable
+//       (they're const since Linux 5.6), and, on sunxi, only for the disp clients that open it *after* we've loaded.
+//       kprobe hooks the kernel function that dispatches those ioctls instead (c.f., damage_probe),
+//       which works for any fbdev (e.g., vfb on a desktop kernel), and for existing clients, too.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static char* backend = "kprobe";
+#else
+static char* backend = "patch";
+#endif
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend,
+		 "How to hook the driver's ioctls: patch or kprobe (Defaults to kprobe on >= 5.6, patch otherwise)");
+// i.e., backend=kprobe
+static bool damage_probing = false;
+
+#ifndef CONFIG_ARCH_SUNXI
+// NOTE: Only on mxc, as on sunxi, what disp refreshes doesn't necessarily come from the framebuffer we'd copy from.
+#	define DMG_ARENA_MAX_KB 65536U
+static unsigned int pixel_arena = 0U;
+module_param(pixel_arena, uint, 0444);
+MODULE_PARM_DESC(pixel_arena,
+		 "Size of the pixel snapshot arena, in KiB, rounded up to a power of two (Defaults to 0, i.e., none)");
+#endif
+
+// What coalescing readers keep around
+typedef struct
+{
+	uint32_t            event;
+	mxcfb_damage_update update;
+} mxcfb_damage_event;
+
+// Refresh requests, indexed by update_marker, so that we can match their completion back to them.
+// NOTE: A request is forgotten once it completes, or when a more recent one lands in the same slot.
+#define DMG_MARKERS 64U
+
+// Waveform modes are sparse (e.g., WAVEFORM_MODE_AUTO is 257 on mxcfb), so they're mapped to slots on first use,
+// and whatever doesn't fit is lumped together in an extra one (c.f., the latency & stats sysfs attributes).
+// NOTE: Only the producers ever add to it (under waveform_lock, and it never shrinks),
+//       lookups (and sysfs) only look at the first waveform_slots entries.
+#define DMG_WAVEFORM_SLOTS 16U
+
+// Per-waveform completion latency (c.f., the latency sysfs attribute)
+typedef struct
+{
+	uint32_t count;
+	u64      total_ns;
+	u64      min_ns;
+	u64      max_ns;
+} mxcfb_damage_latency;
+
+// Cumulative counters (c.f., the stats sysfs group).
+// NOTE: They're per-CPU, so that counting is just a local increment, and only sysfs pays for the sum.
+//       Everything is unsigned long (i.e., as wide as the CPU can increment in one go) except pixels,
+//       which would wrap way too fast on 32-bit.
+#define DMG_STAT_FORMATS (DAMAGE_UPDATE_DATA_GEOMETRY + 2U)    // The last one is DAMAGE_UPDATE_DATA_ERROR
+#define DMG_LAG_BUCKETS  32U
 typedef struct
 {
-	mxcfb_damage_update* buffer;
-	int                  head;
-	int                  tail;
-} mxcfb_damage_circ_buf;
+	unsigned long formats[DMG_STAT_FORMATS];
+	unsigned long waveforms[DMG_WAVEFORM_SLOTS + 1U];
+	u64           pixels;                  // Sum of the update regions' areas
+	unsigned long full;                    // i.e., UPDATE_MODE_FULL
+	unsigned long partial;                 // i.e., UPDATE_MODE_PARTIAL
+	unsigned long copy_failures;           // When we couldn't get at the ioctl's data
+	unsigned long overflows;               // Records the ring couldn't hold (c.f., damage_circ_overflow)
+	unsigned long lag[DMG_LAG_BUCKETS];    // Event to copy_to_user, bucket n holds [2^(n-1), 2^n) µs
+	// Time refresh requests spent in the driver's ioctl handler, per waveform mode, bucketed like lag
+	unsigned long blocking[DMG_WAVEFORM_SLOTS + 1U][DMG_LAG_BUCKETS];
+} mxcfb_damage_stats;
+
+// Sums a per-CPU counter
+#define damage_stat_sum(ctx, field)                                                                                      \
+	({                                                                                                               \
+		u64 ___sum = 0U;                                                                                         \
+		int ___cpu;                                                                                              \
+		for_each_possible_cpu(___cpu)                                                                            \
+		{                                                                                                        \
+			___sum += per_cpu_ptr((ctx)->stats, ___cpu)->field;                                              \
+		}                                                                                                        \
+		___sum;                                                                                                  \
+	})
 
-static mxcfb_damage_update   damage_buffer[DMG_BUF_SIZE];    // ~6KB
-static mxcfb_damage_circ_buf damage_circ = { .buffer = damage_buffer, .head = 0, .tail = 0 };
-static DECLARE_WAIT_QUEUE_HEAD(listen_queue);
 #ifdef CONFIG_ARCH_SUNXI
 typedef long (*ioctl_handler_fn_t)(struct file* file, unsigned int cmd, unsigned long arg);
 static ioctl_handler_fn_t orig_disp_ioctl;
@@ -77,377 +184,3595 @@ static struct file_operations        patched_disp_fops;
 
 static struct cdev* disp_cdev;
 
-static DEFINE_MUTEX(producer_lock);
-
 static uint32_t g2d_rota = 270U;
 static bool     pen_mode = false;
 #else
 typedef int (*ioctl_handler_fn_t)(struct fb_info* info, unsigned int cmd, unsigned long arg);
-static ioctl_handler_fn_t orig_fb_ioctl;
 #endif
 
-#ifdef CONFIG_ARCH_SUNXI
-static long
-    disp_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+// Content hashes of the framebuffer (c.f., FBDAMAGE_SET_TILE_HASHING), on a fixed grid of DAMAGE_TILE_SIZE_MIN px tiles,
+// so that each event is only ever hashed once, whatever the tile size (and the amount) of the readers that want it.
+#define DMG_HASH_SHIFT 3U    // i.e., ilog2(DAMAGE_TILE_SIZE_MIN)
+typedef struct
 {
-	int                   head, tail;
-	sunxi_disp_eink_ioctl ioc_data;
-	struct area_info      area;
-	unsigned int          frame_id;
-	uint32_t              rotate;
-	bool                  copy_failure;
+	uint32_t  cols;
+	uint32_t  rows;
+	uint32_t* hashes;    // Per tile, as of the latest event that touched it
+	uint32_t* stamps;    // Per tile, sequence number of the latest event that actually changed it
+} mxcfb_damage_tile_hashes;
+
+// Everything we keep per framebuffer (c.f., the fbnode module parameter), so that no two of them share anything:
+// each one gets its own ring, its own device node, and its own sysfs attributes.
+typedef struct
+{
+	int                            fbnode;                 // Framebuffer index (always 0 on sunxi)
+	mxcfb_damage_circ_buf          circ;
+	// Every event gets a sequence number, even the ones the ring had to drop (c.f., mxcfb_damage_update_v2)
+	atomic_t                       event_seq;
+	mxcfb_damage_update            submitted[DMG_MARKERS];
+	spinlock_t                     submitted_lock;
+	// Amount of readers that want completion events, we don't bother queuing them otherwise
+	atomic_t                       completion_readers;
+	// Amount of readers that want overflow summaries, we don't bother keeping track of overwritten records otherwise
+	atomic_t                       overflow_readers;
+	// Amount of readers that want pixel snapshots, we don't bother taking them otherwise.
+	// NOTE: Producers that take a snapshot go through snapshot_lock,
+	//       so that the arena is filled in the exact same order as the ring (c.f., damage_pixels_tail).
+	atomic_t                       snapshot_readers;
+	struct mutex                   snapshot_lock;
+	// Arena head as of the latest snapshot that made it to the ring, for the records that don't carry one
+	// (c.f., damage_circ_commit).
+	uint32_t                       pixels_floor;
+	// Amount of readers that want geometry changes, we don't bother queuing them otherwise
+	atomic_t                       geometry_readers;
+	// The layout every record is stamped with (c.f., damage_geometry_check), only ever written under geometry_lock
+	mxcfb_damage_geometry          geometry;
+	seqlock_t                      geometry_lock;
+	uint32_t                       waveform_modes[DMG_WAVEFORM_SLOTS];
+	uint32_t                       waveform_slots;
+	spinlock_t                     waveform_lock;
+	// Per-waveform completion latency (c.f., the latency sysfs attribute)
+	mxcfb_damage_latency           latency_stats[DMG_WAVEFORM_SLOTS + 1U];
+	spinlock_t                     latency_lock;
+	mxcfb_damage_stats __percpu*   stats;                  // c.f., the stats sysfs group
+	uint32_t                       max_occupancy;          // Most records a ring reader ever had queued
+	// NOTE: Producers only ever walk the list under RCU, open & release update it under reader_list_lock.
+	struct list_head               reader_list;
+	struct mutex                   reader_list_lock;
+	// Where a DAMAGE_OVERFLOW_BLOCK producer waits for its readers to make some room
+	wait_queue_head_t              space_queue;
+	struct cdev                    cdev;
+	struct device*                 device;
+#ifndef CONFIG_ARCH_SUNXI
+	// NOTE: Several framebuffers may share the same fb_ops, in which case they share the same original handler, too.
+	struct fb_ops*                 fbops;
+	ioctl_handler_fn_t             orig_fb_ioctl;
+	// Shared by every reader that asked for content hashing (c.f., damage_tile_hashing_get).
+	// NOTE: Producers only ever look at it under RCU, it's only ever swapped under reader_list_lock.
+	mxcfb_damage_tile_hashes __rcu* tile_hashes;
+	uint32_t                       hashing_readers;
+#endif
+} mxcfb_damage_ctx;
 
-	int ret = orig_disp_ioctl(file, cmd, arg);
+// Indexed by fbnode
+static mxcfb_damage_ctx* damage_ctxs[FB_MAX];
 
-	if (cmd == DISP_EINK_SET_NTX_HANDWRITE_ONOFF) {
-		if (!copy_from_user(&ioc_data, (void __user*) arg, sizeof(ioc_data))) {
-			pen_mode = ioc_data.toggle_handw.enable;
-		}
-	} else if (cmd == DISP_EINK_UPDATE2) {
-		// NOTE: Unlike fb_ioctl, unlocked_ioctl is called without a lock, so, hold a mutex ourself...
-		mutex_lock(&producer_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+// NOTE: registered_fb is private to fbmem since 6.1, so we keep the framebuffers we track open instead,
+//       which gets us their fb_info (fb_open stashes it in private_data), and pins it (c.f., damage_fb_open).
+static struct file* damage_fb_files[FB_MAX];
+#endif
 
-		// A lot of the stuff we need is actually a pointer, so we need a bunch of copies...
-		// Make sure *all* of them are sane...
-		copy_failure = false;
-		if (!copy_from_user(&ioc_data, (void __user*) arg, sizeof(ioc_data))) {
-			if (copy_from_user(&area, (void __user*) ioc_data.update2.area, sizeof(area))) {
-				copy_failure = true;
-			}
-			if (get_user(frame_id, (unsigned int __user*) ioc_data.update2.frame_id)) {
-				copy_failure = true;
-			}
-			if (get_user(rotate, (uint32_t __user*) ioc_data.update2.rotate)) {
-				copy_failure = true;
-			}
+// Returns the fb_info of the framebuffer at that index, if there's one (and, on >= 6.1, if we track it)
+static struct fb_info*
+    damage_fb_info(int node)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+	return damage_fb_files[node] ? damage_fb_files[node]->private_data : NULL;
+#else
+	return registered_fb[node];
+#endif
+}
+
+// What a reader lost to overflows since its last read (c.f., DAMAGE_EVENT_OVERFLOW)
+typedef struct
+{
+	uint32_t          count;            // Refresh requests lost, 0 if none
+	uint32_t          event;            // Sequence number of the latest one
+	u64               timestamp;        // ...and its timestamp
+	bool              everything;       // One of them had no data (i.e., that damage could be anywhere)
+	bool              has_region;       // region is only valid if set
+	mxcfb_damage_rect region;           // Bounding box of the ones that had data
+	u64               area;             // Area of the most aggressive one (full beats partial, then the largest wins)
+	uint32_t          waveform_mode;    // ...and its modes
+	uint32_t          update_mode;
+	uint32_t          flags;            // Union of everyone's flags
+} mxcfb_damage_lost;
+
+// Per open file description
+typedef struct
+{
+	mxcfb_damage_ctx*                ctx;
+	struct list_head                 node;          // In the context's reader_list
+	mxcfb_damage_ring_cursor*        cursor;        // Mapped read-write in userspace, our tail lives here
+	atomic_t                         overflows;     // Events dropped by the producer since our last read
+	int                              policy;        // Set via FBDAMAGE_SET_OVERFLOW_POLICY
+	uint32_t                         timeout_us;    // Only for DAMAGE_OVERFLOW_BLOCK
+	uint32_t                         events;        // mxcfb_damage_event_mask, via FBDAMAGE_SET_EVENTS, under lock
+	bool                             snapshots;     // Set via FBDAMAGE_SET_SNAPSHOTS, under lock
+	// Set via FBDAMAGE_SET_FILTER, under lock (and RCU, since the producers look at it), NULL when not filtering
+	const mxcfb_damage_filter __rcu* filter;
+	atomic_t                         filtered;      // Events rejected by the filter since FBDAMAGE_FETCH_FILTERED
+	spinlock_t                       lost_lock;     // Protects lost, which the producers feed
+	mxcfb_damage_lost                lost;          // Only kept track of with DAMAGE_EVENT_OVERFLOW
+	wait_queue_head_t                wait;          // Where read & poll wait for new damage
+	struct mutex                     lock;          // Serializes concurrent reads on the same file
+	// Coalescing mode (c.f., FBDAMAGE_SET_COALESCING), fed directly by the producer instead of the ring
+	spinlock_t                       coalesce_lock;     // Protects everything below
+	mxcfb_damage_event*              rects;             // Twice DAMAGE_COALESCE_MAX_RECTS, the 2nd half is for read
+	uint32_t                         nrects;
+	uint32_t                         max_rects;         // 0 when not coalescing
+	uint32_t                         coalesce_flags;    // mxcfb_damage_coalesce_flags
+	// Tile tracking (c.f., FBDAMAGE_SET_TILES), fed directly by the producer, too
+	spinlock_t                       tiles_lock;        // Protects everything below
+	uint32_t*                        tiles;             // The live bitmap, followed by a scratch copy
+	uint32_t                         tile_shift;        // log2 of the tile size, 0 when not tracking
+	uint32_t                         tile_cols;
+	uint32_t                         tile_rows;
+	uint32_t                         tile_words;        // Size of the bitmap, in 32-bit words
+	bool                             tile_hashing;      // Set via FBDAMAGE_SET_TILE_HASHING, under lock
+	// Set via FBDAMAGE_SET_RECORD_FORMAT, under lock
+	uint32_t                         record_version;    // mxcfb_damage_record_version
+	uint32_t                         record_size;       // i.e., the stride of read()
+	// Wakeup moderation (c.f., FBDAMAGE_SET_WAKEUP)
+	spinlock_t                       wake_lock;         // Protects burst_start, wake_pending & the timer
+	bool                             moderated;
+	bool                             wake_ready;        // Set once the burst warrants a wakeup, cleared once drained
+	uint32_t                         wake_threshold;
+	u64                              wake_quiet_ns;
+	u64                              wake_deadline_ns;
+	u64                              burst_start;       // Timestamp of the first event of the burst, 0 if none
+	uint32_t                         wake_pending;      // Records of the burst the reader actually wants to see
+	struct hrtimer                   wake_timer;
+} mxcfb_damage_reader;
+
+// How long a DAMAGE_OVERFLOW_BLOCK producer may wait for its readers to make some room
+#define DMG_MAX_BLOCK_US USEC_PER_SEC
+// Wakeup moderation is about milliseconds, not minutes
+#define DMG_MAX_WAKEUP_US (10U * USEC_PER_SEC)
+
+static bool
+    damage_reader_room(const mxcfb_damage_reader* reader, uint32_t head)
+{
+	const mxcfb_damage_ctx* ctx = reader->ctx;
+
+	// NOTE: The tail may have been written by userspace via mmap, but since the indices are free-running,
+	//       a bogus one can only ever make the ring look full, which only hurts the reader that wrote it
+	//       (unless it opted into backpressure, in which case it's on them).
+	return head - damage_read_once(reader->cursor->tail) < ctx->circ.size;
+}
+
+// Amount of records waiting to be read
+static uint32_t
+    damage_reader_queued(const mxcfb_damage_reader* reader)
+{
+	const mxcfb_damage_ctx* ctx = reader->ctx;
+
+	if (damage_read_once(reader->max_rects)) {
+		return damage_read_once(reader->nrects);
+	}
+	return damage_ring_queued(&ctx->circ, damage_read_once(reader->cursor->tail));
+}
+
+// Returns true if a reader that opted into backpressure doesn't have room for the record at head,
+// in which case timeout is set to how long we're allowed to wait for it (0 meaning not at all).
+static bool
+    damage_circ_full(mxcfb_damage_ctx* ctx, uint32_t head, uint32_t* timeout)
+{
+	const mxcfb_damage_reader* reader;
+	bool                       full = false;
+	uint32_t                   wait = DMG_MAX_BLOCK_US;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(reader, &ctx->reader_list, node)
+	{
+		const int policy = damage_read_once(reader->policy);
+
+		// The default: a slow reader will notice that it's been lapped, and skip ahead.
+		// (Coalescing readers don't consume the ring at all).
+		if (policy == DAMAGE_OVERFLOW_OVERWRITE_OLDEST || damage_read_once(reader->max_rects) ||
+		    damage_reader_room(reader, head)) {
+			continue;
+		}
+		full = true;
+		if (policy == DAMAGE_OVERFLOW_BLOCK) {
+			// Don't stall the producer for longer than *any* of the blocked readers asked for
+			wait = min_t(uint32_t, wait, damage_read_once(reader->timeout_us));
 		} else {
-			copy_failure = true;
+			wait = 0U;
 		}
+	}
+	rcu_read_unlock();
 
-		// NOTE: This is why we needed to get at the data outside of the circ buffer space check:
-		//       to keep the sysfs attribute up to date even after an overflow ;).
-		if (!copy_failure) {
-			g2d_rota = rotate;
-		}
-#else
-static int
-    fb_ioctl(struct fb_info* info, unsigned int cmd, unsigned long arg)
+	if (timeout) {
+		*timeout = wait;
+	}
+	return full;
+}
+
+// Returns true if the record at head can be written, according to the readers' overflow policies
+static bool
+    damage_circ_reserve(mxcfb_damage_ctx* ctx, uint32_t head)
 {
-	int head, tail;
-	int ret = orig_fb_ioctl(info, cmd, arg);
+	uint32_t timeout;
 
-	if (cmd == MXCFB_SEND_UPDATE_V1_NTX || cmd == MXCFB_SEND_UPDATE_V1 || cmd == MXCFB_SEND_UPDATE_V2) {
-#endif
-		/* The fb_ioctl() is called with the fb_info mutex held, so there is no need for additional locking here */
-		head = damage_circ.head;
-		/* Said locking provide the needed ordering. */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
-		tail = READ_ONCE(damage_circ.tail);
+	if (!damage_circ_full(ctx, head, &timeout)) {
+		return true;
+	}
+	if (timeout == 0U) {
+		return false;
+	}
+
+	// NOTE: mmap consumers don't wake us up when they release their tail, so we'll just time out.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+	wait_event_interruptible_hrtimeout(
+	    ctx->space_queue, !damage_circ_full(ctx, head, NULL), ns_to_ktime((u64) timeout * NSEC_PER_USEC));
 #else
-		tail = ACCESS_ONCE(damage_circ.tail);
+	wait_event_interruptible_timeout(ctx->space_queue, !damage_circ_full(ctx, head, NULL), usecs_to_jiffies(timeout));
 #endif
-		if (CIRC_SPACE(head, tail, DMG_BUF_SIZE) >= 1) {
-			/* insert one item into the buffer */
-
-			// Start with a timestamp, in a way that evacuates most of the 64-bit ktime_t compat concerns...
-			// (There's only a minor s64 vs. u64 change, which should be mostly irrelevant here).
-			damage_circ.buffer[head].timestamp = ktime_to_ns(ktime_get());
-
-#ifdef CONFIG_ARCH_SUNXI
-			if (cmd == DISP_EINK_UPDATE2) {
-				if (copy_failure) {
-					damage_circ.buffer[head].format = DAMAGE_UPDATE_DATA_ERROR;
-				} else {
-					damage_circ.buffer[head].format = DAMAGE_UPDATE_DATA_SUNXI_KOBO_DISP2;
-
-					damage_circ.buffer[head].data.update_region.top  = area.y_top;
-					damage_circ.buffer[head].data.update_region.left = area.x_top;
-					damage_circ.buffer[head].data.update_region.width =
-					    area.x_bottom - area.x_top + 1;
-					damage_circ.buffer[head].data.update_region.height =
-					    area.y_bottom - area.y_top + 1;
-
-					damage_circ.buffer[head].data.waveform_mode =
-					    GET_UPDATE_MODE(ioc_data.update2.update_mode) & ~EINK_PARTIAL_MODE;
-					if (IS_PARTIAL_UPDATE(ioc_data.update2.update_mode)) {
-						damage_circ.buffer[head].data.update_mode = 0;    // UPDATE_MODE_PARTIAL
-					} else {
-						damage_circ.buffer[head].data.update_mode = 1;    // UPDATE_MODE_FULL
-					}
+	return !damage_circ_full(ctx, head, NULL);
+}
 
-					damage_circ.buffer[head].data.update_marker = frame_id;
+// Increments a plain u32 that may be bumped by several producers at once
+// (i.e., one that lives in a page shared with userspace, where an atomic_t has no business being).
+static void
+    damage_inc_u32(uint32_t* p)
+{
+	uint32_t old;
 
-					damage_circ.buffer[head].data.flags =
-					    GET_UPDATE_INFO(ioc_data.update2.update_mode);
+	do {
+		old = damage_read_once(*p);
+	} while (cmpxchg(p, old, old + 1U) != old);
+}
 
-					damage_circ.buffer[head].data.rotate = rotate;
+// Whether a reader asked for records of that format (c.f., FBDAMAGE_SET_EVENTS)
+static bool
+    damage_event_wanted(uint32_t events, mxcfb_damage_data_format format)
+{
+	switch (format) {
+		case DAMAGE_UPDATE_DATA_COMPLETION:
+			return events & DAMAGE_EVENT_COMPLETION;
+		case DAMAGE_UPDATE_DATA_GEOMETRY:
+			return events & DAMAGE_EVENT_GEOMETRY;
+		default:
+			return events & DAMAGE_EVENT_REFRESH;
+	}
+}
 
-					damage_circ.buffer[head].data.pen_mode = pen_mode;
-				}
-#else
-			if (cmd == MXCFB_SEND_UPDATE_V1_NTX) {
-				struct mxcfb_update_data_v1_ntx v1_ntx;
-				if (!copy_from_user(&v1_ntx, (void __user*) arg, sizeof(v1_ntx))) {
-					damage_circ.buffer[head].format = DAMAGE_UPDATE_DATA_V1_NTX;
-
-					// Take a shortcut as the layouts match up to the source's alt_buffer_data
-					memcpy(&damage_circ.buffer[head].data,
-					       &v1_ntx,
-					       offsetof(__typeof__(v1_ntx), alt_buffer_data));
-
-					// V2 only
-					damage_circ.buffer[head].data.dither_mode = 0;
-					damage_circ.buffer[head].data.quant_bit   = 0;
-
-					memcpy(&damage_circ.buffer[head].data.alt_buffer_data,
-					       &v1_ntx.alt_buffer_data,
-					       sizeof(v1_ntx.alt_buffer_data));
-				} else {
-					damage_circ.buffer[head].format = DAMAGE_UPDATE_DATA_ERROR;
-				}
-			} else if (cmd == MXCFB_SEND_UPDATE_V1) {
-				// No void *virt_addr in alt_buffer_data
-				struct mxcfb_update_data_v1 v1;
-				if (!copy_from_user(&v1, (void __user*) arg, sizeof(v1))) {
-					damage_circ.buffer[head].format = DAMAGE_UPDATE_DATA_V1;
-
-					memcpy(&damage_circ.buffer[head].data,
-					       &v1,
-					       offsetof(__typeof__(v1), alt_buffer_data));
-
-					// V2 only
-					damage_circ.buffer[head].data.dither_mode = 0;
-					damage_circ.buffer[head].data.quant_bit   = 0;
-
-					// V1 NTX only
-					damage_circ.buffer[head].data.alt_buffer_data.virt_addr = NULL;
-
-					// Take a shortcut as the layouts match starting from the target's alt_buffer_data.phys_addr
-					memcpy(&damage_circ.buffer[head].data.alt_buffer_data.phys_addr,
-					       &v1.alt_buffer_data,
-					       sizeof(v1.alt_buffer_data));
-				} else {
-					damage_circ.buffer[head].format = DAMAGE_UPDATE_DATA_ERROR;
-				}
-			} else if (cmd == MXCFB_SEND_UPDATE_V2) {
-				// No void *virt_addr in alt_buffer_data
-				// int dither_mode & int quant_bit before alt_buffer_data
-				struct mxcfb_update_data v2;
+// Whether the record is an actual refresh request (i.e., something that damages the screen, wherever that is)
+static bool
+    damage_is_refresh(mxcfb_damage_data_format format)
+{
+	return format != DAMAGE_UPDATE_DATA_COMPLETION && format != DAMAGE_UPDATE_DATA_GEOMETRY;
+}
 
-				if (!copy_from_user(&v2, (void __user*) arg, sizeof(v2))) {
-					damage_circ.buffer[head].format = DAMAGE_UPDATE_DATA_V2;
+// NOTE: Unlike damage_rect_touches, edges don't count
+static bool
+    damage_rect_intersects(const mxcfb_damage_rect* a, const mxcfb_damage_rect* b)
+{
+	return a->left < b->left + b->width && b->left < a->left + a->width && a->top < b->top + b->height &&
+	       b->top < a->top + a->height;
+}
 
-					memcpy(&damage_circ.buffer[head].data,
-					       &v2,
-					       offsetof(__typeof__(v2), alt_buffer_data));
+static bool
+    damage_filter_match(const mxcfb_damage_filter* filter, const mxcfb_damage_update* update)
+{
+	const mxcfb_damage_rect* rect = &update->data.update_region;
+	uint32_t                 i;
 
-					// V1 NTX only
-					damage_circ.buffer[head].data.alt_buffer_data.virt_addr = NULL;
+	// That damage could be anywhere (and a layout change affects everything)
+	if (update->format == DAMAGE_UPDATE_DATA_UNKNOWN || update->format == DAMAGE_UPDATE_DATA_ERROR ||
+	    update->format == DAMAGE_UPDATE_DATA_GEOMETRY) {
+		return true;
+	}
 
-					memcpy(&damage_circ.buffer[head].data.alt_buffer_data.phys_addr,
-					       &v2.alt_buffer_data,
-					       sizeof(v2.alt_buffer_data));
-				} else {
-					damage_circ.buffer[head].format = DAMAGE_UPDATE_DATA_ERROR;
-				}
-#endif
-			} else {
-				damage_circ.buffer[head].format = DAMAGE_UPDATE_DATA_UNKNOWN;
+	if (filter->update_modes &&
+	    (update->data.update_mode >= 32U || !(filter->update_modes & (1U << update->data.update_mode)))) {
+		return false;
+	}
+	if (filter->min_area && (u64) rect->width * rect->height < filter->min_area) {
+		return false;
+	}
+	if ((update->data.flags & filter->flags_mask) != filter->flags_value) {
+		return false;
+	}
+	if (filter->nwaveforms) {
+		for (i = 0U; i < filter->nwaveforms; i++) {
+			if (filter->waveform_modes[i] == update->data.waveform_mode) {
+				break;
 			}
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
-			smp_store_release(&damage_circ.head, (head + 1) & (DMG_BUF_SIZE - 1));
-#else
-			smp_wmb(); /* commit the item before incrementing the head */
-			ACCESS_ONCE(damage_circ.head) = (head + 1) & (DMG_BUF_SIZE - 1);
-#endif
-		} else {
-			atomic_inc(&overflows);
 		}
-		/* wake_up() will make sure that the head is committed before waking anyone up */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
-		wake_up_interruptible_poll(&listen_queue, EPOLLIN | EPOLLRDNORM);
-#else
-		wake_up_interruptible_poll(&listen_queue, POLLIN | POLLRDNORM);
-#endif
-#ifdef CONFIG_ARCH_SUNXI
-		mutex_unlock(&producer_lock);
-#endif
+		if (i == filter->nwaveforms) {
+			return false;
+		}
 	}
-	return ret;
+	if (filter->nrects) {
+		for (i = 0U; i < filter->nrects; i++) {
+			if (damage_rect_intersects(&filter->rects[i], rect)) {
+				return true;
+			}
+		}
+		return false;
+	}
+	return true;
 }
 
-static atomic_t readers = ATOMIC_INIT(0);
+// Whether the update goes through the reader's filter (c.f., FBDAMAGE_SET_FILTER)
+static bool
+    damage_reader_filter(const mxcfb_damage_reader* reader, const mxcfb_damage_update* update)
+{
+	const mxcfb_damage_filter* filter;
+	bool                       match;
+
+	rcu_read_lock();
+	filter = rcu_dereference(reader->filter);
+	match  = !filter || damage_filter_match(filter, update);
+	rcu_read_unlock();
+	return match;
+}
 
-static int
-    fbdamage_open(struct inode* inode, struct file* file)
+// Whether the reader wants that record at all (c.f., FBDAMAGE_SET_EVENTS & FBDAMAGE_SET_FILTER)
+static bool
+    damage_reader_wants(const mxcfb_damage_reader* reader, const mxcfb_damage_update* update)
+{
+	return damage_event_wanted(damage_read_once(reader->events), update->format) &&
+	       damage_reader_filter(reader, update);
+}
+
+// Sets len bits starting at bit start (c.f., bitmap_set, but with a fixed 32-bit word size, since this is ABI)
+static void
+    damage_bitmap_set(uint32_t* map, uint32_t start, uint32_t len)
 {
-	if (atomic_xchg(&readers, 1)) {
-		// We're already open'ed by something!
-		return -EBUSY;
+	uint32_t* p    = map + (start >> 5U);
+	uint32_t  bits = 32U - (start & 31U);
+	uint32_t  mask = ~0U << (start & 31U);
+
+	while (len >= bits) {
+		*p++ |= mask;
+		len -= bits;
+		bits = 32U;
+		mask = ~0U;
+	}
+	if (len) {
+		mask &= ~0U >> (32U - ((start + len) & 31U));
+		*p |= mask;
 	}
-	return 0;
 }
 
+// Returns the current screen dimensions, which is the coordinate space of the update regions
 static int
-    fbdamage_release(struct inode* inode, struct file* file)
+    damage_fb_geometry(const mxcfb_damage_ctx* ctx, uint32_t* xres, uint32_t* yres)
 {
-	atomic_xchg(&readers, 0);
+	// NOTE: On sunxi, disp2 still registers a plain framebuffer for the primary screen (i.e., fb0),
+	//       which is all we need here
+	const struct fb_info* info = damage_fb_info(ctx->fbnode);
+
+	if (!info || info->var.xres == 0U || info->var.yres == 0U) {
+		return -ENODEV;
+	}
+	*xres = info->var.xres;
+	*yres = info->var.yres;
 	return 0;
 }
 
-static ssize_t
-    fbdamage_read(struct file* file, char __user* buffer, size_t count, loff_t* ppos)
+// Whether the update has a region to mark tiles in (i.e., it's a refresh request, and we have its data)
+static bool
+    damage_tile_region(const mxcfb_damage_update* update)
 {
-	int head, tail;
-	if (count < sizeof(mxcfb_damage_update)) {
-		return -EINVAL;
+	return update->format != DAMAGE_UPDATE_DATA_UNKNOWN && update->format != DAMAGE_UPDATE_DATA_ERROR &&
+	       damage_is_refresh(update->format) && update->data.update_region.width != 0U &&
+	       update->data.update_region.height != 0U;
+}
+
+#ifndef CONFIG_ARCH_SUNXI
+// Hashes what's in the framebuffer in tile (col, row), returns false if we can't tell
+static bool
+    damage_tile_hash(const struct fb_info* info, uint32_t shift, uint32_t col, uint32_t row, uint32_t* hash)
+{
+	const uint32_t left = col << shift;
+	const uint32_t top  = row << shift;
+	uint32_t       bytes, width, height, stride, y;
+	unsigned long  src;
+	uint32_t       crc = ~0U;
+
+	// Same constraints as damage_pixels_snapshot
+	if (!info || !info->screen_base || info->var.bits_per_pixel == 0U || info->var.bits_per_pixel % 8U ||
+	    left >= info->var.xres || top >= info->var.yres) {
+		return false;
+	}
+	bytes  = info->var.bits_per_pixel / 8U;
+	width  = min(1U << shift, info->var.xres - left);
+	height = min(1U << shift, info->var.yres - top);
+	stride = width * bytes;
+	src    = (unsigned long) (info->var.yoffset + top) * info->fix.line_length +
+	      (unsigned long) (info->var.xoffset + left) * bytes;
+	if (src + (unsigned long) (height - 1U) * info->fix.line_length + stride > info->fix.smem_len) {
+		return false;
 	}
-	/* no need for locks, since we only allow one reader */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
-	/* read index before reading contents at that index */
-	head = smp_load_acquire(&damage_circ.head);
-#else
-	head = ACCESS_ONCE(damage_circ.head);
-#endif
-	tail = damage_circ.tail;
-	while (!CIRC_CNT(head, tail, DMG_BUF_SIZE)) {
-		// If the ring buffer is currently empty, wait for fb_ioctl to wake us up,
-		// (at which point we'll be guaranteed to have something to read).
 
-		if (file->f_flags & O_NONBLOCK) {
-			// Except if we were open'ed in non-blocking mode, of course...
-			return -EAGAIN;
+	// NOTE: The framebuffer is plain memory on every driver we care about (mxc's is DMA memory, vfb's is vmalloc'ed),
+	//       so it's hashed in place, instead of being bounced through memcpy_fromio first.
+	for (y = 0U; y < height; y++) {
+		crc = crc32_le(crc, (const unsigned char __force*) info->screen_base + src, stride);
+		src += info->fix.line_length;
+	}
+	*hash = crc;
+	return true;
+}
+
+// Hashes every tile of the shared grid, so that hashing only reports what changed from now on
+static mxcfb_damage_tile_hashes*
+    damage_tile_baseline(mxcfb_damage_ctx* ctx, uint32_t xres, uint32_t yres)
+{
+	const struct fb_info*     info  = damage_fb_info(ctx->fbnode);
+	// Nothing has changed yet
+	const uint32_t            event = (uint32_t) atomic_read(&ctx->event_seq) - 1U;
+	mxcfb_damage_tile_hashes* table = kzalloc(sizeof(*table), GFP_KERNEL);
+	uint32_t                  col, row, n;
+
+	if (!table) {
+		return NULL;
+	}
+	table->cols   = DIV_ROUND_UP(xres, 1U << DMG_HASH_SHIFT);
+	table->rows   = DIV_ROUND_UP(yres, 1U << DMG_HASH_SHIFT);
+	// The hashes, followed by the stamps
+	table->hashes = vzalloc(2U * sizeof(*table->hashes) * table->cols * table->rows);
+	if (!table->hashes) {
+		kfree(table);
+		return NULL;
+	}
+	table->stamps = table->hashes + table->cols * table->rows;
+	for (row = 0U; row < table->rows; row++) {
+		for (col = 0U; col < table->cols; col++) {
+			n = row * table->cols + col;
+			damage_tile_hash(info, DMG_HASH_SHIFT, col, row, &table->hashes[n]);
+			table->stamps[n] = event;
 		}
+	}
+	return table;
+}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
-		if (wait_event_interruptible(
-			listen_queue, (CIRC_CNT(smp_load_acquire(&damage_circ.head), damage_circ.tail, DMG_BUF_SIZE)))) {
-#else
-		if (wait_event_interruptible(listen_queue,
-					     (CIRC_CNT(ACCESS_ONCE(damage_circ.head), damage_circ.tail, DMG_BUF_SIZE)))) {
-#endif
-			return -ERESTARTSYS;
+// Takes a reference on the shared hashes (taking the baseline if we're the first hashing reader)
+static int
+    damage_tile_hashing_get(mxcfb_damage_ctx* ctx)
+{
+	mxcfb_damage_tile_hashes* table;
+	uint32_t                  xres, yres;
+	int                       ret = 0;
+
+	mutex_lock(&ctx->reader_list_lock);
+	if (ctx->hashing_readers == 0U) {
+		if (!(ret = damage_fb_geometry(ctx, &xres, &yres))) {
+			table = damage_tile_baseline(ctx, xres, yres);
+			if (table) {
+				rcu_assign_pointer(ctx->tile_hashes, table);
+			} else {
+				ret = -ENOMEM;
+			}
 		}
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
-		head = smp_load_acquire(&damage_circ.head);
-#else
-		head = ACCESS_ONCE(damage_circ.head);
-#endif
-		tail = damage_circ.tail;
 	}
+	if (!ret) {
+		ctx->hashing_readers++;
+	}
+	mutex_unlock(&ctx->reader_list_lock);
+	return ret;
+}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-	/* read index before reading contents at that index */
-	smp_rmb();
-#endif
+static void
+    damage_tile_hashing_put(mxcfb_damage_ctx* ctx)
+{
+	mxcfb_damage_tile_hashes* table = NULL;
 
-	/* extract one item from the buffer */
-	damage_circ.buffer[tail].overflow_notify = atomic_xchg(&overflows, 0);
-	// Allows the reader to know if they're late consuming the buffer or not...
-	damage_circ.buffer[tail].queue_size      = CIRC_CNT(head, tail, DMG_BUF_SIZE);
-	if (copy_to_user(buffer, &damage_circ.buffer[tail], sizeof(mxcfb_damage_update))) {
-		return -EFAULT;
+	mutex_lock(&ctx->reader_list_lock);
+	if (--ctx->hashing_readers == 0U) {
+		table = rcu_dereference_protected(ctx->tile_hashes, lockdep_is_held(&ctx->reader_list_lock));
+		RCU_INIT_POINTER(ctx->tile_hashes, NULL);
+	}
+	mutex_unlock(&ctx->reader_list_lock);
+	if (table) {
+		// Make sure the producers are done looking at it
+		synchronize_rcu();
+		vfree(table->hashes);
+		kfree(table);
 	}
-	/* Finish reading descriptor before incrementing tail. */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
-	smp_store_release(&damage_circ.tail, (tail + 1) & (DMG_BUF_SIZE - 1));
-#else
-	smp_mb(); /* finish reading descriptor before incrementing tail */
-	ACCESS_ONCE(damage_circ.tail) = (tail + 1) & (DMG_BUF_SIZE - 1);
-#endif
-	return sizeof(mxcfb_damage_update);
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
-static __poll_t
-#else
-static unsigned int
-#endif
-    fbdamage_poll(struct file* file, poll_table* wait)
+// Hashes every tile (of the shared grid) the event touches, once, no matter how many readers want it,
+// and stamps the ones whose content changed with the event (c.f., damage_tile_changed).
+// Returns false if we can't vouch for any of it, in which case the whole region is dirty.
+static bool
+    damage_tile_rehash(mxcfb_damage_ctx*               ctx,
+		       const mxcfb_damage_tile_hashes* table,
+		       uint32_t                        event,
+		       const mxcfb_damage_update*      update)
 {
-	int head, tail;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
-	__poll_t mask = 0;
-#else
-	unsigned int mask = 0;
-#endif
+	const struct fb_info*    info = damage_fb_info(ctx->fbnode);
+	const mxcfb_damage_rect* rect = &update->data.update_region;
+	uint32_t                 c0, c1, r0, r1, col, row, n, hash;
 
-	/* no need for locks, since we only allow one reader */
-	poll_wait(file, &listen_queue, wait);
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
-	/* read index before reading contents at that index */
-	head = smp_load_acquire(&damage_circ.head);
-#else
-	head              = ACCESS_ONCE(damage_circ.head);
-#endif
-	tail = damage_circ.tail;
-	if (CIRC_CNT(head, tail, DMG_BUF_SIZE) >= 1) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
-		mask = EPOLLIN | EPOLLRDNORM;
-#else
-                mask = POLLIN | POLLRDNORM;
-#endif
+	// Alt buffer updates bypass the framebuffer
+	if (update->data.flags & EPDC_FLAG_USE_ALT_BUFFER) {
+		return false;
 	}
-
-	return mask;
+	c0 = rect->left >> DMG_HASH_SHIFT;
+	r0 = rect->top >> DMG_HASH_SHIFT;
+	c1 = min_t(uint32_t, (rect->left + rect->width - 1U) >> DMG_HASH_SHIFT, table->cols - 1U);
+	r1 = min_t(uint32_t, (rect->top + rect->height - 1U) >> DMG_HASH_SHIFT, table->rows - 1U);
+	for (row = r0; c0 <= c1 && row <= r1; row++) {
+		for (col = c0; col <= c1; col++) {
+			n = row * table->cols + col;
+			// NOTE: Other producers may be hashing the same tile, hence the xchg:
+			//       whoever actually changes it stamps it, and then marks it for its own readers.
+			if (!damage_tile_hash(info, DMG_HASH_SHIFT, col, row, &hash) ||
+			    xchg(&table->hashes[n], hash) != hash) {
+				damage_write_once(table->stamps[n], event);
+			}
+		}
+	}
+	return true;
 }
 
-static dev_t                        dev;
-static struct class*                fbdamage_class;
-static struct device*               fbdamage_device;
-static struct cdev                  cdev;
-static const struct file_operations fbdamage_fops = { .owner   = THIS_MODULE,
-						      .open    = fbdamage_open,
-						      .read    = fbdamage_read,
-						      .release = fbdamage_release,
-						      .poll    = fbdamage_poll };
-
-#ifdef CONFIG_ARCH_SUNXI
-static ssize_t
-    rotate_show(struct device* dev, struct device_attribute* attr, char* buf)
+// Whether the event changed anything in the reader's tile (col, row) of (1 << shift) px,
+// i.e., in the tiles of the shared grid that are both in there, and in the update's region.
+static bool
+    damage_tile_changed(const mxcfb_damage_tile_hashes* table,
+			uint32_t                        event,
+			const mxcfb_damage_rect*        rect,
+			uint32_t                        shift,
+			uint32_t                        col,
+			uint32_t                        row)
 {
-	return scnprintf(buf, PAGE_SIZE, "%u\n", g2d_rota);
+	const uint32_t ratio = shift - DMG_HASH_SHIFT;
+	const uint32_t c0    = max(col << ratio, rect->left >> DMG_HASH_SHIFT);
+	const uint32_t c1    = min(((col + 1U) << ratio) - 1U, (rect->left + rect->width - 1U) >> DMG_HASH_SHIFT);
+	const uint32_t r0    = max(row << ratio, rect->top >> DMG_HASH_SHIFT);
+	const uint32_t r1    = min(((row + 1U) << ratio) - 1U, (rect->top + rect->height - 1U) >> DMG_HASH_SHIFT);
+	uint32_t       c, r;
+
+	// The baseline was taken at a different resolution, so we can't vouch for that part
+	if (c1 >= table->cols || r1 >= table->rows) {
+		return true;
+	}
+	for (r = r0; r <= r1; r++) {
+		for (c = c0; c <= c1; c++) {
+			if (damage_read_once(table->stamps[r * table->cols + c]) == event) {
+				return true;
+			}
+		}
+	}
+	return false;
 }
-
-static struct device_attribute dev_attr_rotate = __ATTR_RO(rotate);
 #endif
 
-int
-    init_module(void)
+// Marks every tile touched by the update's region
+// (with hashing, only the ones whose content changed, which damage_tile_rehash already figured out, if table is set).
+static void
+    damage_reader_mark_tiles(mxcfb_damage_reader*            reader,
+			     uint32_t                        event,
+			     const mxcfb_damage_update*      update,
+			     const mxcfb_damage_tile_hashes* table)
 {
-	int ret;
-#ifdef CONFIG_ARCH_SUNXI
-	struct file* fp;
+	const mxcfb_damage_rect* rect = &update->data.update_region;
+	uint32_t                 c0, c1, r0, r1, row;
+#ifndef CONFIG_ARCH_SUNXI
+	uint32_t                 col, n;
+#endif
 
-	// NOTE: Since FW 4.31.19086, this may block significantly longer than it used to during early boot,
-	//       which may introduce race conditions if the module is loaded in parallel to the disp client(s)
-	//       you want to sniff...
-	//       In fact, it may completely deadlock: do *NOT* try to insert this module in a way that would block rcS!
-	fp = filp_open("/dev/disp", O_RDONLY, 0);
-	if (IS_ERR(fp)) {
-		pr_err("mxc_epdc_fb_damage: cannot open: `/dev/disp`\n");
-		return -ENODEV;
+	// Nothing to mark if we don't have a region (or if it's already been marked, at submission time)
+	if (!damage_tile_region(update)) {
+		return;
 	}
 
-	disp_cdev = fp->f_inode->i_cdev;
-
-	filp_close(fp, NULL);
-#else
-	if (!registered_fb[fbnode]) {
-		return -ENODEV;
-	}
+	// NOTE: This only ever compares stamps, the hashing itself happens outside of any reader's lock
+	spin_lock(&reader->tiles_lock);
+	if (reader->tile_shift) {
+		// Clip to the grid (in tiles, inclusive)
+		c0 = rect->left >> reader->tile_shift;
+		r0 = rect->top >> reader->tile_shift;
+		c1 = min_t(uint32_t, (rect->left + rect->width - 1U) >> reader->tile_shift, reader->tile_cols - 1U);
+		r1 = min_t(uint32_t, (rect->top + rect->height - 1U) >> reader->tile_shift, reader->tile_rows - 1U);
+		for (row = r0; c0 <= c1 && row <= r1; row++) {
+#ifndef CONFIG_ARCH_SUNXI
+			if (table && damage_read_once(reader->tile_hashing)) {
+				for (col = c0; col <= c1; col++) {
+					n = row * reader->tile_cols + col;
+					if (damage_tile_changed(table, event, rect, reader->tile_shift, col, row)) {
+						reader->tiles[n >> 5U] |= 1U << (n & 31U);
+					}
+				}
+				continue;
+			}
 #endif
-
-	if ((ret = alloc_chrdev_region(&dev, 0, 1, "mxc_epdc_fb_damage"))) {
-		return ret;
-	}
-	cdev_init(&cdev, &fbdamage_fops);
-	cdev.owner = THIS_MODULE;
-	if ((ret = cdev_add(&cdev, dev, 1) < 0)) {
-		unregister_chrdev_region(dev, 1);
-		return ret;
+			damage_bitmap_set(reader->tiles, row * reader->tile_cols + c0, c1 - c0 + 1U);
+		}
 	}
+	spin_unlock(&reader->tiles_lock);
+}
+
+// NOTE: Touching edges count, too, so that typing & pen strokes collapse nicely
+static bool
+    damage_rect_touches(const mxcfb_damage_rect* a, const mxcfb_damage_rect* b)
+{
+	return a->left <= b->left + b->width && b->left <= a->left + a->width && a->top <= b->top + b->height &&
+	       b->top <= a->top + a->height;
+}
+
+static void
+    damage_rect_union(mxcfb_damage_rect* a, const mxcfb_damage_rect* b)
+{
+	const uint32_t right  = max(a->left + a->width, b->left + b->width);
+	const uint32_t bottom = max(a->top + a->height, b->top + b->height);
+
+	a->left   = min(a->left, b->left);
+	a->top    = min(a->top, b->top);
+	a->width  = right - a->left;
+	a->height = bottom - a->top;
+}
+
+static bool
+    damage_coalesce_key_match(uint32_t flags, const mxcfb_damage_update* a, const mxcfb_damage_update* b)
+{
+	if ((flags & DAMAGE_COALESCE_BY_WAVEFORM) && a->data.waveform_mode != b->data.waveform_mode) {
+		return false;
+	}
+	if ((flags & DAMAGE_COALESCE_BY_UPDATE_MODE) && a->data.update_mode != b->data.update_mode) {
+		return false;
+	}
+	return true;
+}
+
+// Adds a rectangle to the reader's list, swallowing every one it touches, under coalesce_lock.
+// NOTE: Everything but the region is inherited from the latest event (which isn't necessarily merged,
+//       c.f., fbdamage_drain_coalesced).
+static void
+    damage_reader_fold(mxcfb_damage_reader* reader, mxcfb_damage_event* merged)
+{
+	mxcfb_damage_rect region;
+	uint32_t          i;
+
+	// Swallow every rectangle we touch, and start over each time, since the merged one keeps growing.
+	i = 0U;
+	while (i < reader->nrects) {
+		mxcfb_damage_event* rect = &reader->rects[i];
+
+		if (damage_coalesce_key_match(reader->coalesce_flags, &rect->update, &merged->update) &&
+		    damage_rect_touches(&rect->update.data.update_region, &merged->update.data.update_region)) {
+			region = merged->update.data.update_region;
+			damage_rect_union(&region, &rect->update.data.update_region);
+			if ((int32_t) (rect->event - merged->event) > 0) {
+				*merged = *rect;
+			}
+			merged->update.data.update_region = region;
+			// Plug the hole with the last one
+			*rect = reader->rects[--reader->nrects];
+			i     = 0U;
+		} else {
+			i++;
+		}
+	}
+
+	// Past the limit, collapse everything into a single bounding box
+	if (reader->nrects == reader->max_rects) {
+		for (i = 0U; i < reader->nrects; i++) {
+			region = merged->update.data.update_region;
+			damage_rect_union(&region, &reader->rects[i].update.data.update_region);
+			if ((int32_t) (reader->rects[i].event - merged->event) > 0) {
+				*merged = reader->rects[i];
+			}
+			merged->update.data.update_region = region;
+		}
+		reader->nrects = 0U;
+	}
+	reader->rects[reader->nrects++] = *merged;
+}
+
+// Merges update into the reader's set of rectangles, returns true if the reader needs a wakeup
+// (i.e., if it previously had nothing to read).
+static bool
+    damage_reader_coalesce(mxcfb_damage_reader* reader, uint32_t event, const mxcfb_damage_update* update)
+{
+	mxcfb_damage_event merged = { .event = event, .update = *update };
+	bool               was_empty;
+
+	// Nothing to merge if we don't have a region (and completions & layout changes aren't damage)
+	if (update->format == DAMAGE_UPDATE_DATA_UNKNOWN || update->format == DAMAGE_UPDATE_DATA_ERROR ||
+	    !damage_is_refresh(update->format)) {
+		return false;
+	}
+
+	spin_lock(&reader->coalesce_lock);
+	if (reader->max_rects == 0U) {
+		// We've just switched back to the ring
+		spin_unlock(&reader->coalesce_lock);
+		return true;
+	}
+	was_empty = reader->nrects == 0U;
+	damage_reader_fold(reader, &merged);
+	spin_unlock(&reader->coalesce_lock);
+
+	return was_empty;
+}
+
+static void
+    damage_reader_wake(mxcfb_damage_reader* reader)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+	wake_up_interruptible_poll(&reader->wait, EPOLLIN | EPOLLRDNORM);
+#else
+	wake_up_interruptible_poll(&reader->wait, POLLIN | POLLRDNORM);
+#endif
+}
+
+static enum hrtimer_restart
+    damage_reader_wake_timer(struct hrtimer* timer)
+{
+	mxcfb_damage_reader* reader = container_of(timer, mxcfb_damage_reader, wake_timer);
+
+	damage_write_once(reader->wake_ready, true);
+	damage_reader_wake(reader);
+	return HRTIMER_NORESTART;
+}
+
+// Wakes the reader up right away if it has enough queued records,
+// otherwise (re)arms the timer for whichever comes first: the end of the burst, or its deadline.
+// NOTE: Only ever called for records that made it through the reader's filter & event mask (c.f., damage_circ_publish),
+//       the ring itself also holds everything everyone else wanted, which this reader is going to skip anyway.
+static void
+    damage_reader_moderate(mxcfb_damage_reader* reader)
+{
+	const u64 now     = ktime_to_ns(ktime_get());
+	u64       expires = 0U;
+	uint32_t  pending;
+
+	spin_lock(&reader->wake_lock);
+	reader->wake_pending++;
+	if (reader->wake_ready) {
+		// Already woken up, it just hasn't caught up yet
+		spin_unlock(&reader->wake_lock);
+		return;
+	}
+	// Coalesced rectangles are already only the ones the reader wanted (and they may have absorbed a few records)
+	pending = damage_read_once(reader->max_rects) ? damage_read_once(reader->nrects) : reader->wake_pending;
+	if (reader->wake_threshold && pending >= reader->wake_threshold) {
+		hrtimer_try_to_cancel(&reader->wake_timer);
+		damage_write_once(reader->wake_ready, true);
+		spin_unlock(&reader->wake_lock);
+		damage_reader_wake(reader);
+		return;
+	}
+
+	if (!reader->burst_start) {
+		reader->burst_start = now;
+	}
+	if (reader->wake_quiet_ns) {
+		expires = now + reader->wake_quiet_ns;
+	}
+	if (reader->wake_deadline_ns && (!expires || reader->burst_start + reader->wake_deadline_ns < expires)) {
+		expires = reader->burst_start + reader->wake_deadline_ns;
+	}
+	if (expires) {
+		hrtimer_start(&reader->wake_timer, ns_to_ktime(expires), HRTIMER_MODE_ABS);
+	}
+	spin_unlock(&reader->wake_lock);
+}
+
+// Folds a refresh request the reader is never going to see into the summary of what it lost
+static void
+    damage_reader_lose(mxcfb_damage_reader* reader, uint32_t event, const mxcfb_damage_update* update)
+{
+	mxcfb_damage_lost*       lost = &reader->lost;
+	const mxcfb_damage_rect* rect = &update->data.update_region;
+	const u64                area = (u64) rect->width * rect->height;
+	const bool               full = update->data.update_mode != 0U;
+
+	// Completions & layout changes don't damage anything
+	if (!damage_is_refresh(update->format)) {
+		return;
+	}
+
+	spin_lock(&reader->lost_lock);
+	lost->count++;
+	lost->event     = event;
+	lost->timestamp = update->timestamp;
+	if (update->format == DAMAGE_UPDATE_DATA_UNKNOWN || update->format == DAMAGE_UPDATE_DATA_ERROR) {
+		lost->everything = true;
+	} else if (!lost->has_region) {
+		lost->has_region    = true;
+		lost->region        = *rect;
+		lost->area          = area;
+		lost->waveform_mode = update->data.waveform_mode;
+		lost->update_mode   = update->data.update_mode;
+		lost->flags         = update->data.flags;
+	} else {
+		damage_rect_union(&lost->region, rect);
+		lost->flags |= update->data.flags;
+		if ((full && lost->update_mode == 0U) || (full == (lost->update_mode != 0U) && area >= lost->area)) {
+			lost->area          = area;
+			lost->waveform_mode = update->data.waveform_mode;
+			lost->update_mode   = update->data.update_mode;
+		}
+	}
+	spin_unlock(&reader->lost_lock);
+}
+
+// Hands over (and forgets) the summary of what the reader lost, as a DAMAGE_UPDATE_DATA_OVERFLOW record.
+// The raw summary is left in taken, so that it can be put back if that record never makes it out
+// (c.f., damage_reader_restore_lost). Returns false if it didn't lose anything.
+static bool
+    damage_reader_take_lost(mxcfb_damage_reader* reader,
+			    mxcfb_damage_lost*   taken,
+			    uint32_t*            event,
+			    mxcfb_damage_update* update)
+{
+	const mxcfb_damage_lost* lost = taken;
+	uint32_t                 xres, yres;
+
+	spin_lock(&reader->lost_lock);
+	*taken = reader->lost;
+	memset(&reader->lost, 0, sizeof(reader->lost));
+	spin_unlock(&reader->lost_lock);
+	if (lost->count == 0U) {
+		return false;
+	}
+
+	memset(update, 0, sizeof(*update));
+	update->format             = DAMAGE_UPDATE_DATA_OVERFLOW;
+	update->timestamp          = lost->timestamp;
+	update->data.waveform_mode = lost->waveform_mode;
+	update->data.update_mode   = lost->update_mode;
+	update->data.flags         = lost->flags;
+	if (lost->everything && !damage_fb_geometry(reader->ctx, &xres, &yres)) {
+		update->data.update_region.width  = xres;
+		update->data.update_region.height = yres;
+	} else {
+		update->data.update_region = lost->region;
+	}
+	*event = lost->event;
+	return true;
+}
+
+// Folds a summary damage_reader_take_lost handed over back into whatever the reader lost since then
+// (i.e., the one it took is older).
+static void
+    damage_reader_restore_lost(mxcfb_damage_reader* reader, const mxcfb_damage_lost* taken)
+{
+	mxcfb_damage_lost* lost = &reader->lost;
+	bool               full;
+
+	spin_lock(&reader->lost_lock);
+	if (lost->count == 0U) {
+		*lost = *taken;
+	} else {
+		lost->count += taken->count;
+		lost->everything |= taken->everything;
+		if (taken->has_region && !lost->has_region) {
+			lost->has_region    = true;
+			lost->region        = taken->region;
+			lost->area          = taken->area;
+			lost->waveform_mode = taken->waveform_mode;
+			lost->update_mode   = taken->update_mode;
+			lost->flags         = taken->flags;
+		} else if (taken->has_region) {
+			damage_rect_union(&lost->region, &taken->region);
+			lost->flags |= taken->flags;
+			// Same tie-break as damage_reader_lose, except that the newer one wins a tie
+			full = taken->update_mode != 0U;
+			if ((full && lost->update_mode == 0U) ||
+			    (full == (lost->update_mode != 0U) && taken->area > lost->area)) {
+				lost->area          = taken->area;
+				lost->waveform_mode = taken->waveform_mode;
+				lost->update_mode   = taken->update_mode;
+			}
+		}
+	}
+	spin_unlock(&reader->lost_lock);
+}
+
+// Accounts for a record we couldn't write, for every reader that consumes the ring (and would have wanted it)
+static void
+    damage_circ_overflow(mxcfb_damage_ctx* ctx, uint32_t event, const mxcfb_damage_update* update)
+{
+	mxcfb_damage_reader* reader;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(reader, &ctx->reader_list, node)
+	{
+		if (!damage_read_once(reader->max_rects) && damage_reader_wants(reader, update)) {
+			atomic_inc(&reader->overflows);
+			if (damage_read_once(reader->events) & DAMAGE_EVENT_OVERFLOW) {
+				damage_reader_lose(reader, event, update);
+			}
+		}
+	}
+	rcu_read_unlock();
+
+	// Cumulative, for the benefit of mmap consumers
+	damage_inc_u32(&ctx->circ.header->overflows);
+	this_cpu_inc(ctx->stats->overflows);
+}
+
+// The slots only use fixed-width fields (c.f., mxcfb_damage_fixed_data), unlike mxcfb_damage_update.
+static void
+    damage_slot_pack(mxcfb_damage_slot* slot, const mxcfb_damage_update* update)
+{
+	const mxcfb_damage_data* data = &update->data;
+
+	slot->timestamp              = update->timestamp;
+	slot->format                 = update->format;
+	slot->data.update_region     = data->update_region;
+	slot->data.waveform_mode     = data->waveform_mode;
+	slot->data.update_mode       = data->update_mode;
+	slot->data.update_marker     = data->update_marker;
+	slot->data.temp              = data->temp;
+	slot->data.flags             = data->flags;
+	slot->data.dither_mode       = data->dither_mode;
+	slot->data.quant_bit         = data->quant_bit;
+	slot->data.alt_phys_addr     = data->alt_buffer_data.phys_addr;
+	slot->data.alt_width         = data->alt_buffer_data.width;
+	slot->data.alt_height        = data->alt_buffer_data.height;
+	slot->data.alt_update_region = data->alt_buffer_data.alt_update_region;
+	slot->data.rotate            = data->rotate;
+	slot->data.pen_mode          = data->pen_mode;
+	slot->reserved               = 0U;
+}
+
+// c.f., damage_slot_pack
+static void
+    damage_data_unpack(mxcfb_damage_data* data, const mxcfb_damage_fixed_data* fixed)
+{
+	data->update_region                     = fixed->update_region;
+	data->waveform_mode                     = fixed->waveform_mode;
+	data->update_mode                       = fixed->update_mode;
+	data->update_marker                     = fixed->update_marker;
+	data->temp                              = fixed->temp;
+	data->flags                             = fixed->flags;
+	data->dither_mode                       = fixed->dither_mode;
+	data->quant_bit                         = fixed->quant_bit;
+	data->alt_buffer_data.virt_addr         = NULL;
+	data->alt_buffer_data.phys_addr         = fixed->alt_phys_addr;
+	data->alt_buffer_data.width             = fixed->alt_width;
+	data->alt_buffer_data.height            = fixed->alt_height;
+	data->alt_buffer_data.alt_update_region = fixed->alt_update_region;
+	data->rotate                            = fixed->rotate;
+	data->pen_mode                          = !!fixed->pen_mode;
+}
+
+// NOTE: overflow_notify & queue_size are left to the caller
+static void
+    damage_slot_unpack(mxcfb_damage_update* update, const mxcfb_damage_slot* slot)
+{
+	memset(update, 0, sizeof(*update));
+	update->timestamp = slot->timestamp;
+	update->format    = slot->format;
+	damage_data_unpack(&update->data, &slot->data);
+}
+
+// Folds the record we're about to overwrite into the summary of every reader that wanted it, but hasn't read it yet
+// (and lets the tracepoint know about it, if any reader at all lost it).
+// NOTE: A reader may still be busy copying it, in which case the summary errs on the side of caution.
+static void
+    damage_circ_evict(mxcfb_damage_ctx* ctx, const mxcfb_damage_slot* slot)
+{
+	mxcfb_damage_reader* reader;
+	mxcfb_damage_update  update;
+	bool                 lost = false;
+
+	damage_slot_unpack(&update, slot);
+	rcu_read_lock();
+	list_for_each_entry_rcu(reader, &ctx->reader_list, node)
+	{
+		// NOTE: Coalescing readers never read from the ring, so they can't lose anything in there
+		if (damage_read_once(reader->max_rects)) {
+			continue;
+		}
+		if ((int32_t) (slot->seq - damage_read_once(reader->cursor->tail)) >= 0 &&
+		    damage_reader_wants(reader, &update)) {
+			lost = true;
+			if (damage_read_once(reader->events) & DAMAGE_EVENT_OVERFLOW) {
+				damage_reader_lose(reader, slot->event, &update);
+			}
+		}
+	}
+	rcu_read_unlock();
+
+	// NOTE: The ring was full (for that reader, at least), hence the occupancy
+	if (lost) {
+		trace_fbdamage_drop(ctx->fbnode, slot->event, &update, ctx->circ.size);
+	}
+}
+
+// Feeds the event to every reader's tile bitmap and/or coalesced rectangles, and wakes them up.
+// Returns the fullest ring reader's occupancy.
+static uint32_t
+    damage_circ_publish(mxcfb_damage_ctx* ctx, uint32_t event, const mxcfb_damage_update* update)
+{
+	const mxcfb_damage_tile_hashes* table = NULL;
+	mxcfb_damage_reader*            reader;
+	bool                            wanted, first;
+	uint32_t                        occupancy = 0U;
+	uint32_t                        old, prev;
+
+	rcu_read_lock();
+#ifndef CONFIG_ARCH_SUNXI
+	// Figure out what actually changed once and for all, before (and outside of) any reader's lock
+	table = rcu_dereference(ctx->tile_hashes);
+	if (table && (!damage_tile_region(update) || !damage_tile_rehash(ctx, table, event, update))) {
+		table = NULL;
+	}
+#endif
+	list_for_each_entry_rcu(reader, &ctx->reader_list, node)
+	{
+		if (!damage_read_once(reader->max_rects)) {
+			occupancy = max(occupancy, damage_reader_queued(reader));
+		}
+		wanted = damage_event_wanted(damage_read_once(reader->events), update->format);
+		// Filtered out events don't reach the reader in any shape or form, they're only accounted for
+		if (!damage_reader_filter(reader, update)) {
+			if (wanted) {
+				atomic_inc(&reader->filtered);
+			}
+			continue;
+		}
+		if (damage_read_once(reader->tile_shift)) {
+			damage_reader_mark_tiles(reader, event, update, table);
+		}
+		// Don't wake up a reader for records it's going to skip anyway
+		if (!wanted) {
+			continue;
+		}
+		// Coalescing readers only need to hear about the first event since their last read
+		first = true;
+		if (damage_read_once(reader->max_rects)) {
+			first = damage_reader_coalesce(reader, event, update);
+		}
+		if (damage_read_once(reader->moderated)) {
+			damage_reader_moderate(reader);
+		} else if (first) {
+			damage_reader_wake(reader);
+		}
+	}
+	rcu_read_unlock();
+
+	// Another producer may be racing us
+	old = damage_read_once(ctx->max_occupancy);
+	while (occupancy > old) {
+		prev = cmpxchg(&ctx->max_occupancy, old, occupancy);
+		if (prev == old) {
+			break;
+		}
+		old = prev;
+	}
+	return occupancy;
+}
+
+// Reads the framebuffer's current layout (everything but its generation).
+// NOTE: Without the fb_info's lock (we may be in atomic context), so a concurrent FBIOPUT_VSCREENINFO may tear it,
+//       in which case the next check will just notice that it changed once more.
+static void
+    damage_geometry_read(const mxcfb_damage_ctx* ctx, mxcfb_damage_geometry* geometry)
+{
+	const struct fb_info* info = damage_fb_info(ctx->fbnode);
+
+	memset(geometry, 0, sizeof(*geometry));
+	// NOTE: On sunxi, what disp refreshes isn't necessarily backed by a framebuffer at all
+	if (info) {
+		geometry->xres           = info->var.xres;
+		geometry->yres           = info->var.yres;
+		geometry->xres_virtual   = info->var.xres_virtual;
+		geometry->yres_virtual   = info->var.yres_virtual;
+		geometry->bits_per_pixel = info->var.bits_per_pixel;
+		geometry->line_length    = info->fix.line_length;
+		geometry->grayscale      = info->var.grayscale;
+#ifndef CONFIG_ARCH_SUNXI
+		geometry->rotate         = info->var.rotate;
+#endif
+	}
+#ifdef CONFIG_ARCH_SUNXI
+	geometry->rotate = damage_read_once(g2d_rota);
+#endif
+}
+
+// Copies the layout records are currently stamped with
+static void
+    damage_geometry_load(const mxcfb_damage_ctx* ctx, mxcfb_damage_geometry* geometry)
+{
+	unsigned int seq;
+
+	do {
+		seq       = read_seqbegin(&ctx->geometry_lock);
+		*geometry = ctx->geometry;
+	} while (read_seqretry(&ctx->geometry_lock, seq));
+}
+
+// Claims the next record in the ring, if the readers' overflow policies allow it (returns false otherwise).
+// On success, preemption stays disabled until damage_circ_queue publishes the record,
+// so that the producers waiting for their turn to publish theirs are never waiting on a task that isn't running.
+static bool
+    damage_circ_claim(mxcfb_damage_ctx* ctx, uint32_t* seq)
+{
+	uint32_t next;
+
+	while (true) {
+		next = damage_ring_next(&ctx->circ);
+		// NOTE: This may sleep (c.f., DAMAGE_OVERFLOW_BLOCK), so it has to happen before we claim anything
+		if (!damage_circ_reserve(ctx, next)) {
+			return false;
+		}
+
+		preempt_disable();
+		if (damage_ring_claim(&ctx->circ, next)) {
+			*seq = next;
+			return true;
+		}
+		// Another producer beat us to it, try again with the next one
+		preempt_enable();
+	}
+}
+
+// Queues a record in the ring (if the readers' overflow policies allow it), and hands it over to the readers.
+// NOTE: Safe to call from any number of producers at once, no locking required.
+static void
+    damage_circ_queue(mxcfb_damage_ctx*          ctx,
+		      const mxcfb_damage_update* update,
+		      u64                        latency,
+		      const mxcfb_damage_pixels* pixels,
+		      const mxcfb_damage_call*   call)
+{
+	mxcfb_damage_slot* slot;
+	mxcfb_damage_slot  record;
+	uint32_t           event, seq, occupancy;
+	bool               queued = false;
+
+	// NOTE: Before the claim, so that we never retry a seqlock read with preemption disabled
+	damage_geometry_load(ctx, &record.geometry);
+	if (damage_circ_claim(ctx, &seq)) {
+		// NOTE: Only once the records before ours are published, so that event numbers follow the ring's order
+		//       (otherwise, a concurrent producer could land a later event in an earlier slot).
+		damage_ring_wait_turn(&ctx->circ, seq);
+		event = (uint32_t) atomic_inc_return(&ctx->event_seq) - 1U;
+		slot  = damage_ring_slot(&ctx->circ, seq);
+
+		// Don't let the record we're about to overwrite vanish without a trace
+		if ((atomic_read(&ctx->overflow_readers) || trace_fbdamage_drop_enabled()) &&
+		    slot->seq == seq - ctx->circ.size) {
+			damage_circ_evict(ctx, slot);
+		}
+		record.event = event;
+		damage_slot_pack(&record, update);
+		record.latency = latency;
+		record.pixels  = *pixels;
+		record.call    = *call;
+		damage_ring_commit(&ctx->circ, seq, &record);
+		preempt_enable();
+		queued = true;
+	} else {
+		event = (uint32_t) atomic_inc_return(&ctx->event_seq) - 1U;
+		damage_circ_overflow(ctx, event, update);
+	}
+	/* wake_up() will make sure that the head is committed before waking anyone up */
+	occupancy = damage_circ_publish(ctx, event, update);
+	if (queued) {
+		trace_fbdamage_queue(ctx->fbnode, event, update, occupancy);
+	} else {
+		trace_fbdamage_drop(ctx->fbnode, event, update, occupancy);
+	}
+}
+
+// Returns the arena position of the oldest snapshot a reader that asked for them hasn't consumed yet,
+// or head if there's none.
+// NOTE: Only ever called under snapshot_lock, which means that arena positions only ever go forward
+//       along with sequence numbers (c.f., damage_circ_commit).
+static uint32_t
+    damage_pixels_tail(mxcfb_damage_ctx* ctx, uint32_t head)
+{
+	const mxcfb_damage_reader* reader;
+	const mxcfb_damage_slot*   slot;
+	const uint32_t             ring_head = damage_load_acquire(&ctx->circ.header->head);
+	uint32_t                   tail      = head;
+	uint32_t                   seq, offset;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(reader, &ctx->reader_list, node)
+	{
+		// Coalescing readers don't consume the ring (and their records don't carry any snapshot)
+		if (!damage_read_once(reader->snapshots) || damage_read_once(reader->max_rects)) {
+			continue;
+		}
+		// Same as in read, if it's been lapped, the oldest record still around is what matters.
+		// NOTE: Producers without a snapshot don't take snapshot_lock, so one of them may be lapping that record
+		//       right now, in which case the reader just lost it, and the next one is what matters.
+		for (seq = damage_ring_oldest(&ctx->circ, ring_head, damage_read_once(reader->cursor->tail));
+		     seq != ring_head;
+		     seq++) {
+			slot = damage_ring_slot(&ctx->circ, seq);
+			if (damage_load_acquire(&slot->seq) != seq) {
+				continue;
+			}
+			offset = damage_read_once(slot->pixels.offset);
+			/* Finish reading the offset before checking the tag again */
+			smp_rmb();
+			if (damage_read_once(slot->seq) != seq) {
+				continue;
+			}
+			if (head - offset > head - tail) {
+				tail = offset;
+			}
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return tail;
+}
+
+#ifndef CONFIG_ARCH_SUNXI
+// Copies the pixels of the update region from the framebuffer to the arena (if there's room), under snapshot_lock.
+static void
+    damage_pixels_snapshot(mxcfb_damage_ctx* ctx, const mxcfb_damage_update* update, mxcfb_damage_pixels* pixels)
+{
+	const struct fb_info*    info = damage_fb_info(ctx->fbnode);
+	const mxcfb_damage_rect* rect = &update->data.update_region;
+	const uint32_t           size = ctx->circ.header->pixels_size;
+	// Only we ever write it, under snapshot_lock
+	const uint32_t           head = ctx->circ.header->pixels_head;
+	uint32_t                 bytes, width, height, stride, len, start, y;
+	unsigned long            src;
+	unsigned char*           dst;
+
+	pixels->status = DAMAGE_PIXELS_UNSUPPORTED;
+	// Alt buffer updates don't refresh what's in the framebuffer, and sub-byte formats aren't worth the trouble
+	if (update->data.flags & EPDC_FLAG_USE_ALT_BUFFER || !info->screen_base || info->var.bits_per_pixel == 0U ||
+	    info->var.bits_per_pixel % 8U) {
+		return;
+	}
+	if (rect->left >= info->var.xres || rect->top >= info->var.yres || rect->width == 0U || rect->height == 0U) {
+		return;
+	}
+	bytes  = info->var.bits_per_pixel / 8U;
+	width  = min(rect->width, info->var.xres - rect->left);
+	height = min(rect->height, info->var.yres - rect->top);
+	stride = width * bytes;
+	src    = (unsigned long) (info->var.yoffset + rect->top) * info->fix.line_length +
+	      (unsigned long) (info->var.xoffset + rect->left) * bytes;
+	if (src + (unsigned long) (height - 1U) * info->fix.line_length + stride > info->fix.smem_len) {
+		return;
+	}
+
+	pixels->status = DAMAGE_PIXELS_DROPPED;
+	if ((u64) stride * height > size) {
+		return;
+	}
+	len   = stride * height;
+	// A snapshot never wraps around, skip to the start of the arena if it wouldn't fit at the end
+	start = head;
+	if ((start & ctx->circ.pixels_mask) + len > size) {
+		start = (start | ctx->circ.pixels_mask) + 1U;
+	}
+	// Don't overwrite what a reader hasn't had a chance to look at yet
+	if (start + len - damage_pixels_tail(ctx, head) > size) {
+		return;
+	}
+
+	// Move head first, so that userspace can tell that what it just copied may have changed under its feet
+	damage_write_once(ctx->circ.header->pixels_head, start + len);
+	smp_wmb();
+	dst = ctx->circ.pixels + (start & ctx->circ.pixels_mask);
+	for (y = 0U; y < height; y++) {
+		memcpy_fromio(dst + y * stride, info->screen_base + src + y * info->fix.line_length, stride);
+	}
+
+	pixels->offset = start;
+	pixels->length = len;
+	pixels->stride = stride;
+	pixels->status = DAMAGE_PIXELS_OK;
+}
+#endif
+
+// Queues a record in the ring, along with a snapshot of the pixels it refreshes, if anyone asked for them.
+static void
+    damage_circ_commit(mxcfb_damage_ctx*          ctx,
+		       const mxcfb_damage_update* update,
+		       u64                        latency,
+		       const mxcfb_damage_call*   call)
+{
+	mxcfb_damage_pixels pixels = { 0 };
+
+	if (!ctx->circ.pixels) {
+		damage_circ_queue(ctx, update, latency, &pixels, call);
+		return;
+	}
+
+#ifndef CONFIG_ARCH_SUNXI
+	if (atomic_read(&ctx->snapshot_readers) && update->format != DAMAGE_UPDATE_DATA_UNKNOWN &&
+	    update->format != DAMAGE_UPDATE_DATA_ERROR && damage_is_refresh(update->format)) {
+		mutex_lock(&ctx->snapshot_lock);
+		// Even if there's no room for it, the record still points to where the arena was at
+		pixels.offset = ctx->circ.header->pixels_head;
+		damage_pixels_snapshot(ctx, update, &pixels);
+		damage_circ_queue(ctx, update, latency, &pixels, call);
+		// Only now that it has a sequence number may the records without a snapshot point past it
+		damage_store_release(&ctx->pixels_floor, ctx->circ.header->pixels_head);
+		mutex_unlock(&ctx->snapshot_lock);
+		return;
+	}
+#endif
+
+	// NOTE: Records without a snapshot still point to where the arena was at, which is what damage_pixels_tail needs.
+	//       They don't need the lock for that, as long as they read it *before* claiming a sequence number:
+	//       every snapshot accounted for in the floor by then already has an earlier one,
+	//       and every snapshot that isn't starts at or after it.
+	pixels.offset = damage_load_acquire(&ctx->pixels_floor);
+	damage_circ_queue(ctx, update, latency, &pixels, call);
+}
+
+// Returns the slot of that waveform mode (allocating it if need be), DMG_WAVEFORM_SLOTS if we're out of slots.
+static uint32_t
+    damage_waveform_slot(mxcfb_damage_ctx* ctx, uint32_t waveform_mode)
+{
+	uint32_t n = damage_load_acquire(&ctx->waveform_slots);
+	uint32_t i;
+
+	for (i = 0U; i < n; i++) {
+		if (ctx->waveform_modes[i] == waveform_mode) {
+			return i;
+		}
+	}
+
+	// Not there yet, which is rare enough (at most DMG_WAVEFORM_SLOTS times) to warrant a lock
+	spin_lock(&ctx->waveform_lock);
+	// Another producer may have beaten us to it
+	for (n = ctx->waveform_slots; i < n; i++) {
+		if (ctx->waveform_modes[i] == waveform_mode) {
+			break;
+		}
+	}
+	if (i == n && n < DMG_WAVEFORM_SLOTS) {
+		ctx->waveform_modes[n] = waveform_mode;
+		// Pairs with the acquire above (and in sysfs)
+		damage_store_release(&ctx->waveform_slots, n + 1U);
+	}
+	spin_unlock(&ctx->waveform_lock);
+	return i;
+}
+
+static void
+    damage_latency_account(mxcfb_damage_ctx* ctx, uint32_t waveform_mode, u64 latency)
+{
+	mxcfb_damage_latency* stats = &ctx->latency_stats[damage_waveform_slot(ctx, waveform_mode)];
+
+	spin_lock(&ctx->latency_lock);
+	if (stats->count == 0U || latency < stats->min_ns) {
+		stats->min_ns = latency;
+	}
+	stats->max_ns = max(stats->max_ns, latency);
+	stats->total_ns += latency;
+	stats->count++;
+	spin_unlock(&ctx->latency_lock);
+}
+
+// NOTE: Unknown formats have no data, completions were already accounted for as requests,
+//       and the other non-refresh ones don't have a region or a waveform to speak of.
+static void
+    damage_stat_event(mxcfb_damage_ctx* ctx, const mxcfb_damage_update* update)
+{
+	const mxcfb_damage_rect* rect = &update->data.update_region;
+
+	if (update->format == DAMAGE_UPDATE_DATA_ERROR) {
+		this_cpu_inc(ctx->stats->formats[DMG_STAT_FORMATS - 1U]);
+		this_cpu_inc(ctx->stats->copy_failures);
+		return;
+	}
+	// NOTE: Anything past the last format we know of would land in the error slot (or past it), so just skip it
+	if (update->format >= DMG_STAT_FORMATS - 1U) {
+		return;
+	}
+	this_cpu_inc(ctx->stats->formats[update->format]);
+	if (update->format == DAMAGE_UPDATE_DATA_UNKNOWN || update->format >= DAMAGE_UPDATE_DATA_COMPLETION) {
+		return;
+	}
+
+	this_cpu_inc(ctx->stats->waveforms[damage_waveform_slot(ctx, update->data.waveform_mode)]);
+	this_cpu_add(ctx->stats->pixels, (u64) rect->width * rect->height);
+	if (update->data.update_mode) {
+		this_cpu_inc(ctx->stats->full);
+	} else {
+		this_cpu_inc(ctx->stats->partial);
+	}
+}
+
+// Maps a duration in nanoseconds to its histogram bucket (c.f., mxcfb_damage_stats)
+static uint32_t
+    damage_stat_bucket(u64 ns)
+{
+	const u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	return us ? min_t(uint32_t, ilog2(us) + 1U, DMG_LAG_BUCKETS - 1U) : 0U;
+}
+
+// Accounts for the time it took for an event to reach userspace
+static void
+    damage_stat_lag(mxcfb_damage_ctx* ctx, u64 now, u64 timestamp)
+{
+	this_cpu_inc(ctx->stats->lag[damage_stat_bucket(now > timestamp ? now - timestamp : 0U)]);
+}
+
+// Accounts for the time a refresh request kept the submitting thread stuck in the driver
+static void
+    damage_stat_blocking(mxcfb_damage_ctx* ctx, const mxcfb_damage_update* update, const mxcfb_damage_call* call)
+{
+	uint32_t slot;
+
+	// NOTE: Without the data, there's no telling which waveform mode it was
+	if (update->format == DAMAGE_UPDATE_DATA_UNKNOWN || update->format == DAMAGE_UPDATE_DATA_ERROR) {
+		return;
+	}
+	slot = damage_waveform_slot(ctx, update->data.waveform_mode);
+	this_cpu_inc(ctx->stats->blocking[slot][damage_stat_bucket(call->duration)]);
+}
+
+// Remembers a refresh request, so that damage_circ_complete can match its completion back to it
+static void
+    damage_circ_submit(mxcfb_damage_ctx* ctx, const mxcfb_damage_update* update)
+{
+	// NOTE: A zero marker means the client isn't going to wait on it (and it wouldn't be able to tell them apart)
+	if (update->format == DAMAGE_UPDATE_DATA_UNKNOWN || update->format == DAMAGE_UPDATE_DATA_ERROR ||
+	    update->data.update_marker == 0U) {
+		return;
+	}
+	spin_lock(&ctx->submitted_lock);
+	ctx->submitted[update->data.update_marker & (DMG_MARKERS - 1U)] = *update;
+	spin_unlock(&ctx->submitted_lock);
+}
+
+// The kernel just reported the refresh tagged with marker as done:
+// account for its latency, and queue a completion event carrying the data of the original request.
+static void
+    damage_circ_complete(mxcfb_damage_ctx* ctx, uint32_t marker, const mxcfb_damage_call* call)
+{
+	mxcfb_damage_update* request = &ctx->submitted[marker & (DMG_MARKERS - 1U)];
+	mxcfb_damage_update  update;
+	u64                  now, latency;
+
+	if (marker == 0U) {
+		return;
+	}
+	spin_lock(&ctx->submitted_lock);
+	// NOTE: Only the first waiter gets to report it
+	if (request->format == DAMAGE_UPDATE_DATA_UNKNOWN || request->data.update_marker != marker) {
+		spin_unlock(&ctx->submitted_lock);
+		return;
+	}
+	update          = *request;
+	request->format = DAMAGE_UPDATE_DATA_UNKNOWN;
+	spin_unlock(&ctx->submitted_lock);
+
+	now              = ktime_to_ns(ktime_get());
+	latency          = now - update.timestamp;
+	update.format    = DAMAGE_UPDATE_DATA_COMPLETION;
+	update.timestamp = now;
+
+	damage_latency_account(ctx, update.data.waveform_mode, latency);
+	damage_stat_event(ctx, &update);
+	if (atomic_read(&ctx->completion_readers)) {
+		damage_circ_commit(ctx, &update, latency, call);
+	}
+}
+
+// Bumps the generation if the layout changed since the last time we looked, and queues a geometry change if it did.
+static void
+    damage_geometry_check(mxcfb_damage_ctx* ctx)
+{
+	mxcfb_damage_geometry live, cached;
+	mxcfb_damage_update   update  = { 0 };
+	mxcfb_damage_call     call    = { 0 };
+	bool                  changed = false;
+
+	// Nothing changed is by far the most common case, and it doesn't take any lock
+	damage_geometry_read(ctx, &live);
+	damage_geometry_load(ctx, &cached);
+	live.generation = cached.generation;
+	if (!memcmp(&live, &cached, sizeof(live))) {
+		return;
+	}
+
+	write_seqlock(&ctx->geometry_lock);
+	// Another producer may have beaten us to it
+	live.generation = ctx->geometry.generation;
+	if (memcmp(&live, &ctx->geometry, sizeof(live))) {
+		live.generation++;
+		ctx->geometry = live;
+		changed       = true;
+	}
+	write_sequnlock(&ctx->geometry_lock);
+	if (!changed || !atomic_read(&ctx->geometry_readers)) {
+		return;
+	}
+
+	update.timestamp                 = ktime_to_ns(ktime_get());
+	update.format                    = DAMAGE_UPDATE_DATA_GEOMETRY;
+	// That's all v1 records have room for
+	update.data.update_region.width  = live.xres;
+	update.data.update_region.height = live.yres;
+	update.data.rotate               = live.rotate;
+	damage_circ_commit(ctx, &update, 0U, &call);
+}
+
+// Queues a refresh request (i.e., what the ioctl hooks do with the data they just copied).
+static void
+    damage_circ_request(mxcfb_damage_ctx* ctx, const mxcfb_damage_update* update, const mxcfb_damage_call* call)
+{
+	// NOTE: Before the request itself, so that it gets stamped with the layout it was actually meant for
+	damage_geometry_check(ctx);
+	damage_stat_event(ctx, update);
+	damage_stat_blocking(ctx, update, call);
+	damage_circ_submit(ctx, update);
+	damage_circ_commit(ctx, update, 0U, call);
+}
+
+// Feeds the ring with whatever the ioctl the driver just handled means for us
+// (c.f., the ioctl hooks below, and damage_probe_return for the kprobe backend).
+#ifdef CONFIG_ARCH_SUNXI
+static void
+    damage_ioctl_done(mxcfb_damage_ctx* ctx, unsigned int cmd, unsigned long arg, const mxcfb_damage_call* call)
+{
+	mxcfb_damage_update   update = { 0 };
+	sunxi_disp_eink_ioctl ioc_data;
+	struct area_info      area;
+	unsigned int          frame_id;
+	uint32_t              rotate;
+	bool                  copy_failure;
+
+	if (cmd == DISP_EINK_SET_NTX_HANDWRITE_ONOFF) {
+		if (!copy_from_user(&ioc_data, (void __user*) arg, sizeof(ioc_data))) {
+			pen_mode = ioc_data.toggle_handw.enable;
+		}
+	} else if (cmd == DISP_EINK_WAIT_FRAME_SYNC_COMPLETE) {
+		// Only if the kernel actually reported it as done
+		if (call->ret < 0) {
+			return;
+		}
+		if (!copy_from_user(&ioc_data, (void __user*) arg, sizeof(ioc_data))) {
+			damage_circ_complete(ctx, ioc_data.wait_for.frame_id, call);
+		} else {
+			this_cpu_inc(ctx->stats->copy_failures);
+		}
+	} else if (cmd == DISP_EINK_UPDATE2) {
+		// NOTE: Unlike fb_ioctl, unlocked_ioctl is called without a lock, but we don't need one:
+		//       everything is copied into a record on our own stack first,
+		//       and the ring itself is safe to feed from several producers at once (c.f., damage_circ_queue).
+		//       That way, concurrent callers (e.g., the UI & the pen) never wait on each other's page faults.
+
+		// A lot of the stuff we need is actually a pointer, so we need a bunch of copies...
+		// Make sure *all* of them are sane...
+		copy_failure = false;
+		if (!copy_from_user(&ioc_data, (void __user*) arg, sizeof(ioc_data))) {
+			if (copy_from_user(&area, (void __user*) ioc_data.update2.area, sizeof(area))) {
+				copy_failure = true;
+			}
+			if (get_user(frame_id, (unsigned int __user*) ioc_data.update2.frame_id)) {
+				copy_failure = true;
+			}
+			if (get_user(rotate, (uint32_t __user*) ioc_data.update2.rotate)) {
+				copy_failure = true;
+			}
+		} else {
+			copy_failure = true;
+		}
+
+		// NOTE: This is why we needed to get at the data outside of the circ buffer space check:
+		//       to keep the sysfs attribute up to date even after an overflow ;).
+		if (!copy_failure) {
+			g2d_rota = rotate;
+		}
+#else
+static void
+    damage_ioctl_done(mxcfb_damage_ctx* ctx, unsigned int cmd, unsigned long arg, const mxcfb_damage_call* call)
+{
+	mxcfb_damage_update update = { 0 };
+	uint32_t            marker;
+
+	if (cmd == FBIOPUT_VSCREENINFO) {
+		// NOTE: Only with backend=kprobe, as fbmem handles it without ever calling the driver's fb_ioctl
+		//       (damage_fb_notify usually beat us to it, but that depends on CONFIG_FB_NOTIFY).
+		if (call->ret == 0) {
+			damage_geometry_check(ctx);
+		}
+	} else if (cmd == MXCFB_WAIT_FOR_UPDATE_COMPLETE_V1 || cmd == MXCFB_WAIT_FOR_UPDATE_COMPLETE_V3) {
+		// NOTE: Both variants start with the marker.
+		//       Only if the kernel actually reported it as done, though.
+		if (call->ret < 0) {
+			return;
+		}
+		if (!get_user(marker, (uint32_t __user*) arg)) {
+			damage_circ_complete(ctx, marker, call);
+		} else {
+			this_cpu_inc(ctx->stats->copy_failures);
+		}
+	} else if (cmd == MXCFB_SEND_UPDATE_V1_NTX || cmd == MXCFB_SEND_UPDATE_V1 || cmd == MXCFB_SEND_UPDATE_V2) {
+#endif
+		// NOTE: The record is built on the stack first,
+		//       so that tile tracking & coalescing readers still get to see it if the ring is full.
+		// Start with a timestamp, in a way that evacuates most of the 64-bit ktime_t compat concerns...
+		// (There's only a minor s64 vs. u64 change, which should be mostly irrelevant here).
+		update.timestamp = ktime_to_ns(ktime_get());
+
+#ifdef CONFIG_ARCH_SUNXI
+		if (cmd == DISP_EINK_UPDATE2) {
+			if (copy_failure) {
+				update.format = DAMAGE_UPDATE_DATA_ERROR;
+			} else {
+				update.format = DAMAGE_UPDATE_DATA_SUNXI_KOBO_DISP2;
+
+				update.data.update_region.top    = area.y_top;
+				update.data.update_region.left   = area.x_top;
+				update.data.update_region.width  = area.x_bottom - area.x_top + 1;
+				update.data.update_region.height = area.y_bottom - area.y_top + 1;
+
+				update.data.waveform_mode =
+				    GET_UPDATE_MODE(ioc_data.update2.update_mode) & ~EINK_PARTIAL_MODE;
+				if (IS_PARTIAL_UPDATE(ioc_data.update2.update_mode)) {
+					update.data.update_mode = 0;    // UPDATE_MODE_PARTIAL
+				} else {
+					update.data.update_mode = 1;    // UPDATE_MODE_FULL
+				}
+
+				update.data.update_marker = frame_id;
+
+				update.data.flags = GET_UPDATE_INFO(ioc_data.update2.update_mode);
+
+				update.data.rotate = rotate;
+
+				update.data.pen_mode = pen_mode;
+			}
+#else
+		if (cmd == MXCFB_SEND_UPDATE_V1_NTX) {
+			struct mxcfb_update_data_v1_ntx v1_ntx;
+			if (!copy_from_user(&v1_ntx, (void __user*) arg, sizeof(v1_ntx))) {
+				update.format = DAMAGE_UPDATE_DATA_V1_NTX;
+
+				// Take a shortcut as the layouts match up to the source's alt_buffer_data
+				memcpy(&update.data, &v1_ntx, offsetof(__typeof__(v1_ntx), alt_buffer_data));
+
+				// V2 only
+				update.data.dither_mode = 0;
+				update.data.quant_bit   = 0;
+
+				memcpy(&update.data.alt_buffer_data,
+				       &v1_ntx.alt_buffer_data,
+				       sizeof(v1_ntx.alt_buffer_data));
+			} else {
+				update.format = DAMAGE_UPDATE_DATA_ERROR;
+			}
+		} else if (cmd == MXCFB_SEND_UPDATE_V1) {
+			// No void *virt_addr in alt_buffer_data
+			struct mxcfb_update_data_v1 v1;
+			if (!copy_from_user(&v1, (void __user*) arg, sizeof(v1))) {
+				update.format = DAMAGE_UPDATE_DATA_V1;
+
+				memcpy(&update.data, &v1, offsetof(__typeof__(v1), alt_buffer_data));
+
+				// V2 only
+				update.data.dither_mode = 0;
+				update.data.quant_bit   = 0;
+
+				// V1 NTX only
+				update.data.alt_buffer_data.virt_addr = NULL;
+
+				// Take a shortcut as the layouts match starting from the target's alt_buffer_data.phys_addr
+				memcpy(&update.data.alt_buffer_data.phys_addr,
+				       &v1.alt_buffer_data,
+				       sizeof(v1.alt_buffer_data));
+			} else {
+				update.format = DAMAGE_UPDATE_DATA_ERROR;
+			}
+		} else if (cmd == MXCFB_SEND_UPDATE_V2) {
+			// No void *virt_addr in alt_buffer_data
+			// int dither_mode & int quant_bit before alt_buffer_data
+			struct mxcfb_update_data v2;
+
+			if (!copy_from_user(&v2, (void __user*) arg, sizeof(v2))) {
+				update.format = DAMAGE_UPDATE_DATA_V2;
+
+				memcpy(&update.data, &v2, offsetof(__typeof__(v2), alt_buffer_data));
+
+				// V1 NTX only
+				update.data.alt_buffer_data.virt_addr = NULL;
+
+				memcpy(&update.data.alt_buffer_data.phys_addr,
+				       &v2.alt_buffer_data,
+				       sizeof(v2.alt_buffer_data));
+			} else {
+				update.format = DAMAGE_UPDATE_DATA_ERROR;
+			}
+#endif
+		} else {
+			update.format = DAMAGE_UPDATE_DATA_UNKNOWN;
+		}
+
+		damage_circ_request(ctx, &update, call);
+	}
+}
+
+#ifdef CONFIG_ARCH_SUNXI
+static long
+    fbdamage_disp_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+{
+	mxcfb_damage_call call = { 0 };
+
+	// Keep track of how long the driver kept us waiting (e.g., on a collision, or a full update queue)
+	const u64 start = ktime_to_ns(ktime_get());
+	int       ret   = orig_disp_ioctl(file, cmd, arg);
+
+	call.duration = ktime_to_ns(ktime_get()) - start;
+	call.ret      = ret;
+
+	// NOTE: There's only ever the one screen on sunxi
+	damage_ioctl_done(damage_ctxs[0], cmd, arg, &call);
+	return ret;
+}
+#else
+// Returns the handler we replaced in those fb_ops (c.f., init_module)
+static ioctl_handler_fn_t
+    damage_orig_fb_ioctl(const struct fb_ops* fbops)
+{
+	int i;
+
+	for (i = 0; i < FB_MAX; i++) {
+		if (damage_ctxs[i] && damage_ctxs[i]->fbops == fbops) {
+			return damage_ctxs[i]->orig_fb_ioctl;
+		}
+	}
+	return NULL;
+}
+
+static int
+    fb_ioctl(struct fb_info* info, unsigned int cmd, unsigned long arg)
+{
+	// NOTE: A framebuffer we don't track may share its fb_ops with one we do, in which case we just pass it through.
+	mxcfb_damage_ctx*        ctx    = info->node >= 0 && info->node < FB_MAX ? damage_ctxs[info->node] : NULL;
+	// (Same thing for one we're still in the process of patching, c.f., init_module).
+	const ioctl_handler_fn_t orig   = ctx && ctx->fbops ? ctx->orig_fb_ioctl : damage_orig_fb_ioctl(info->fbops);
+	mxcfb_damage_call        call   = { 0 };
+	u64                      start;
+	int                      ret;
+
+	if (!orig) {
+		return -ENOTTY;
+	}
+	if (!ctx) {
+		return orig(info, cmd, arg);
+	}
+
+	// Keep track of how long the driver kept us waiting (e.g., on a collision, or a full update queue)
+	start         = ktime_to_ns(ktime_get());
+	ret           = orig(info, cmd, arg);
+	call.duration = ktime_to_ns(ktime_get()) - start;
+	call.ret      = ret;
+
+	damage_ioctl_done(ctx, cmd, arg, &call);
+	return ret;
+}
+#endif
+
+// NOTE: fbmem handles FBIOPUT_VSCREENINFO (and the mode sysfs attributes) without ever calling the driver's fb_ioctl,
+//       so that's the only way the patch backend gets to hear about a layout change as soon as it happens.
+//       Without CONFIG_FB_NOTIFY, it'll have to wait for the next refresh request (c.f., damage_circ_request).
+static int
+    damage_fb_notify(struct notifier_block* nb, unsigned long action, void* data)
+{
+	const struct fb_event* event = data;
+	mxcfb_damage_ctx*      ctx;
+
+#ifdef FB_EVENT_MODE_CHANGE_ALL
+	if (action != FB_EVENT_MODE_CHANGE && action != FB_EVENT_MODE_CHANGE_ALL) {
+#else
+	if (action != FB_EVENT_MODE_CHANGE) {
+#endif
+		return NOTIFY_DONE;
+	}
+	ctx = event->info->node >= 0 && event->info->node < FB_MAX ? damage_ctxs[event->info->node] : NULL;
+	if (ctx) {
+		damage_geometry_check(ctx);
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block damage_fb_notifier = {
+	.notifier_call = damage_fb_notify,
+};
+
+// NOTE: The kprobe backend needs a kretprobe with an entry handler (i.e., Linux >= 2.6.25),
+//       and we need to know where the probed function's arguments live (c.f., damage_probe_arg).
+#if defined(CONFIG_KRETPROBES) && (defined(CONFIG_X86_64) || defined(CONFIG_ARM) || defined(CONFIG_ARM64))
+#	define DMG_HAVE_PROBE
+#endif
+
+#ifdef DMG_HAVE_PROBE
+// What the entry handler leaves for the return handler
+typedef struct
+{
+	mxcfb_damage_ctx* ctx;
+	unsigned int      cmd;
+	unsigned long     arg;
+	u64               start;
+} mxcfb_damage_probe_call;
+
+// Returns the nth argument of the probed function, as it was on entry
+// (c.f., regs_get_kernel_argument, which not every kernel we care about has).
+static unsigned long
+    damage_probe_arg(const struct pt_regs* regs, unsigned int n)
+{
+#	if defined(CONFIG_X86_64)
+	switch (n) {
+		case 0:
+			return regs->di;
+		case 1:
+			return regs->si;
+		default:
+			return regs->dx;
+	}
+#	elif defined(CONFIG_ARM64)
+	return regs->regs[n];
+#	else
+	return regs->uregs[n];
+#	endif
+}
+
+// The ioctls damage_ioctl_done actually cares about
+static bool
+    damage_probe_wanted(unsigned int cmd)
+{
+#	ifdef CONFIG_ARCH_SUNXI
+	return cmd == DISP_EINK_SET_NTX_HANDWRITE_ONOFF || cmd == DISP_EINK_WAIT_FRAME_SYNC_COMPLETE ||
+	       cmd == DISP_EINK_UPDATE2;
+#	else
+	return cmd == MXCFB_WAIT_FOR_UPDATE_COMPLETE_V1 || cmd == MXCFB_WAIT_FOR_UPDATE_COMPLETE_V3 ||
+	       cmd == MXCFB_SEND_UPDATE_V1_NTX || cmd == MXCFB_SEND_UPDATE_V1 || cmd == MXCFB_SEND_UPDATE_V2 ||
+	       cmd == FBIOPUT_VSCREENINFO;
+#	endif
+}
+
+static int
+    damage_probe_entry(struct kretprobe_instance* ri, struct pt_regs* regs)
+{
+	mxcfb_damage_probe_call* data = (mxcfb_damage_probe_call*) ri->data;
+#	ifdef CONFIG_ARCH_SUNXI
+	// disp_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+	// NOTE: There's only ever the one screen on sunxi
+	data->ctx = damage_ctxs[0];
+#	else
+	// do_fb_ioctl(struct fb_info* info, unsigned int cmd, unsigned long arg)
+	const struct fb_info* info = (const struct fb_info*) damage_probe_arg(regs, 0U);
+
+	data->ctx = info->node >= 0 && info->node < FB_MAX ? damage_ctxs[info->node] : NULL;
+#	endif
+	data->cmd = (unsigned int) damage_probe_arg(regs, 1U);
+	data->arg = damage_probe_arg(regs, 2U);
+
+	// Don't even bother with the return probe for a framebuffer we don't track, or an ioctl we don't care about
+	if (!data->ctx || !damage_probe_wanted(data->cmd)) {
+		return 1;
+	}
+	// Keep track of how long the driver kept us waiting (e.g., on a collision, or a full update queue)
+	data->start = ktime_to_ns(ktime_get());
+	return 0;
+}
+
+static int
+    damage_probe_return(struct kretprobe_instance* ri, struct pt_regs* regs)
+{
+	const mxcfb_damage_probe_call* data = (const mxcfb_damage_probe_call*) ri->data;
+	mxcfb_damage_call              call = { 0 };
+
+	call.duration = ktime_to_ns(ktime_get()) - data->start;
+	call.ret      = (int32_t) regs_return_value(regs);
+
+	// NOTE: We're in atomic context, so we can't fault the ioctl's data in, and there's nowhere to defer that to
+	//       (we'd need the caller's mm). In practice, it's resident (the driver itself just read it);
+	//       if not, a request is reported as DAMAGE_UPDATE_DATA_ERROR, and a completion is lost (c.f., the header).
+	//       That's also why DAMAGE_OVERFLOW_BLOCK & pixel snapshots (i.e., whatever may sleep) are off the table.
+	pagefault_disable();
+	damage_ioctl_done(data->ctx, data->cmd, data->arg, &call);
+	pagefault_enable();
+	return 0;
+}
+
+// NOTE: The function that calls the driver's ioctl handler, whoever opened the device, and whenever they did.
+//       It's static, so it may have been inlined, in which case registering the probe fails (with ENOENT or EINVAL).
+static struct kretprobe damage_probe = {
+#	ifdef CONFIG_ARCH_SUNXI
+	// NOTE: disp's own handler, not our replacement (c.f., fbdamage_disp_ioctl), which is why ours isn't named that.
+	.kp.symbol_name = "disp_ioctl",
+#	else
+	.kp.symbol_name = "do_fb_ioctl",
+#	endif
+	.entry_handler  = damage_probe_entry,
+	.handler        = damage_probe_return,
+	.data_size      = sizeof(mxcfb_damage_probe_call),
+	// NOTE: Concurrent ioctls past that many aren't seen at all (c.f., cleanup_module)
+	.maxactive      = 32,
+};
+#endif
+
+static int
+    fbdamage_open(struct inode* inode, struct file* file)
+{
+	mxcfb_damage_ctx*    ctx    = container_of(inode->i_cdev, mxcfb_damage_ctx, cdev);
+	mxcfb_damage_reader* reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+
+	if (!reader) {
+		return -ENOMEM;
+	}
+	// NOTE: vmalloc_user hands us a zeroed page, which we need, since we're going to map it into userspace.
+	reader->cursor = vmalloc_user(PAGE_SIZE);
+	if (!reader->cursor) {
+		kfree(reader);
+		return -ENOMEM;
+	}
+	reader->ctx = ctx;
+	atomic_set(&reader->overflows, 0);
+	atomic_set(&reader->filtered, 0);
+	// A slow reader only loses its own events, unless it explicitly opts into backpressure
+	reader->policy = DAMAGE_OVERFLOW_OVERWRITE_OLDEST;
+	// Completion events are opt-in
+	reader->events = DAMAGE_EVENT_REFRESH;
+	// The good old mxcfb_damage_update
+	reader->record_version = DAMAGE_RECORD_V1;
+	reader->record_size    = sizeof(mxcfb_damage_update);
+	init_waitqueue_head(&reader->wait);
+	mutex_init(&reader->lock);
+	spin_lock_init(&reader->lost_lock);
+	spin_lock_init(&reader->coalesce_lock);
+	spin_lock_init(&reader->tiles_lock);
+	spin_lock_init(&reader->wake_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&reader->wake_timer, damage_reader_wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&reader->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	reader->wake_timer.function = damage_reader_wake_timer;
+#endif
+
+	mutex_lock(&ctx->reader_list_lock);
+	// We only care about damage that happens from now on
+	reader->cursor->tail = damage_load_acquire(&ctx->circ.header->head);
+	list_add_tail_rcu(&reader->node, &ctx->reader_list);
+	mutex_unlock(&ctx->reader_list_lock);
+
+	file->private_data = reader;
+	return 0;
+}
+
+static int
+    fbdamage_release(struct inode* inode, struct file* file)
+{
+	mxcfb_damage_reader* reader = file->private_data;
+	mxcfb_damage_ctx*    ctx    = reader->ctx;
+
+	mutex_lock(&ctx->reader_list_lock);
+	list_del_rcu(&reader->node);
+	mutex_unlock(&ctx->reader_list_lock);
+	// Make sure the producer is done looking at us...
+	synchronize_rcu();
+	// ...and that it doesn't keep waiting on us if we were blocking it.
+	wake_up(&ctx->space_queue);
+	// It can't re-arm the timer anymore, either
+	hrtimer_cancel(&reader->wake_timer);
+	if (reader->events & DAMAGE_EVENT_COMPLETION) {
+		atomic_dec(&ctx->completion_readers);
+	}
+	if (reader->events & DAMAGE_EVENT_OVERFLOW) {
+		atomic_dec(&ctx->overflow_readers);
+	}
+	if (reader->events & DAMAGE_EVENT_GEOMETRY) {
+		atomic_dec(&ctx->geometry_readers);
+	}
+	if (reader->snapshots) {
+		atomic_dec(&ctx->snapshot_readers);
+	}
+
+	kfree(rcu_dereference_protected(reader->filter, 1));
+#ifndef CONFIG_ARCH_SUNXI
+	if (reader->tile_hashing) {
+		damage_tile_hashing_put(ctx);
+	}
+#endif
+	kfree(reader->tiles);
+	kfree(reader->rects);
+	vfree(reader->cursor);
+	kfree(reader);
+	return 0;
+}
+
+// Where fbdamage_drain copies records to (i.e., a plain user buffer for read, an iov_iter for read_iter)
+typedef int (*damage_sink_fn_t)(void* sink, const void* record, size_t size);
+
+static uint16_t
+    damage_clamp_u16(uint32_t v)
+{
+	return (uint16_t) min_t(uint32_t, v, 0xFFFFU);
+}
+
+// Hands a record over to the sink, in the reader's record format
+static int
+    damage_reader_emit(const mxcfb_damage_reader*   reader,
+		       uint32_t                     event,
+		       const mxcfb_damage_update*   update,
+		       u64                          latency,
+		       const mxcfb_damage_pixels*   pixels,
+		       const mxcfb_damage_call*     call,
+		       const mxcfb_damage_geometry* geometry,
+		       damage_sink_fn_t             copy_out,
+		       void*                        sink)
+{
+	u64                     record[DAMAGE_RECORD_MAX_SIZE / sizeof(u64)];
+	mxcfb_damage_update_v2* v2 = (mxcfb_damage_update_v2*) record;
+
+	if (reader->record_version == DAMAGE_RECORD_V1) {
+		// Frozen, so no need for a bounce buffer
+		return copy_out(sink, update, sizeof(*update));
+	}
+
+	// NOTE: Fields the client doesn't know about are dropped, fields we don't know about are zeroed.
+	if (reader->record_size > sizeof(*v2)) {
+		memset((char*) record + sizeof(*v2), 0, reader->record_size - sizeof(*v2));
+	}
+
+	v2->timestamp     = update->timestamp;
+	v2->seq           = event;
+	v2->update_marker = update->data.update_marker;
+	v2->region.top    = damage_clamp_u16(update->data.update_region.top);
+	v2->region.left   = damage_clamp_u16(update->data.update_region.left);
+	v2->region.width  = damage_clamp_u16(update->data.update_region.width);
+	v2->region.height = damage_clamp_u16(update->data.update_region.height);
+	v2->flags         = update->data.flags;
+	v2->waveform_mode = damage_clamp_u16(update->data.waveform_mode);
+	v2->update_mode   = (uint8_t) update->data.update_mode;
+	v2->format        = (uint8_t) update->format;
+	v2->latency       = latency;
+	v2->pixels        = *pixels;
+	v2->call          = *call;
+	v2->geometry      = *geometry;
+	return copy_out(sink, record, reader->record_size);
+}
+
+// Every event that's actually queued in the ring (i.e., all but overflow summaries)
+#define DMG_RING_EVENTS (DAMAGE_EVENT_REFRESH | DAMAGE_EVENT_COMPLETION | DAMAGE_EVENT_GEOMETRY)
+
+// Returns true if there's at least one record the reader wants
+// (c.f., FBDAMAGE_SET_EVENTS & FBDAMAGE_SET_FILTER) between tail & head
+static bool
+    damage_reader_scan(const mxcfb_damage_reader* reader, uint32_t head, uint32_t tail)
+{
+	mxcfb_damage_ctx*   ctx = reader->ctx;
+	mxcfb_damage_slot   record;
+	mxcfb_damage_update update;
+
+	if ((damage_read_once(reader->events) & DMG_RING_EVENTS) == DMG_RING_EVENTS &&
+	    !rcu_access_pointer(reader->filter)) {
+		return head != tail;
+	}
+	for (tail = damage_ring_oldest(&ctx->circ, head, tail); tail != head; tail++) {
+		// If we've been lapped, let read sort it out
+		if (!damage_ring_fetch(&ctx->circ, tail, &record)) {
+			return true;
+		}
+		damage_slot_unpack(&update, &record);
+		if (damage_reader_wants(reader, &update)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool
+    damage_reader_pending(const mxcfb_damage_reader* reader)
+{
+	const mxcfb_damage_ctx* ctx = reader->ctx;
+
+	if (damage_read_once(reader->max_rects)) {
+		return damage_read_once(reader->nrects) != 0U;
+	}
+	/* read index before reading contents at that index */
+	return damage_reader_scan(
+	    reader, damage_load_acquire(&ctx->circ.header->head), damage_read_once(reader->cursor->tail));
+}
+
+// i.e., pending, and worth a wakeup, as far as wakeup moderation is concerned
+static bool
+    damage_reader_ready(const mxcfb_damage_reader* reader)
+{
+	return damage_reader_pending(reader) &&
+	       (!damage_read_once(reader->moderated) || damage_read_once(reader->wake_ready));
+}
+
+// Once everything has been read, the next burst starts from scratch
+static void
+    damage_reader_settle(mxcfb_damage_reader* reader)
+{
+	if (!damage_read_once(reader->moderated)) {
+		return;
+	}
+	spin_lock(&reader->wake_lock);
+	if (!damage_reader_pending(reader)) {
+		hrtimer_try_to_cancel(&reader->wake_timer);
+		reader->burst_start  = 0U;
+		reader->wake_pending = 0U;
+		damage_write_once(reader->wake_ready, false);
+	}
+	spin_unlock(&reader->wake_lock);
+}
+
+// Waits until there's something to read, returns with the reader's lock held on success.
+// NOTE: Wakeup moderation only applies to blocking reads, a non-blocking one gets whatever is there.
+static int
+    damage_reader_wait(struct file* file, mxcfb_damage_reader* reader)
+{
+	// NOTE: The producer never touches our tail, this only protects it against concurrent reads on the same file.
+	if (mutex_lock_interruptible(&reader->lock)) {
+		return -ERESTARTSYS;
+	}
+	while (!(file->f_flags & O_NONBLOCK ? damage_reader_pending(reader) : damage_reader_ready(reader))) {
+		// If the ring buffer is currently empty, wait for fb_ioctl to wake us up,
+		// (at which point we'll be guaranteed to have something to read).
+		mutex_unlock(&reader->lock);
+
+		if (file->f_flags & O_NONBLOCK) {
+			// Except if we were open'ed in non-blocking mode, of course...
+			return -EAGAIN;
+		}
+
+		if (wait_event_interruptible(reader->wait, damage_reader_ready(reader))) {
+			return -ERESTARTSYS;
+		}
+		if (mutex_lock_interruptible(&reader->lock)) {
+			return -ERESTARTSYS;
+		}
+	}
+	return 0;
+}
+
+// Hands out (and forgets about) as many merged rectangles as fit in count.
+static ssize_t
+    fbdamage_drain_coalesced(mxcfb_damage_reader* reader, size_t count, damage_sink_fn_t copy_out, void* sink)
+{
+	mxcfb_damage_ctx*     ctx    = reader->ctx;
+	// Only ever touched by read, which is serialized by the reader's lock
+	mxcfb_damage_event*   out    = reader->rects + DAMAGE_COALESCE_MAX_RECTS;
+	const uint32_t        stride = reader->record_size;
+	const u64             now    = ktime_to_ns(ktime_get());
+	// Merged rectangles don't carry any snapshot, nor a single ioctl's outcome
+	mxcfb_damage_pixels   pixels = { 0 };
+	mxcfb_damage_call     call   = { 0 };
+	// ...and they may span several layouts, so they get the current one
+	mxcfb_damage_geometry geometry;
+	uint32_t              n, left, i, j, overflows;
+
+	// Keep the critical section short, the producer is waiting on it
+	spin_lock(&reader->coalesce_lock);
+	n    = min_t(size_t, reader->nrects, count / stride);
+	left = reader->nrects - n;
+	memcpy(out, reader->rects, n * sizeof(*out));
+	memmove(reader->rects, reader->rects + n, left * sizeof(*out));
+	reader->nrects = left;
+	spin_unlock(&reader->coalesce_lock);
+	damage_geometry_load(ctx, &geometry);
+
+	for (i = 0U; i < n; i++) {
+		overflows                     = i == 0U ? (uint32_t) atomic_xchg(&reader->overflows, 0) : 0U;
+		out[i].update.overflow_notify = overflows;
+		out[i].update.queue_size      = n + left - i;
+		if (damage_reader_emit(
+			reader, out[i].event, &out[i].update, 0U, &pixels, &call, &geometry, copy_out, sink)) {
+			atomic_add(overflows, &reader->overflows);
+			break;
+		}
+		trace_fbdamage_read(ctx->fbnode, out[i].event, &out[i].update, out[i].update.queue_size);
+		damage_stat_lag(ctx, now, out[i].update.timestamp);
+	}
+	if (i < n) {
+		// What didn't make it out goes back where it came from (merged with whatever came in since then)
+		spin_lock(&reader->coalesce_lock);
+		for (j = i; j < n; j++) {
+			damage_reader_fold(reader, &out[j]);
+		}
+		spin_unlock(&reader->coalesce_lock);
+	}
+	damage_reader_settle(reader);
+	mutex_unlock(&reader->lock);
+	if (i == 0U) {
+		return -EFAULT;
+	}
+	return i * stride;
+}
+
+// Copies as many whole records as fit in count, and releases the tail only once, at the very end.
+static ssize_t
+    fbdamage_drain(struct file* file, size_t count, damage_sink_fn_t copy_out, void* sink)
+{
+	mxcfb_damage_reader*  reader = file->private_data;
+	mxcfb_damage_ctx*     ctx    = reader->ctx;
+	uint32_t              head, tail, next, avail, fit, n, i, lost, stride, summary_event, overflows;
+	mxcfb_damage_slot     record;
+	mxcfb_damage_update   update;
+	mxcfb_damage_update   summary;
+	mxcfb_damage_lost     taken;
+	// Overflow summaries don't carry any snapshot, nor a single ioctl's outcome
+	mxcfb_damage_pixels   no_pixels = { 0 };
+	mxcfb_damage_call     no_call   = { 0 };
+	// ...and they may span several layouts, so they get the current one
+	mxcfb_damage_geometry geometry;
+	u64                   now;
+	int                   ret;
+
+	if (count < damage_read_once(reader->record_size)) {
+		return -EINVAL;
+	}
+again:
+	if ((ret = damage_reader_wait(file, reader))) {
+		return ret;
+	}
+	// The record format may have changed while we were waiting
+	stride = reader->record_size;
+	if (count < stride) {
+		mutex_unlock(&reader->lock);
+		return -EINVAL;
+	}
+	if (reader->max_rects) {
+		return fbdamage_drain_coalesced(reader, count, copy_out, sink);
+	}
+
+	head = damage_load_acquire(&ctx->circ.header->head);
+	tail = damage_read_once(reader->cursor->tail);
+	now  = ktime_to_ns(ktime_get());
+
+	lost = 0U;
+resync:
+	// If the producer lapped us (or an mmap consumer left us with a bogus tail), skip ahead to the oldest record
+	next = damage_ring_oldest(&ctx->circ, head, tail);
+	lost += next - tail;
+	tail = next;
+
+	// NOTE: i counts the records we consume, n the ones we actually hand out (c.f., FBDAMAGE_SET_EVENTS)
+	avail = head - tail;
+	fit   = count / stride;
+	for (i = 0U, n = 0U; i < avail && n < fit; i++) {
+		/* extract one item from the buffer */
+		// NOTE: The ring is shared with userspace, so work on a local copy.
+		if (!damage_ring_fetch(&ctx->circ, tail + i, &record)) {
+			// We've been lapped while reading (c.f., DAMAGE_OVERFLOW_OVERWRITE_OLDEST)
+			if (n > 0U) {
+				// Ship what we've got so far, we'll catch up on the next read.
+				break;
+			}
+			tail += i;
+			next = damage_ring_resync(&ctx->circ, &head, tail);
+			lost += next - tail;
+			tail = next;
+			goto resync;
+		}
+		damage_slot_unpack(&update, &record);
+		if (!damage_reader_wants(reader, &update)) {
+			continue;
+		}
+		// What we lost to overflows goes right before the first record we do get (c.f., DAMAGE_EVENT_OVERFLOW)
+		if (n == 0U && damage_reader_take_lost(reader, &taken, &summary_event, &summary)) {
+			overflows               = (uint32_t) atomic_xchg(&reader->overflows, 0);
+			summary.overflow_notify = overflows + lost;
+			summary.queue_size      = avail - i + 1U;
+			damage_geometry_load(ctx, &geometry);
+			if (damage_reader_emit(reader,
+					       summary_event,
+					       &summary,
+					       0U,
+					       &no_pixels,
+					       &no_call,
+					       &geometry,
+					       copy_out,
+					       sink)) {
+				// Nothing made it out, so it's all still to be reported on the next read
+				damage_reader_restore_lost(reader, &taken);
+				atomic_add(overflows, &reader->overflows);
+				break;
+			}
+			trace_fbdamage_read(ctx->fbnode, summary_event, &summary, summary.queue_size);
+			// NOTE: Summaries never go through the ring, so they're accounted for once they're delivered
+			this_cpu_inc(ctx->stats->formats[DAMAGE_UPDATE_DATA_OVERFLOW]);
+			n++;
+			// No room left for this one, it'll be first in line on the next read
+			if (n == fit) {
+				break;
+			}
+		}
+		// Only the first record of a batch reports the overflows (they happened before it).
+		overflows              = n == 0U ? (uint32_t) atomic_xchg(&reader->overflows, 0) : 0U;
+		update.overflow_notify = n == 0U ? overflows + lost : 0U;
+		// Allows the reader to know if they're late consuming the buffer or not...
+		update.queue_size      = avail - i;
+		if (damage_reader_emit(reader,
+				       record.event,
+				       &update,
+				       record.latency,
+				       &record.pixels,
+				       &record.call,
+				       &record.geometry,
+				       copy_out,
+				       sink)) {
+			atomic_add(overflows, &reader->overflows);
+			break;
+		}
+		trace_fbdamage_read(ctx->fbnode, record.event, &update, update.queue_size);
+		damage_stat_lag(ctx, now, update.timestamp);
+		n++;
+	}
+	if (n == 0U && i < avail) {
+		// Nothing made it out, so what we were lapped on is still to be reported on the next read.
+		// NOTE: Keep the tail we skipped ahead to, so that the next read doesn't count it all over again.
+		damage_store_release(&reader->cursor->tail, tail);
+		atomic_add(lost, &reader->overflows);
+		mutex_unlock(&reader->lock);
+		return -EFAULT;
+	}
+	/* Finish reading descriptors before incrementing tail. */
+	damage_store_release(&reader->cursor->tail, tail + i);
+	damage_reader_settle(reader);
+	mutex_unlock(&reader->lock);
+	// Let a DAMAGE_OVERFLOW_BLOCK producer know there's some room now
+	if (damage_read_once(reader->policy) == DAMAGE_OVERFLOW_BLOCK) {
+		wake_up(&ctx->space_queue);
+	}
+	if (n == 0U) {
+		// Nothing we were interested in, go back to sleep (and report what we may have lost on the next read)
+		atomic_add(lost, &reader->overflows);
+		goto again;
+	}
+	return n * stride;
+}
+
+static int
+    damage_copy_to_user(void* sink, const void* record, size_t size)
+{
+	char __user** buffer = sink;
+
+	if (copy_to_user(*buffer, record, size)) {
+		return -EFAULT;
+	}
+	*buffer += size;
+	return 0;
+}
+
+static ssize_t
+    fbdamage_read(struct file* file, char __user* buffer, size_t count, loff_t* ppos)
+{
+	return fbdamage_drain(file, count, damage_copy_to_user, &buffer);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+static int
+    damage_copy_to_iter(void* sink, const void* record, size_t size)
+{
+	if (copy_to_iter(record, size, sink) != size) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+// For readv & friends (plain read() still goes through fbdamage_read, which saves the iov_iter setup).
+static ssize_t
+    fbdamage_read_iter(struct kiocb* iocb, struct iov_iter* to)
+{
+	return fbdamage_drain(iocb->ki_filp, iov_iter_count(to), damage_copy_to_iter, to);
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+static __poll_t
+#else
+static unsigned int
+#endif
+    fbdamage_poll(struct file* file, poll_table* wait)
+{
+	mxcfb_damage_reader* reader = file->private_data;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+	__poll_t mask = 0;
+#else
+	unsigned int mask = 0;
+#endif
+
+	poll_wait(file, &reader->wait, wait);
+
+	if (damage_reader_ready(reader)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+		mask = EPOLLIN | EPOLLRDNORM;
+#else
+                mask = POLLIN | POLLRDNORM;
+#endif
+	}
+
+	return mask;
+}
+
+// Makes sure a mapping stays read-only, even via mprotect
+static int
+    damage_vma_readonly(struct vm_area_struct* vma)
+{
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	return 0;
+}
+
+static int
+    fbdamage_mmap(struct file* file, struct vm_area_struct* vma)
+{
+	mxcfb_damage_reader* reader = file->private_data;
+	mxcfb_damage_ctx*    ctx    = reader->ctx;
+	unsigned long        size   = vma->vm_end - vma->vm_start;
+	int                  ret;
+
+	if (vma->vm_pgoff == 0) {
+		// The header & the records are read-only, the kernel trusts the head it finds there.
+		if (size > ctx->circ.header->map_size) {
+			return -EINVAL;
+		}
+		if ((ret = damage_vma_readonly(vma))) {
+			return ret;
+		}
+		return remap_vmalloc_range(vma, ctx->circ.header, 0);
+	} else if (vma->vm_pgoff == (ctx->circ.header->cursor_offset >> PAGE_SHIFT)) {
+		if (size > PAGE_SIZE) {
+			return -EINVAL;
+		}
+		// Every reader gets its own cursor
+		return remap_vmalloc_range(vma, ((const mxcfb_damage_reader*) file->private_data)->cursor, 0);
+	} else if (ctx->circ.pixels && vma->vm_pgoff == (ctx->circ.header->pixels_offset >> PAGE_SHIFT)) {
+		// Shared by everyone, and read-only, too
+		if (size > ctx->circ.header->pixels_size) {
+			return -EINVAL;
+		}
+		if ((ret = damage_vma_readonly(vma))) {
+			return ret;
+		}
+		return remap_vmalloc_range(vma, ctx->circ.pixels, 0);
+	}
+
+	return -EINVAL;
+}
+
+static long
+    fbdamage_set_overflow_policy(mxcfb_damage_reader* reader, const void __user* arg)
+{
+	mxcfb_damage_ctx*           ctx = reader->ctx;
+	mxcfb_damage_overflow_setup setup;
+
+	if (copy_from_user(&setup, arg, sizeof(setup))) {
+		return -EFAULT;
+	}
+	if (setup.policy > DAMAGE_OVERFLOW_BLOCK || setup.timeout_us > DMG_MAX_BLOCK_US) {
+		return -EINVAL;
+	}
+	// NOTE: A kprobe producer can't sleep (c.f., damage_probe_return)
+	if (setup.policy == DAMAGE_OVERFLOW_BLOCK && damage_probing) {
+		return -EOPNOTSUPP;
+	}
+
+	damage_write_once(reader->timeout_us, setup.timeout_us);
+	damage_write_once(reader->policy, (int) setup.policy);
+	// Let a blocked producer re-evaluate its options
+	wake_up(&ctx->space_queue);
+	return 0;
+}
+
+static long
+    fbdamage_set_coalescing(mxcfb_damage_reader* reader, const void __user* arg)
+{
+	mxcfb_damage_ctx*           ctx = reader->ctx;
+	mxcfb_damage_coalesce_setup setup;
+
+	if (copy_from_user(&setup, arg, sizeof(setup))) {
+		return -EFAULT;
+	}
+	if (setup.max_rects > DAMAGE_COALESCE_MAX_RECTS ||
+	    setup.flags & ~(uint32_t) (DAMAGE_COALESCE_BY_WAVEFORM | DAMAGE_COALESCE_BY_UPDATE_MODE)) {
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&reader->lock)) {
+		return -ERESTARTSYS;
+	}
+	// NOTE: Allocated once and for all, so that the producer never has to care about it going away.
+	if (setup.max_rects && !reader->rects) {
+		reader->rects = kcalloc(2U * DAMAGE_COALESCE_MAX_RECTS, sizeof(*reader->rects), GFP_KERNEL);
+		if (!reader->rects) {
+			mutex_unlock(&reader->lock);
+			return -ENOMEM;
+		}
+	}
+
+	// Whatever was pending in the previous mode is discarded
+	spin_lock(&reader->coalesce_lock);
+	reader->nrects         = 0U;
+	reader->coalesce_flags = setup.flags;
+	damage_write_once(reader->max_rects, setup.max_rects);
+	spin_unlock(&reader->coalesce_lock);
+	damage_store_release(&reader->cursor->tail, damage_load_acquire(&ctx->circ.header->head));
+	mutex_unlock(&reader->lock);
+
+	// Let a blocked producer re-evaluate its options
+	wake_up(&ctx->space_queue);
+	return 0;
+}
+
+static long
+    fbdamage_set_tiles(mxcfb_damage_reader* reader, void __user* arg)
+{
+	mxcfb_damage_tiles_setup setup;
+	uint32_t                 xres, yres;
+	uint32_t                 shift = 0U, cols = 0U, rows = 0U, words = 0U;
+	uint32_t*                tiles = NULL;
+	uint32_t*                old;
+	int                      ret;
+
+	if (copy_from_user(&setup, arg, sizeof(setup))) {
+		return -EFAULT;
+	}
+	if (setup.tile_size) {
+		if (!is_power_of_2(setup.tile_size) || setup.tile_size < DAMAGE_TILE_SIZE_MIN ||
+		    setup.tile_size > DAMAGE_TILE_SIZE_MAX) {
+			return -EINVAL;
+		}
+		if ((ret = damage_fb_geometry(reader->ctx, &xres, &yres))) {
+			return ret;
+		}
+		shift = ilog2(setup.tile_size);
+		cols  = DIV_ROUND_UP(xres, setup.tile_size);
+		rows  = DIV_ROUND_UP(yres, setup.tile_size);
+		words = DIV_ROUND_UP(cols * rows, 32U);
+		// The live bitmap, followed by the scratch copy
+		tiles = kcalloc(2U * words, sizeof(*tiles), GFP_KERNEL);
+		if (!tiles) {
+			return -ENOMEM;
+		}
+	}
+
+	// NOTE: FBDAMAGE_FETCH_TILES uses the scratch copy under the reader's lock
+	if (mutex_lock_interruptible(&reader->lock)) {
+		kfree(tiles);
+		return -ERESTARTSYS;
+	}
+	spin_lock(&reader->tiles_lock);
+	old                = reader->tiles;
+	reader->tiles      = tiles;
+	reader->tile_cols  = cols;
+	reader->tile_rows  = rows;
+	reader->tile_words = words;
+	damage_write_once(reader->tile_shift, shift);
+	spin_unlock(&reader->tiles_lock);
+	mutex_unlock(&reader->lock);
+	kfree(old);
+
+	setup.cols  = cols;
+	setup.rows  = rows;
+	setup.words = words;
+	if (copy_to_user(arg, &setup, sizeof(setup))) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static long
+    fbdamage_fetch_tiles(mxcfb_damage_reader* reader, void __user* arg)
+{
+	mxcfb_damage_tiles_fetch fetch;
+	uint32_t*                scratch;
+	uint32_t                 words, dirty, i;
+
+	if (copy_from_user(&fetch, arg, sizeof(fetch))) {
+		return -EFAULT;
+	}
+
+	if (mutex_lock_interruptible(&reader->lock)) {
+		return -ERESTARTSYS;
+	}
+	words = reader->tile_words;
+	if (!reader->tile_shift || fetch.words < words) {
+		mutex_unlock(&reader->lock);
+		return -EINVAL;
+	}
+	scratch = reader->tiles + words;
+
+	// Swap it out with a clean slate in one go, so that the producer never has to wait on copy_to_user
+	spin_lock(&reader->tiles_lock);
+	memcpy(scratch, reader->tiles, words * sizeof(*scratch));
+	memset(reader->tiles, 0, words * sizeof(*scratch));
+	spin_unlock(&reader->tiles_lock);
+
+	if (copy_to_user((void __user*) (uintptr_t) fetch.bitmap, scratch, words * sizeof(*scratch))) {
+		// Put it back, so that nothing gets lost
+		spin_lock(&reader->tiles_lock);
+		for (i = 0U; i < words; i++) {
+			reader->tiles[i] |= scratch[i];
+		}
+		spin_unlock(&reader->tiles_lock);
+		mutex_unlock(&reader->lock);
+		return -EFAULT;
+	}
+	dirty = 0U;
+	for (i = 0U; i < words; i++) {
+		dirty += hweight32(scratch[i]);
+	}
+	mutex_unlock(&reader->lock);
+
+	fetch.words = words;
+	fetch.dirty = dirty;
+	if (copy_to_user(arg, &fetch, sizeof(fetch))) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static long
+    fbdamage_set_tile_hashing(mxcfb_damage_reader* reader, const void __user* arg)
+{
+#ifdef CONFIG_ARCH_SUNXI
+	return -EOPNOTSUPP;
+#else
+	uint32_t enable;
+	int      ret = 0;
+
+	if (get_user(enable, (const uint32_t __user*) arg)) {
+		return -EFAULT;
+	}
+	if (enable > 1U) {
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&reader->lock)) {
+		return -ERESTARTSYS;
+	}
+	// NOTE: The hashes are shared, the first hashing reader takes the baseline, the last one throws it away
+	if (enable && !reader->tile_hashing) {
+		ret = damage_tile_hashing_get(reader->ctx);
+	} else if (!enable && reader->tile_hashing) {
+		damage_tile_hashing_put(reader->ctx);
+	}
+	if (!ret) {
+		damage_write_once(reader->tile_hashing, enable);
+	}
+	mutex_unlock(&reader->lock);
+	return ret;
+#endif
+}
+
+static long
+    fbdamage_set_record_format(mxcfb_damage_reader* reader, void __user* arg)
+{
+	mxcfb_damage_record_format format;
+
+	if (copy_from_user(&format, arg, sizeof(format))) {
+		return -EFAULT;
+	}
+	switch (format.version) {
+		case DAMAGE_RECORD_V1:
+			// Frozen, no wiggle room
+			if (format.size != sizeof(mxcfb_damage_update)) {
+				return -EINVAL;
+			}
+			break;
+		case DAMAGE_RECORD_V2:
+			// Extensible, as long as the base layout fits
+			if (format.size < DAMAGE_RECORD_V2_MIN_SIZE || format.size > DAMAGE_RECORD_MAX_SIZE ||
+			    !IS_ALIGNED(format.size, sizeof(u64))) {
+				return -EINVAL;
+			}
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&reader->lock)) {
+		return -ERESTARTSYS;
+	}
+	reader->record_version = format.version;
+	damage_write_once(reader->record_size, format.size);
+	mutex_unlock(&reader->lock);
+
+	// Let the client know what we actually fill
+	format.size = format.version == DAMAGE_RECORD_V1 ? sizeof(mxcfb_damage_update) : sizeof(mxcfb_damage_update_v2);
+	if (copy_to_user(arg, &format, sizeof(format))) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static long
+    fbdamage_set_wakeup(mxcfb_damage_reader* reader, const void __user* arg)
+{
+	mxcfb_damage_wakeup_setup setup;
+
+	if (copy_from_user(&setup, arg, sizeof(setup))) {
+		return -EFAULT;
+	}
+	if (setup.threshold > DMG_BUF_MAX || setup.quiet_us > DMG_MAX_WAKEUP_US ||
+	    setup.deadline_us > DMG_MAX_WAKEUP_US) {
+		return -EINVAL;
+	}
+
+	spin_lock(&reader->wake_lock);
+	hrtimer_try_to_cancel(&reader->wake_timer);
+	reader->wake_threshold   = setup.threshold;
+	reader->wake_quiet_ns    = (u64) setup.quiet_us * NSEC_PER_USEC;
+	reader->wake_deadline_ns = (u64) setup.deadline_us * NSEC_PER_USEC;
+	reader->burst_start      = 0U;
+	reader->wake_pending     = 0U;
+	// Whatever's already pending is fair game
+	damage_write_once(reader->wake_ready, damage_reader_queued(reader) != 0U);
+	damage_write_once(reader->moderated, setup.threshold > 1U || setup.quiet_us || setup.deadline_us);
+	spin_unlock(&reader->wake_lock);
+
+	damage_reader_wake(reader);
+	return 0;
+}
+
+static long
+    fbdamage_set_events(mxcfb_damage_reader* reader, const void __user* arg)
+{
+	mxcfb_damage_ctx* ctx = reader->ctx;
+	uint32_t          events;
+
+	if (get_user(events, (const uint32_t __user*) arg)) {
+		return -EFAULT;
+	}
+	// Overflow summaries only make sense alongside the events they summarize
+	if (!(events & DMG_RING_EVENTS) || events & ~(uint32_t) (DMG_RING_EVENTS | DAMAGE_EVENT_OVERFLOW)) {
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&reader->lock)) {
+		return -ERESTARTSYS;
+	}
+	if ((events ^ reader->events) & DAMAGE_EVENT_COMPLETION) {
+		if (events & DAMAGE_EVENT_COMPLETION) {
+			atomic_inc(&ctx->completion_readers);
+		} else {
+			atomic_dec(&ctx->completion_readers);
+		}
+	}
+	if ((events ^ reader->events) & DAMAGE_EVENT_OVERFLOW) {
+		if (events & DAMAGE_EVENT_OVERFLOW) {
+			atomic_inc(&ctx->overflow_readers);
+		} else {
+			atomic_dec(&ctx->overflow_readers);
+		}
+	}
+	if ((events ^ reader->events) & DAMAGE_EVENT_GEOMETRY) {
+		if (events & DAMAGE_EVENT_GEOMETRY) {
+			atomic_inc(&ctx->geometry_readers);
+		} else {
+			atomic_dec(&ctx->geometry_readers);
+		}
+	}
+	damage_write_once(reader->events, events);
+	mutex_unlock(&reader->lock);
+	// Don't hand out a stale summary if it's ever turned back on
+	if (!(events & DAMAGE_EVENT_OVERFLOW)) {
+		spin_lock(&reader->lost_lock);
+		memset(&reader->lost, 0, sizeof(reader->lost));
+		spin_unlock(&reader->lost_lock);
+	}
+
+	// What's already queued may have just become interesting
+	damage_reader_wake(reader);
+	return 0;
+}
+
+static long
+    fbdamage_set_filter(mxcfb_damage_reader* reader, const void __user* arg)
+{
+	mxcfb_damage_filter        filter;
+	const mxcfb_damage_filter* old;
+	mxcfb_damage_filter*       new = NULL;
+
+	if (copy_from_user(&filter, arg, sizeof(filter))) {
+		return -EFAULT;
+	}
+	if (filter.nrects > DAMAGE_FILTER_MAX_RECTS || filter.nwaveforms > DAMAGE_FILTER_MAX_WAVEFORMS ||
+	    filter.flags_value & ~filter.flags_mask) {
+		return -EINVAL;
+	}
+
+	// An all-zero filter lets everything through, so don't bother with it
+	if (filter.nrects || filter.nwaveforms || filter.update_modes || filter.min_area || filter.flags_mask) {
+		new = kmemdup(&filter, sizeof(filter), GFP_KERNEL);
+		if (!new) {
+			return -ENOMEM;
+		}
+	}
+
+	if (mutex_lock_interruptible(&reader->lock)) {
+		kfree(new);
+		return -ERESTARTSYS;
+	}
+	old = rcu_dereference_protected(reader->filter, lockdep_is_held(&reader->lock));
+	rcu_assign_pointer(reader->filter, new);
+	mutex_unlock(&reader->lock);
+
+	// Make sure the producers are done looking at the previous one
+	synchronize_rcu();
+	kfree(old);
+
+	// What's already queued may have just become interesting
+	damage_reader_wake(reader);
+	return 0;
+}
+
+static long
+    fbdamage_fetch_filtered(mxcfb_damage_reader* reader, void __user* arg)
+{
+	return put_user((uint32_t) atomic_xchg(&reader->filtered, 0), (uint32_t __user*) arg);
+}
+
+static long
+    fbdamage_get_geometry(mxcfb_damage_reader* reader, void __user* arg)
+{
+	mxcfb_damage_geometry geometry;
+
+	// Catch up with whatever may have changed since the last refresh request
+	damage_geometry_check(reader->ctx);
+	damage_geometry_load(reader->ctx, &geometry);
+	if (copy_to_user(arg, &geometry, sizeof(geometry))) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static long
+    fbdamage_set_snapshots(mxcfb_damage_reader* reader, const void __user* arg)
+{
+	mxcfb_damage_ctx* ctx = reader->ctx;
+	uint32_t          enable;
+
+	if (get_user(enable, (const uint32_t __user*) arg)) {
+		return -EFAULT;
+	}
+	if (!ctx->circ.pixels) {
+		return -EOPNOTSUPP;
+	}
+
+	if (mutex_lock_interruptible(&reader->lock)) {
+		return -ERESTARTSYS;
+	}
+	if (!!enable != reader->snapshots) {
+		if (enable) {
+			atomic_inc(&ctx->snapshot_readers);
+		} else {
+			atomic_dec(&ctx->snapshot_readers);
+		}
+		damage_write_once(reader->snapshots, !!enable);
+	}
+	mutex_unlock(&reader->lock);
+	return 0;
+}
+
+static long
+    fbdamage_inject(const mxcfb_damage_reader* reader, const void __user* arg)
+{
+	mxcfb_damage_ctx*   ctx    = reader->ctx;
+	mxcfb_damage_inject injection;
+	mxcfb_damage_update update = { 0 };
+	// They never went through the driver
+	mxcfb_damage_call   call   = { 0 };
+	uint32_t            i;
+
+	if (!inject) {
+		return -ENOTTY;
+	}
+	if (!capable(CAP_SYS_ADMIN)) {
+		return -EPERM;
+	}
+	if (copy_from_user(&injection, arg, sizeof(injection))) {
+		return -EFAULT;
+	}
+	if (injection.count == 0U || injection.count > FBDAMAGE_INJECT_MAX) {
+		return -EINVAL;
+	}
+	if (injection.format == DAMAGE_UPDATE_DATA_UNKNOWN || injection.format > DAMAGE_UPDATE_DATA_COMPLETION) {
+		return -EINVAL;
+	}
+
+	update.format = injection.format;
+	damage_data_unpack(&update.data, &injection.data);
+	for (i = 0U; i < injection.count; i++) {
+		// NOTE: A DAMAGE_OVERFLOW_BLOCK reader may make each of these take a while
+		if (signal_pending(current)) {
+			return i ? (long) i : -ERESTARTSYS;
+		}
+		if (injection.format == DAMAGE_UPDATE_DATA_COMPLETION) {
+			damage_circ_complete(ctx, injection.data.update_marker, &call);
+		} else {
+			update.timestamp = ktime_to_ns(ktime_get());
+			damage_circ_request(ctx, &update, &call);
+		}
+		cond_resched();
+	}
+
+	return (long) i;
+}
+
+static long
+    fbdamage_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+		case FBDAMAGE_SET_OVERFLOW_POLICY:
+			return fbdamage_set_overflow_policy(file->private_data, (const void __user*) arg);
+		case FBDAMAGE_SET_COALESCING:
+			return fbdamage_set_coalescing(file->private_data, (const void __user*) arg);
+		case FBDAMAGE_SET_TILES:
+			return fbdamage_set_tiles(file->private_data, (void __user*) arg);
+		case FBDAMAGE_FETCH_TILES:
+			return fbdamage_fetch_tiles(file->private_data, (void __user*) arg);
+		case FBDAMAGE_SET_TILE_HASHING:
+			return fbdamage_set_tile_hashing(file->private_data, (const void __user*) arg);
+		case FBDAMAGE_SET_RECORD_FORMAT:
+			return fbdamage_set_record_format(file->private_data, (void __user*) arg);
+		case FBDAMAGE_SET_WAKEUP:
+			return fbdamage_set_wakeup(file->private_data, (const void __user*) arg);
+		case FBDAMAGE_SET_EVENTS:
+			return fbdamage_set_events(file->private_data, (const void __user*) arg);
+		case FBDAMAGE_SET_FILTER:
+			return fbdamage_set_filter(file->private_data, (const void __user*) arg);
+		case FBDAMAGE_FETCH_FILTERED:
+			return fbdamage_fetch_filtered(file->private_data, (void __user*) arg);
+		case FBDAMAGE_SET_SNAPSHOTS:
+			return fbdamage_set_snapshots(file->private_data, (const void __user*) arg);
+		case FBDAMAGE_GET_GEOMETRY:
+			return fbdamage_get_geometry(file->private_data, (void __user*) arg);
+		case FBDAMAGE_INJECT:
+			return fbdamage_inject(file->private_data, (const void __user*) arg);
+		default:
+			return -ENOTTY;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+// NOTE: Our ioctls only take fixed-width fields, laid out the same way on both ABIs (c.f., mxcfb_damage_inject),
+//       so only the pointer itself needs some care.
+static long
+    fbdamage_compat_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+{
+	return fbdamage_ioctl(file, cmd, (unsigned long) compat_ptr(arg));
+}
+#endif
+
+static dev_t                        dev;
+static struct class*                fbdamage_class;
+static const struct file_operations fbdamage_fops = { .owner          = THIS_MODULE,
+						      .open           = fbdamage_open,
+						      .read           = fbdamage_read,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+						      .read_iter      = fbdamage_read_iter,
+#endif
+						      .release        = fbdamage_release,
+						      .poll           = fbdamage_poll,
+						      .mmap           = fbdamage_mmap,
+						      .unlocked_ioctl = fbdamage_ioctl,
+#ifdef CONFIG_COMPAT
+						      .compat_ioctl   = fbdamage_compat_ioctl,
+#endif
+};
+
+static int
+    damage_circ_alloc(mxcfb_damage_ctx* ctx)
+{
+	// NOTE: vmalloc_user hands us zeroed memory, which we need, since we're going to map it into userspace.
+	unsigned long map_size = PAGE_SIZE + PAGE_ALIGN(ring_size * sizeof(mxcfb_damage_slot));
+
+	ctx->circ.header = vmalloc_user(map_size);
+	if (!ctx->circ.header) {
+		return -ENOMEM;
+	}
+	ctx->circ.slots = (mxcfb_damage_slot*) ((char*) ctx->circ.header + PAGE_SIZE);
+	ctx->circ.size  = ring_size;
+	ctx->circ.mask  = ring_size - 1U;
+
+	ctx->circ.header->ring_size      = ring_size;
+	ctx->circ.header->record_size    = sizeof(mxcfb_damage_slot);
+	ctx->circ.header->records_offset = PAGE_SIZE;
+	ctx->circ.header->map_size       = map_size;
+	// Right after the read-only mapping (each reader maps its own cursor there)
+	ctx->circ.header->cursor_offset  = map_size;
+
+#ifndef CONFIG_ARCH_SUNXI
+	if (pixel_arena) {
+		// NOTE: Keep it a whole number of pages, since that's what mmap deals with.
+		const unsigned long arena_size =
+		    max_t(unsigned long, roundup_pow_of_two(pixel_arena) * 1024UL, PAGE_SIZE);
+
+		ctx->circ.pixels = vmalloc_user(arena_size);
+		if (!ctx->circ.pixels) {
+			vfree(ctx->circ.header);
+			return -ENOMEM;
+		}
+		ctx->circ.pixels_mask           = arena_size - 1U;
+		// Right after the cursor
+		ctx->circ.header->pixels_offset = map_size + PAGE_SIZE;
+		ctx->circ.header->pixels_size   = arena_size;
+	}
+#endif
+
+	return 0;
+}
+
+static void
+    damage_circ_free(mxcfb_damage_ctx* ctx)
+{
+	vfree(ctx->circ.pixels);
+	vfree(ctx->circ.header);
+}
+
+#ifdef CONFIG_ARCH_SUNXI
+static ssize_t
+    rotate_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%u\n", g2d_rota);
+}
+
+static struct device_attribute dev_attr_rotate = __ATTR_RO(rotate);
+#endif
+
+// Prints the waveform mode a slot maps to (c.f., damage_waveform_slot), n being the amount of slots in use
+static ssize_t
+    damage_show_waveform(mxcfb_damage_ctx* ctx, char* buf, ssize_t len, uint32_t slot, uint32_t n)
+{
+	if (slot < n) {
+		return scnprintf(buf + len, PAGE_SIZE - len, "%u", ctx->waveform_modes[slot]);
+	}
+	return scnprintf(buf + len, PAGE_SIZE - len, "other");
+}
+
+// One line per waveform mode: waveform_mode count min avg max (the latter three in µs)
+static ssize_t
+    latency_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	mxcfb_damage_ctx*    ctx = dev_get_drvdata(dev);
+	mxcfb_damage_latency stats[DMG_WAVEFORM_SLOTS + 1U];
+	uint32_t             n, i;
+	ssize_t              len = 0;
+
+	spin_lock(&ctx->latency_lock);
+	memcpy(stats, ctx->latency_stats, sizeof(stats));
+	spin_unlock(&ctx->latency_lock);
+	n = damage_load_acquire(&ctx->waveform_slots);
+
+	for (i = 0U; i <= DMG_WAVEFORM_SLOTS; i++) {
+		if (stats[i].count == 0U || (i >= n && i < DMG_WAVEFORM_SLOTS)) {
+			continue;
+		}
+		len += damage_show_waveform(ctx, buf, len, i, n);
+		len += scnprintf(buf + len,
+				 PAGE_SIZE - len,
+				 " %u %llu %llu %llu\n",
+				 stats[i].count,
+				 div_u64(stats[i].min_ns, NSEC_PER_USEC),
+				 div_u64(div_u64(stats[i].total_ns, stats[i].count), NSEC_PER_USEC),
+				 div_u64(stats[i].max_ns, NSEC_PER_USEC));
+	}
+	return len;
+}
+
+static struct device_attribute dev_attr_latency = __ATTR_RO(latency);
+
+// The stats group: one value per attribute, except for the breakdowns, which are one "key count" pair per line.
+// NOTE: Counters are only ever summed at read time, so a reading isn't an atomic snapshot of every CPU.
+#define DAMAGE_STAT_ATTR(field)                                                                                          \
+	static ssize_t field##_show(struct device* dev, struct device_attribute* attr, char* buf)                        \
+	{                                                                                                                \
+		const mxcfb_damage_ctx* ctx = dev_get_drvdata(dev);                                                     \
+		return scnprintf(buf, PAGE_SIZE, "%llu\n", damage_stat_sum(ctx, field));                                \
+	}                                                                                                                \
+	static struct device_attribute dev_attr_##field = __ATTR_RO(field)
+
+DAMAGE_STAT_ATTR(pixels);
+DAMAGE_STAT_ATTR(full);
+DAMAGE_STAT_ATTR(partial);
+DAMAGE_STAT_ATTR(copy_failures);
+DAMAGE_STAT_ATTR(overflows);
+
+// Keyed by mxcfb_damage_data_format
+static ssize_t
+    formats_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	static const char* const names[] = { "unknown",    "v1_ntx",   "v1",       "v2",   "sunxi_kobo_disp2",
+					     "completion", "overflow", "geometry", "error" };
+	const mxcfb_damage_ctx*  ctx     = dev_get_drvdata(dev);
+	ssize_t                  len     = 0;
+	uint32_t                 i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(names) != DMG_STAT_FORMATS);
+	for (i = 0U; i < DMG_STAT_FORMATS; i++) {
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu\n", names[i], damage_stat_sum(ctx, formats[i]));
+	}
+	return len;
+}
+
+static struct device_attribute dev_attr_formats = __ATTR_RO(formats);
+
+// Keyed by waveform_mode, refresh requests only
+static ssize_t
+    waveforms_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	mxcfb_damage_ctx* ctx = dev_get_drvdata(dev);
+	const uint32_t    n   = damage_load_acquire(&ctx->waveform_slots);
+	ssize_t           len = 0;
+	u64               count;
+	uint32_t          i;
+
+	for (i = 0U; i <= DMG_WAVEFORM_SLOTS; i++) {
+		if (i >= n && i < DMG_WAVEFORM_SLOTS) {
+			continue;
+		}
+		count = damage_stat_sum(ctx, waveforms[i]);
+		if (count) {
+			len += damage_show_waveform(ctx, buf, len, i, n);
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %llu\n", count);
+		}
+	}
+	return len;
+}
+
+static struct device_attribute dev_attr_waveforms = __ATTR_RO(waveforms);
+
+static ssize_t
+    max_occupancy_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	const mxcfb_damage_ctx* ctx = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", damage_read_once(ctx->max_occupancy));
+}
+
+static struct device_attribute dev_attr_max_occupancy = __ATTR_RO(max_occupancy);
+
+// Keyed by the lower bound of the bucket, in µs
+static ssize_t
+    lag_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	const mxcfb_damage_ctx* ctx = dev_get_drvdata(dev);
+	ssize_t                 len = 0;
+	uint32_t                i;
+
+	for (i = 0U; i < DMG_LAG_BUCKETS; i++) {
+		len += scnprintf(
+		    buf + len, PAGE_SIZE - len, "%u %llu\n", i ? 1U << (i - 1U) : 0U, damage_stat_sum(ctx, lag[i]));
+	}
+	return len;
+}
+
+static struct device_attribute dev_attr_lag = __ATTR_RO(lag);
+
+// Keyed by waveform_mode, then by the lower bound of the bucket, in µs (empty buckets are skipped)
+static ssize_t
+    blocking_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	mxcfb_damage_ctx* ctx = dev_get_drvdata(dev);
+	const uint32_t    n   = damage_load_acquire(&ctx->waveform_slots);
+	ssize_t           len = 0;
+	u64               count;
+	uint32_t          i, j;
+
+	for (i = 0U; i <= DMG_WAVEFORM_SLOTS; i++) {
+		if (i >= n && i < DMG_WAVEFORM_SLOTS) {
+			continue;
+		}
+		for (j = 0U; j < DMG_LAG_BUCKETS; j++) {
+			count = damage_stat_sum(ctx, blocking[i][j]);
+			if (count) {
+				len += damage_show_waveform(ctx, buf, len, i, n);
+				len += scnprintf(
+				    buf + len, PAGE_SIZE - len, " %u %llu\n", j ? 1U << (j - 1U) : 0U, count);
+			}
+		}
+	}
+	return len;
+}
+
+static struct device_attribute dev_attr_blocking = __ATTR_RO(blocking);
+
+// Any write resets everything (including the latency attribute, but not the waveform mode slots)
+static ssize_t
+    reset_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	mxcfb_damage_ctx* ctx = dev_get_drvdata(dev);
+	int               cpu;
+
+	// NOTE: Best effort, an increment racing with us on another CPU may survive it
+	for_each_possible_cpu(cpu)
+	{
+		memset(per_cpu_ptr(ctx->stats, cpu), 0, sizeof(mxcfb_damage_stats));
+	}
+	damage_write_once(ctx->max_occupancy, 0U);
+
+	spin_lock(&ctx->latency_lock);
+	memset(ctx->latency_stats, 0, sizeof(ctx->latency_stats));
+	spin_unlock(&ctx->latency_lock);
+	return count;
+}
+
+static struct device_attribute dev_attr_reset = __ATTR(reset, 0200, NULL, reset_store);
+
+static struct attribute* damage_stats_attrs[] = {
+	&dev_attr_formats.attr,
+	&dev_attr_waveforms.attr,
+	&dev_attr_pixels.attr,
+	&dev_attr_full.attr,
+	&dev_attr_partial.attr,
+	&dev_attr_copy_failures.attr,
+	&dev_attr_overflows.attr,
+	&dev_attr_max_occupancy.attr,
+	&dev_attr_lag.attr,
+	&dev_attr_blocking.attr,
+	&dev_attr_reset.attr,
+	NULL,
+};
+
+static const struct attribute_group damage_stats_group = { .name = "stats", .attrs = damage_stats_attrs };
+
+// Sets up everything for the framebuffer at index node, which shows up as /dev/fbdamage if primary,
+// or /dev/fbdamageN (N being node) otherwise.
+static int
+    damage_ctx_create(int node, unsigned int minor, bool primary)
+{
+	mxcfb_damage_ctx* ctx;
+	int               ret;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx) {
+		return -ENOMEM;
+	}
+	ctx->fbnode = node;
+	atomic_set(&ctx->event_seq, 0);
+	atomic_set(&ctx->completion_readers, 0);
+	atomic_set(&ctx->overflow_readers, 0);
+	atomic_set(&ctx->snapshot_readers, 0);
+	atomic_set(&ctx->geometry_readers, 0);
+	spin_lock_init(&ctx->submitted_lock);
+	mutex_init(&ctx->snapshot_lock);
+	seqlock_init(&ctx->geometry_lock);
+	// Generation 0 is never handed out, so that you can tell it apart from a record without one
+	damage_geometry_read(ctx, &ctx->geometry);
+	ctx->geometry.generation = 1U;
+	spin_lock_init(&ctx->waveform_lock);
+	spin_lock_init(&ctx->latency_lock);
+	INIT_LIST_HEAD(&ctx->reader_list);
+	mutex_init(&ctx->reader_list_lock);
+	init_waitqueue_head(&ctx->space_queue);
+
+	ctx->stats = alloc_percpu(mxcfb_damage_stats);
+	if (!ctx->stats) {
+		ret = -ENOMEM;
+		goto free_ctx;
+	}
+	if ((ret = damage_circ_alloc(ctx))) {
+		goto free_stats;
+	}
+
+	cdev_init(&ctx->cdev, &fbdamage_fops);
+	ctx->cdev.owner = THIS_MODULE;
+	if ((ret = cdev_add(&ctx->cdev, MKDEV(MAJOR(dev), minor), 1)) < 0) {
+		goto free_circ;
+	}
+
+	// NOTE: The sysfs attributes find their way back to us via the device's driver data
+	if (primary) {
+		ctx->device = device_create(fbdamage_class, NULL, ctx->cdev.dev, ctx, "fbdamage");
+	} else {
+		ctx->device = device_create(fbdamage_class, NULL, ctx->cdev.dev, ctx, "fbdamage%d", node);
+	}
+	if (IS_ERR(ctx->device)) {
+		ret = PTR_ERR(ctx->device);
+		goto del_cdev;
+	}
+
+	// Created @ /sys/devices/virtual/fbdamage/fbdamage/latency (or fbdamageN)
+	if ((ret = device_create_file(ctx->device, &dev_attr_latency))) {
+		goto destroy_device;
+	}
+
+	// Created @ /sys/devices/virtual/fbdamage/fbdamage/stats/ (or fbdamageN)
+	if ((ret = sysfs_create_group(&ctx->device->kobj, &damage_stats_group))) {
+		goto remove_latency;
+	}
+
+#ifdef CONFIG_ARCH_SUNXI
+	// Created @ /sys/devices/virtual/fbdamage/fbdamage/rotate
+	if ((ret = device_create_file(ctx->device, &dev_attr_rotate))) {
+		goto remove_stats;
+	}
+#endif
+
+	damage_ctxs[node] = ctx;
+	return 0;
+
+#ifdef CONFIG_ARCH_SUNXI
+remove_stats:
+	sysfs_remove_group(&ctx->device->kobj, &damage_stats_group);
+#endif
+remove_latency:
+	device_remove_file(ctx->device, &dev_attr_latency);
+destroy_device:
+	device_destroy(fbdamage_class, ctx->cdev.dev);
+del_cdev:
+	cdev_del(&ctx->cdev);
+free_circ:
+	damage_circ_free(ctx);
+free_stats:
+	free_percpu(ctx->stats);
+free_ctx:
+	kfree(ctx);
+	return ret;
+}
+
+static void
+    damage_ctx_destroy(mxcfb_damage_ctx* ctx)
+{
+	damage_ctxs[ctx->fbnode] = NULL;
+
+#ifdef CONFIG_ARCH_SUNXI
+	device_remove_file(ctx->device, &dev_attr_rotate);
+#endif
+	sysfs_remove_group(&ctx->device->kobj, &damage_stats_group);
+	device_remove_file(ctx->device, &dev_attr_latency);
+
+	cdev_del(&ctx->cdev);
+	device_destroy(fbdamage_class, ctx->cdev.dev);
+
+	damage_circ_free(ctx);
+	free_percpu(ctx->stats);
+	kfree(ctx);
+}
+
+static void
+    damage_ctx_destroy_all(void)
+{
+	int i;
+
+	for (i = 0; i < FB_MAX; i++) {
+		if (damage_ctxs[i]) {
+			damage_ctx_destroy(damage_ctxs[i]);
+		}
+	}
+}
+
+#ifndef CONFIG_ARCH_SUNXI
+// Returns true if there's a framebuffer at that index (which, on >= 6.1, we then keep open, c.f., damage_fb_files)
+static bool
+    damage_fb_open(unsigned int node)
+{
+#	if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+	char         path[16];
+	struct file* fp;
+
+	if (damage_fb_files[node]) {
+		return true;
+	}
+	snprintf(path, sizeof(path), "/dev/fb%u", node);
+	fp = filp_open(path, O_RDONLY, 0);
+	if (IS_ERR(fp)) {
+		return false;
+	}
+	damage_fb_files[node] = fp;
+	return true;
+#	else
+	return registered_fb[node] != NULL;
+#	endif
+}
+#endif
+
+static void
+    damage_fb_close_all(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+	int i;
+
+	for (i = 0; i < FB_MAX; i++) {
+		if (damage_fb_files[i]) {
+			filp_close(damage_fb_files[i], NULL);
+			damage_fb_files[i] = NULL;
+		}
+	}
+#endif
+}
+
+#ifndef CONFIG_ARCH_SUNXI
+// Parses the fbnode parameter into a list of framebuffer indices (without duplicates, in the order they were given),
+// returns how many there are, or a negative errno.
+static int
+    damage_parse_fbnodes(int* nodes)
+{
+	char*        list;
+	char*        cursor;
+	char*        token;
+	unsigned int node;
+	int          count = 0;
+	int          ret   = 0;
+	int          i;
+
+	if (sysfs_streq(fbnode, "all")) {
+		for (i = 0; i < FB_MAX; i++) {
+			if (damage_fb_open((unsigned int) i)) {
+				nodes[count++] = i;
+			}
+		}
+		return count ? count : -ENODEV;
+	}
+
+	list = kstrdup(fbnode, GFP_KERNEL);
+	if (!list) {
+		return -ENOMEM;
+	}
+	cursor = list;
+	while ((token = strsep(&cursor, ","))) {
+		if (kstrtouint(token, 10, &node) || node >= FB_MAX) {
+			pr_err("mxc_epdc_fb_damage: fbnode must be a list of framebuffer indices, or all\n");
+			ret = -EINVAL;
+			break;
+		}
+		if (!damage_fb_open(node)) {
+			pr_err("mxc_epdc_fb_damage: there's no fb%u\n", node);
+			ret = -ENODEV;
+			break;
+		}
+		for (i = 0; i < count; i++) {
+			if (nodes[i] == (int) node) {
+				break;
+			}
+		}
+		if (i == count) {
+			nodes[count++] = (int) node;
+		}
+	}
+	kfree(list);
+
+	return ret ? ret : count;
+}
+#endif
+
+int
+    init_module(void)
+{
+	int nodes[FB_MAX];
+	int count, ret, i;
+#ifdef CONFIG_ARCH_SUNXI
+	struct file* fp;
+#endif
+
+	if (sysfs_streq(backend, "kprobe")) {
+#ifdef DMG_HAVE_PROBE
+		damage_probing = true;
+#else
+		pr_err("mxc_epdc_fb_damage: backend=kprobe needs CONFIG_KRETPROBES, on x86_64, arm or arm64\n");
+		return -EOPNOTSUPP;
+#endif
+	} else if (!sysfs_streq(backend, "patch")) {
+		pr_err("mxc_epdc_fb_damage: backend must be either patch or kprobe\n");
+		return -EINVAL;
+	}
+
+	if (!is_power_of_2(ring_size) || ring_size < DMG_BUF_MIN || ring_size > DMG_BUF_MAX) {
+		pr_err("mxc_epdc_fb_damage: ring_size must be a power of two between %u and %u\n",
+		       DMG_BUF_MIN,
+		       DMG_BUF_MAX);
+		return -EINVAL;
+	}
+#ifndef CONFIG_ARCH_SUNXI
+	if (pixel_arena > DMG_ARENA_MAX_KB) {
+		pr_err("mxc_epdc_fb_damage: pixel_arena must be at most %u KiB\n", DMG_ARENA_MAX_KB);
+		return -EINVAL;
+	}
+	// NOTE: Snapshots are taken under a mutex, which a kprobe producer can't take (c.f., damage_probe_return)
+	if (pixel_arena && damage_probing) {
+		pr_err("mxc_epdc_fb_damage: pixel_arena isn't supported with backend=kprobe\n");
+		return -EINVAL;
+	}
+#endif
+
+	// This one is ABI, and is supposed to look the same everywhere
+	BUILD_BUG_ON(offsetof(mxcfb_damage_update_v2, latency) != DAMAGE_RECORD_V2_MIN_SIZE);
+	BUILD_BUG_ON(!IS_ALIGNED(sizeof(mxcfb_damage_update_v2), sizeof(u64)));
+	BUILD_BUG_ON(sizeof(mxcfb_damage_update_v2) > DAMAGE_RECORD_MAX_SIZE);
+	// So is the mmap'ed slot (i.e., no pointers, and 64-bit fields at offsets that even i386 aligns)
+	BUILD_BUG_ON(offsetof(mxcfb_damage_slot, timestamp) != 8U);
+	BUILD_BUG_ON(offsetof(mxcfb_damage_slot, data) != 20U);
+	BUILD_BUG_ON(sizeof(mxcfb_damage_fixed_data) != 80U);
+	BUILD_BUG_ON(offsetof(mxcfb_damage_slot, latency) != 104U);
+	BUILD_BUG_ON(offsetof(mxcfb_damage_slot, pixels) != 112U);
+	BUILD_BUG_ON(offsetof(mxcfb_damage_slot, call) != 128U);
+	BUILD_BUG_ON(offsetof(mxcfb_damage_slot, geometry) != 144U);
+	BUILD_BUG_ON(sizeof(mxcfb_damage_slot) != 184U);
+	// And the injection payload (the only ioctl argument that ever embedded an mxcfb_damage_data)
+	BUILD_BUG_ON(offsetof(mxcfb_damage_inject, data) != 8U);
+	BUILD_BUG_ON(sizeof(mxcfb_damage_inject) != 88U);
+
+#ifdef CONFIG_ARCH_SUNXI
+	// NOTE: Since FW 4.31.19086, this may block significantly longer than it used to during early boot,
+	//       which may introduce race conditions if the module is loaded in parallel to the disp client(s)
+	//       you want to sniff...
+	//       In fact, it may completely deadlock: do *NOT* try to insert this module in a way that would block rcS!
+	//       (The kprobe backend doesn't need it at all).
+	if (!damage_probing) {
+		fp = filp_open("/dev/disp", O_RDONLY, 0);
+		if (IS_ERR(fp)) {
+			pr_err("mxc_epdc_fb_damage: cannot open: `/dev/disp`\n");
+			return -ENODEV;
+		}
+
+		disp_cdev = fp->f_inode->i_cdev;
+
+		filp_close(fp, NULL);
+	}
+
+	// There's only ever the one screen
+	nodes[0] = 0;
+	count    = 1;
+#else
+	if ((count = damage_parse_fbnodes(nodes)) < 0) {
+		damage_fb_close_all();
+		return count;
+	}
+#endif
+
+	// One minor per framebuffer
+	if ((ret = alloc_chrdev_region(&dev, 0, count, "mxc_epdc_fb_damage"))) {
+		damage_fb_close_all();
+		return ret;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	fbdamage_class = class_create("fbdamage");
+#else
+	fbdamage_class = class_create(THIS_MODULE, "fbdamage");
+#endif
+
+	// NOTE: The first one keeps the plain /dev/fbdamage name, so that existing consumers keep working.
+	for (i = 0; i < count; i++) {
+		if ((ret = damage_ctx_create(nodes[i], i, i == 0))) {
+			damage_ctx_destroy_all();
+			class_destroy(fbdamage_class);
+			unregister_chrdev_region(dev, count);
+			damage_fb_close_all();
+			return ret;
+		}
+	}
+	// NOTE: Whichever backend we use (c.f., damage_fb_notify), and it's a no-op without CONFIG_FB_NOTIFY
+	fb_register_client(&damage_fb_notifier);
+
+#ifdef DMG_HAVE_PROBE
+	if (damage_probing) {
+		// Everything went according to plan, hook the thing for real!
+		if ((ret = register_kretprobe(&damage_probe))) {
+			pr_err("mxc_epdc_fb_damage: cannot probe `%s` (%d)\n", damage_probe.kp.symbol_name, ret);
+			fb_unregister_client(&damage_fb_notifier);
+			damage_ctx_destroy_all();
+			class_destroy(fbdamage_class);
+			unregister_chrdev_region(dev, count);
+			damage_fb_close_all();
+			return ret;
+		}
+		return 0;
+	}
+#endif
 
 #ifdef CONFIG_ARCH_SUNXI
 	orig_disp_ioctl = disp_cdev->ops->unlocked_ioctl;
@@ -460,30 +3785,28 @@ int
 	//       (We never really unload the module outside of development/debugging scenarios, though).
 	orig_disp_fops                   = disp_cdev->ops;
 	patched_disp_fops                = *orig_disp_fops;
-	patched_disp_fops.unlocked_ioctl = disp_ioctl;
+	patched_disp_fops.unlocked_ioctl = fbdamage_disp_ioctl;
+
+	// Everything went according to plan, patch the thing for real!
+	disp_cdev->ops = &patched_disp_fops;
 #else
-	orig_fb_ioctl                          = registered_fb[fbnode]->fbops->fb_ioctl;
+	// Everything went according to plan, patch the things for real!
 	// NOTE: Much like the file_operations above, this will become much hairier on newer kernels (>= 5.6),
 	//       since https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/commit/include/linux/fb.h?id=bf9e25ec12877a622857460c2f542a6c31393250 made it const ;).
-	registered_fb[fbnode]->fbops->fb_ioctl = fb_ioctl;
-#endif
-
-	fbdamage_class  = class_create(THIS_MODULE, "fbdamage");
-	fbdamage_device = device_create(fbdamage_class, NULL, dev, NULL, "fbdamage");
-
-#ifdef CONFIG_ARCH_SUNXI
-	// Created @ /sys/devices/virtual/fbdamage/fbdamage/rotate
-	if ((ret = device_create_file(fbdamage_device, &dev_attr_rotate))) {
-		cdev_del(&cdev);
-		device_destroy(fbdamage_class, dev);
-		class_destroy(fbdamage_class);
-		unregister_chrdev_region(dev, 1);
-
-		return ret;
+	for (i = 0; i < count; i++) {
+		mxcfb_damage_ctx* ctx   = damage_ctxs[nodes[i]];
+		// NOTE: On >= 5.6, it's on whoever asked for backend=patch to make sure these are actually writable.
+		struct fb_ops*    fbops = (struct fb_ops*) damage_fb_info(ctx->fbnode)->fbops;
+
+		// Several framebuffers may share the same fb_ops, which we only ever want to patch once
+		if (fbops->fb_ioctl == fb_ioctl) {
+			ctx->orig_fb_ioctl = damage_orig_fb_ioctl(fbops);
+		} else {
+			ctx->orig_fb_ioctl = fbops->fb_ioctl;
+			fbops->fb_ioctl    = fb_ioctl;
+		}
+		ctx->fbops = fbops;
 	}
-
-	// Everything went according to plan, patch the thing for real!
-	disp_cdev->ops = &patched_disp_fops;
 #endif
 	return 0;
 }
@@ -491,20 +3814,38 @@ int
 void
     cleanup_module(void)
 {
-#ifdef CONFIG_ARCH_SUNXI
-	device_remove_file(fbdamage_device, &dev_attr_rotate);
+	unsigned int count = 0U;
+	int          i;
+
+	if (damage_probing) {
+#ifdef DMG_HAVE_PROBE
+		// NOTE: This waits for the handlers that are still running, so the contexts are safe to destroy.
+		unregister_kretprobe(&damage_probe);
+		if (damage_probe.nmissed) {
+			pr_warn("mxc_epdc_fb_damage: missed %d ioctls (too many at once)\n", damage_probe.nmissed);
+		}
 #endif
-
-	cdev_del(&cdev);
-	device_destroy(fbdamage_class, dev);
-	class_destroy(fbdamage_class);
-	unregister_chrdev_region(dev, 1);
-
+	} else {
 #ifdef CONFIG_ARCH_SUNXI
-	disp_cdev->ops = orig_disp_fops;
+		disp_cdev->ops = orig_disp_fops;
 #else
-	registered_fb[fbnode]->fbops->fb_ioctl = orig_fb_ioctl;
+		for (i = 0; i < FB_MAX; i++) {
+			// NOTE: The first context sharing a given fb_ops restores it for all of them
+			if (damage_ctxs[i] && damage_ctxs[i]->fbops->fb_ioctl == fb_ioctl) {
+				damage_ctxs[i]->fbops->fb_ioctl = damage_ctxs[i]->orig_fb_ioctl;
+			}
+		}
 #endif
+	}
+
+	fb_unregister_client(&damage_fb_notifier);
+	for (i = 0; i < FB_MAX; i++) {
+		count += damage_ctxs[i] != NULL;
+	}
+	damage_ctx_destroy_all();
+	class_destroy(fbdamage_class);
+	unregister_chrdev_region(dev, count);
+	damage_fb_close_all();
 }
 
 MODULE_LICENSE("GPL");
@@ -11,7 +11,10 @@
 #ifndef __KERNEL__
 #	include <stdint.h>
 #	include <stdbool.h>
+#	include <sys/ioctl.h>
 #	define NSEC_PER_SEC 1000000000ULL
+#else
+#	include <linux/ioctl.h>
 #endif
 
 // Indicates the ioctl variant used (per damage event).
@@ -22,8 +25,15 @@ typedef enum
 	DAMAGE_UPDATE_DATA_V1,    // Nothing should actually use this one in practice, even on the Aura
 	DAMAGE_UPDATE_DATA_V2,
 	DAMAGE_UPDATE_DATA_SUNXI_KOBO_DISP2,
-	DAMAGE_UPDATE_DATA_ERROR = 0xFF,
+	DAMAGE_UPDATE_DATA_COMPLETION,    // Not a refresh request, but its completion (c.f., FBDAMAGE_SET_EVENTS)
+	DAMAGE_UPDATE_DATA_OVERFLOW,      // Not a refresh request, but a summary of the ones you lost (ditto)
+	DAMAGE_UPDATE_DATA_GEOMETRY,      // Not a refresh request, but a change of the framebuffer's layout (ditto)
+	DAMAGE_UPDATE_DATA_ERROR = 0xFF,    // A refresh request we couldn't read (see below)
 } mxcfb_damage_data_format;
+// NOTE: With backend=kprobe, the ioctl's data is read from the probe's return handler, which can't take page faults:
+//       if the caller's copy of it isn't resident by then, a refresh request is reported as DAMAGE_UPDATE_DATA_ERROR,
+//       and its completion (c.f., DAMAGE_EVENT_COMPLETION) is lost entirely (only counted as a copy failure).
+//       This is rare in practice, since the driver itself just read that very memory.
 
 // NOTE: We mimic these mxcfb structs because there are minor variants depending on the exact ioctl being used,
 //       and this also allows us to entirely avoid a dependency on kernel headers.
@@ -77,4 +87,352 @@ typedef struct
 	mxcfb_damage_data        data;
 } mxcfb_damage_update;
 
+// The ring buffer itself can also be mmap'ed, in which case you can drain it without any syscalls.
+// Offset 0 maps (read-only) the ring header page, immediately followed by the slots themselves.
+// The header's cursor_offset maps (read-write) the cursor page, which is where the consumer's tail lives
+// (every open file description gets its own, so concurrent readers don't step on each other's toes).
+// Both indices are free-running sequence numbers: the amount of queued events is simply head - tail,
+// and a sequence number maps to the slot at index (seq & (ring_size - 1)).
+// The consumer must load head with acquire semantics *before* reading the slots it covers,
+// and store tail with release semantics *after* it's done reading them (exactly like read() does).
+// If head - tail > ring_size, the producer has already lapped you (c.f., DAMAGE_OVERFLOW_OVERWRITE_OLDEST),
+// skip ahead to head - ring_size + 1.
+// Each slot is tagged with the sequence number of the record it holds: load it with acquire semantics,
+// copy the record, then (after a read barrier) check that it hasn't changed.
+// If it doesn't match the sequence number you expected, the record was overwritten under your feet:
+// same as above, skip ahead.
+// If the module was loaded with a pixel arena (c.f., FBDAMAGE_SET_SNAPSHOTS), pixels_offset maps it (read-only).
+typedef struct
+{
+	uint32_t head;              // Sequence number of the next record to be written by the kernel
+	uint32_t overflows;         // Cumulative amount of events dropped by the producer because of a full ring
+	uint32_t ring_size;         // Amount of slots in the ring (always a power of two)
+	uint32_t record_size;       // Stride between slots, in bytes
+	uint32_t records_offset;    // Offset of the first slot from the start of the mapping, in bytes
+	uint32_t map_size;          // Size of the read-only mapping at offset 0, in bytes
+	uint32_t cursor_offset;     // mmap offset of the read-write cursor page, in bytes
+	uint32_t pixels_offset;     // mmap offset of the pixel arena, in bytes (0 if there isn't one)
+	uint32_t pixels_size;       // Size of the pixel arena, in bytes (always a power of two)
+	uint32_t pixels_head;       // Free-running position of the end of the latest snapshot, in bytes
+} mxcfb_damage_ring_header;
+
+// Where to find the pixel snapshot of an event (c.f., FBDAMAGE_SET_SNAPSHOTS)
+typedef enum
+{
+	DAMAGE_PIXELS_NONE = 0,       // No snapshot (i.e., nobody asked for one, or not a refresh request)
+	DAMAGE_PIXELS_OK,             // It's there
+	DAMAGE_PIXELS_DROPPED,        // The arena was full (or the region is larger than the whole arena)
+	DAMAGE_PIXELS_UNSUPPORTED,    // We can't get at those pixels (e.g., alt buffer updates, or < 8bpp)
+} mxcfb_damage_pixels_status;
+
+typedef struct
+{
+	uint32_t offset;    // Free-running position in the arena, in bytes (i.e., at offset & (pixels_size - 1))
+	uint32_t length;    // In bytes (a snapshot never wraps around the end of the arena)
+	uint32_t stride;    // Bytes per row (rows are tightly packed, top to bottom, in the framebuffer's pixel format)
+	uint32_t status;    // mxcfb_damage_pixels_status
+} mxcfb_damage_pixels;
+
+// What happened in the driver's own ioctl handler (i.e., MXCFB_SEND_UPDATE, or the wait for its completion).
+// NOTE: The event's timestamp is taken once it returns, so timestamp - duration is when the ioctl was issued.
+typedef struct
+{
+	uint64_t duration;    // Time spent in there, in nanoseconds (0 for injected events)
+	int32_t  ret;         // What it returned (i.e., 0, or -errno)
+	uint32_t reserved;
+} mxcfb_damage_call;
+
+typedef struct
+{
+	uint32_t tail;    // Sequence number of the next record to be consumed
+} mxcfb_damage_ring_cursor;
+
+// The framebuffer's layout, i.e., everything it takes to map an update_region to an offset in framebuffer memory.
+// The generation starts at 1, and goes up by one every time any of the other fields changes
+// (c.f., DAMAGE_EVENT_GEOMETRY). Pan offsets don't count, they move on every flip.
+typedef struct
+{
+	uint32_t generation;
+	uint32_t xres;
+	uint32_t yres;
+	uint32_t xres_virtual;
+	uint32_t yres_virtual;
+	uint32_t bits_per_pixel;
+	uint32_t line_length;    // Bytes per row
+	uint32_t rotate;         // FB_ROTATE_* on mxc, the g2d rotation in degrees on sunxi (c.f., the rotate attribute)
+	uint32_t grayscale;
+	uint32_t reserved;
+} mxcfb_damage_geometry;
+
+// Same thing as mxcfb_damage_data, minus alt_buffer_data.virt_addr, in fixed-width fields only,
+// so that it looks exactly the same to 32-bit & 64-bit userspace (unlike mxcfb_damage_data).
+typedef struct
+{
+	mxcfb_damage_rect update_region;
+	uint32_t          waveform_mode;
+	uint32_t          update_mode;
+	uint32_t          update_marker;
+	int32_t           temp;
+	uint32_t          flags;
+	int32_t           dither_mode;
+	int32_t           quant_bit;
+	uint32_t          alt_phys_addr;
+	uint32_t          alt_width;
+	uint32_t          alt_height;
+	mxcfb_damage_rect alt_update_region;
+	uint32_t          rotate;
+	uint32_t          pen_mode;
+} mxcfb_damage_fixed_data;
+
+// NOTE: Like mxcfb_damage_update_v2, 64-bit fields sit at naturally aligned offsets,
+//       so the layout doesn't depend on the ABI (e.g., i386 only aligns them to 4 bytes).
+//       There's no overflow_notify nor queue_size, c.f., the ring header's overflows & head.
+typedef struct
+{
+	uint32_t                seq;          // Sequence number of the record held in this slot
+	uint32_t                event;        // Sequence number of the event itself (c.f., mxcfb_damage_update_v2)
+	uint64_t                timestamp;    // In nanoseconds, time reference is CLOCK_MONOTONIC
+	uint32_t                format;       // mxcfb_damage_data_format
+	mxcfb_damage_fixed_data data;
+	uint32_t                reserved;
+	uint64_t                latency;      // Only for DAMAGE_UPDATE_DATA_COMPLETION, in nanoseconds
+	mxcfb_damage_pixels     pixels;
+	mxcfb_damage_call       call;
+	mxcfb_damage_geometry   geometry;     // The layout the record was queued under
+} mxcfb_damage_slot;
+
+// ioctls on /dev/fbdamage
+#define FBDAMAGE_IOCTL_MAGIC 'D'
+
+// What the producer does when a reader's view of the ring is full.
+// This is per open, and defaults to DAMAGE_OVERFLOW_OVERWRITE_OLDEST.
+// NOTE: The ring itself is shared by every reader, so DAMAGE_OVERFLOW_DROP_NEWEST & DAMAGE_OVERFLOW_BLOCK
+//       apply backpressure to the producer, which affects *every* reader.
+// NOTE: DAMAGE_OVERFLOW_BLOCK fails with -EOPNOTSUPP if the module was loaded with backend=kprobe
+//       (its producers can't sleep).
+typedef enum
+{
+	DAMAGE_OVERFLOW_DROP_NEWEST = 0,     // The new event is discarded
+	DAMAGE_OVERFLOW_OVERWRITE_OLDEST,    // The oldest unread event is overwritten (i.e., the slow reader loses it)
+	DAMAGE_OVERFLOW_BLOCK,               // The producer blocks for up to timeout_us, then drops the new event
+} mxcfb_damage_overflow_policy;
+
+typedef struct
+{
+	uint32_t policy;        // mxcfb_damage_overflow_policy
+	uint32_t timeout_us;    // Only for DAMAGE_OVERFLOW_BLOCK, in µs (at most one second)
+} mxcfb_damage_overflow_setup;
+
+#define FBDAMAGE_SET_OVERFLOW_POLICY _IOW(FBDAMAGE_IOCTL_MAGIC, 0x01, mxcfb_damage_overflow_setup)
+
+// In coalescing mode, read() returns merged regions instead of raw events (per open, disabled by default).
+// Regions that touch are merged together (optionally only if they share the same waveform_mode and/or update_mode),
+// and everything but update_region is inherited from the latest event that was merged in.
+// queue_size is the amount of rectangles left to read, *including* this one.
+#define DAMAGE_COALESCE_MAX_RECTS 64U
+
+typedef enum
+{
+	DAMAGE_COALESCE_BY_WAVEFORM    = 1U << 0,    // Only merge regions refreshed with the same waveform_mode
+	DAMAGE_COALESCE_BY_UPDATE_MODE = 1U << 1,    // Only merge regions refreshed with the same update_mode
+} mxcfb_damage_coalesce_flags;
+
+typedef struct
+{
+	uint32_t max_rects;    // Above that, everything is merged into a single bounding box. 0 disables coalescing.
+	uint32_t flags;        // mxcfb_damage_coalesce_flags
+} mxcfb_damage_coalesce_setup;
+
+#define FBDAMAGE_SET_COALESCING _IOW(FBDAMAGE_IOCTL_MAGIC, 0x02, mxcfb_damage_coalesce_setup)
+
+// Tile tracking (per open, disabled by default, and independent from read()):
+// every event marks the fixed-size tiles its update_region touches in a dirty bitmap
+// (which, unlike the ring, never overflows), and FBDAMAGE_FETCH_TILES copies that bitmap out & clears it in one go.
+// Tile (col, row) is bit (n & 31) of word (n >> 5), with n = row * cols + col.
+#define DAMAGE_TILE_SIZE_MIN 8U
+#define DAMAGE_TILE_SIZE_MAX 256U
+
+typedef struct
+{
+	uint32_t tile_size;    // In pixels, a power of two between DAMAGE_TILE_SIZE_MIN & MAX. 0 disables tracking.
+	uint32_t cols;         // Out: amount of tiles per row (the grid covers the whole screen)
+	uint32_t rows;         // Out: amount of rows
+	uint32_t words;        // Out: size of the bitmap, in 32-bit words
+} mxcfb_damage_tiles_setup;
+
+#define FBDAMAGE_SET_TILES _IOWR(FBDAMAGE_IOCTL_MAGIC, 0x03, mxcfb_damage_tiles_setup)
+
+typedef struct
+{
+	uint64_t bitmap;    // Pointer to an array of (at least) words uint32_t
+	uint32_t words;     // Size of that array, in 32-bit words. Out: amount of words written
+	uint32_t dirty;     // Out: amount of dirty tiles
+} mxcfb_damage_tiles_fetch;
+
+#define FBDAMAGE_FETCH_TILES _IOWR(FBDAMAGE_IOCTL_MAGIC, 0x04, mxcfb_damage_tiles_fetch)
+
+// Content hashing, on top of tile tracking (per open, disabled by default): a tile is then only marked dirty
+// if what's in the framebuffer there actually changed since the last event that touched it
+// (e.g., an app re-sending an identical region, or a full refresh that only cleans up ghosting, dirties nothing).
+// Every tile an event touches is hashed (CRC32) straight from the framebuffer at submission time, and compared to
+// its previous hash. That happens once per event, on a grid of DAMAGE_TILE_SIZE_MIN px tiles shared by every hashing
+// reader, whatever their own tile size: the baseline is taken when the first one enables it.
+// NOTE: Since it's shared, a tile is compared to what was there for the last event that touched it,
+//       including the ones your filter rejected.
+// Tiles we can't look into (e.g., alt buffer updates, sub-byte pixel formats) are always marked dirty.
+// Takes 1 to enable it, 0 to disable it.
+// NOTE: Only on mxc (-EOPNOTSUPP otherwise), as on sunxi, what disp refreshes isn't necessarily in the framebuffer.
+#define FBDAMAGE_SET_TILE_HASHING _IOW(FBDAMAGE_IOCTL_MAGIC, 0x0C, uint32_t)
+
+// read() returns mxcfb_damage_update records by default, but FBDAMAGE_SET_RECORD_FORMAT can switch
+// an open file description to the much more compact mxcfb_damage_update_v2
+// (which is also pointer-free, so it looks the same on every ABI).
+typedef enum
+{
+	DAMAGE_RECORD_V1 = 1,    // mxcfb_damage_update, frozen
+	DAMAGE_RECORD_V2,        // mxcfb_damage_update_v2, extensible (new fields are only ever appended)
+} mxcfb_damage_record_version;
+
+typedef struct
+{
+	uint16_t top;
+	uint16_t left;
+	uint16_t width;
+	uint16_t height;
+} mxcfb_damage_rect16;
+
+// NOTE: There's no overflow_notify nor queue_size: the event sequence number takes care of both
+//       (a gap means you've missed some events, modulo coalescing, which merges them).
+typedef struct
+{
+	uint64_t              timestamp;        // In nanoseconds, time reference is CLOCK_MONOTONIC
+	uint32_t              seq;              // Sequence number of the event (including the ones the ring had to drop)
+	uint32_t              update_marker;
+	mxcfb_damage_rect16   region;           // i.e., update_region
+	uint32_t              flags;
+	uint16_t              waveform_mode;
+	uint8_t               update_mode;
+	uint8_t               format;           // mxcfb_damage_data_format
+	uint64_t              latency;          // Only for DAMAGE_UPDATE_DATA_COMPLETION, in nanoseconds
+	mxcfb_damage_pixels   pixels;
+	mxcfb_damage_call     call;             // Zeroed for coalesced records
+	mxcfb_damage_geometry geometry;         // Layout it was queued under (the current one for overflow & coalesced)
+} mxcfb_damage_update_v2;
+
+#define DAMAGE_RECORD_V2_MIN_SIZE 32U
+#define DAMAGE_RECORD_MAX_SIZE    256U
+
+typedef struct
+{
+	uint32_t version;    // mxcfb_damage_record_version
+	uint32_t size;       // sizeof your record struct, i.e., the stride of read(). Out: how much of it we fill.
+} mxcfb_damage_record_format;
+
+#define FBDAMAGE_SET_RECORD_FORMAT _IOWR(FBDAMAGE_IOCTL_MAGIC, 0x05, mxcfb_damage_record_format)
+
+// Wakeup moderation (per open, disabled by default):
+// instead of waking you up (poll & blocking reads) for every single event,
+// the kernel waits for whichever comes first of these (0 disables a condition):
+typedef struct
+{
+	uint32_t threshold;      // That many records you'd actually get are waiting (c.f., FBDAMAGE_SET_EVENTS)
+	uint32_t quiet_us;       // No new event came in for that long (i.e., the burst is over)
+	uint32_t deadline_us;    // It's been that long since the first event of the burst
+	uint32_t reserved;
+} mxcfb_damage_wakeup_setup;
+
+#define FBDAMAGE_SET_WAKEUP _IOW(FBDAMAGE_IOCTL_MAGIC, 0x06, mxcfb_damage_wakeup_setup)
+
+// What gets queued for you (per open, only refresh requests by default).
+// Completion events are queued when the kernel reports a refresh as done to whoever waited on its update_marker
+// (i.e., MXCFB_WAIT_FOR_UPDATE_COMPLETE, or DISP_EINK_WAIT_FRAME_SYNC_COMPLETE on sunxi).
+// They carry the data of the matching request, and the submission to completion latency
+// (only in v2 records & mmap slots, v1 records only have the completion's timestamp).
+// NOTE: They're only ever queued in the ring, coalescing & tile tracking only care about refresh requests.
+// Overflow summaries fold every refresh request you lost to an overflow (be it dropped, or overwritten before you
+// got to it) into a single record, which read() hands out right before the next one you *do* get:
+// update_region is their bounding box (the whole screen if one of them had no data),
+// waveform_mode & update_mode are those of the most aggressive one (full beats partial, then the largest one wins),
+// flags are the union of theirs, and timestamp & seq (in v2 records) are those of the latest one.
+// That way, you only have to re-process that area, instead of assuming the whole screen is dirty.
+// NOTE: They're never queued in the ring itself, so mmap consumers don't get them,
+//       and they're not subject to FBDAMAGE_SET_FILTER (only the refreshes that went through it are folded in).
+// Geometry changes are queued whenever the framebuffer's layout changes (resolution, depth, stride or rotation,
+// be it via FBIOPUT_VSCREENINFO, the fb sysfs attributes, or a new g2d rotation on sunxi).
+// Every v2 record & mmap slot carries the layout it was queued under (c.f., mxcfb_damage_geometry),
+// these just let you know as soon as it happens, and even if nothing gets refreshed afterwards.
+// That way, you can keep whatever you derived from it around until the generation changes.
+// v1 records only get the new resolution (as the update_region), and the new rotation (in data.rotate).
+// NOTE: A change is noticed as soon as fbmem applies it (via the fb notifier chain, so, with CONFIG_FB_NOTIFY),
+//       or when the kernel sees it go through FBIOPUT_VSCREENINFO (with backend=kprobe),
+//       or at the latest, with the next refresh request (before it gets queued, e.g., a new g2d rotation on sunxi).
+//       They're not subject to FBDAMAGE_SET_FILTER, and coalescing & tile tracking ignore them.
+typedef enum
+{
+	DAMAGE_EVENT_REFRESH    = 1U << 0,    // Refresh requests, i.e., every format but COMPLETION, OVERFLOW & GEOMETRY
+	DAMAGE_EVENT_COMPLETION = 1U << 1,    // i.e., DAMAGE_UPDATE_DATA_COMPLETION
+	DAMAGE_EVENT_OVERFLOW   = 1U << 2,    // i.e., DAMAGE_UPDATE_DATA_OVERFLOW
+	DAMAGE_EVENT_GEOMETRY   = 1U << 3,    // i.e., DAMAGE_UPDATE_DATA_GEOMETRY
+} mxcfb_damage_event_mask;
+
+#define FBDAMAGE_SET_EVENTS _IOW(FBDAMAGE_IOCTL_MAGIC, 0x07, uint32_t)
+
+// Debugging aid: pushes synthetic events through the exact same path as the real ioctls,
+// so that the ring & its readers can be exercised without an EPDC (e.g., with the module loaded against vfb).
+// Only available if the module was loaded with inject=1, and requires CAP_SYS_ADMIN (-EPERM otherwise).
+// The timestamp is set by the kernel, format must be a refresh format or DAMAGE_UPDATE_DATA_COMPLETION
+// (in which case only data.update_marker matters, and it completes the matching request, if any).
+// The event is repeated count times (at most FBDAMAGE_INJECT_MAX, one at a time, like the real thing).
+// Returns the amount of events injected (which may fall short of count if a signal interrupted us).
+#define FBDAMAGE_INJECT_MAX 1024U
+// NOTE: data is an mxcfb_damage_fixed_data (and format a plain uint32_t), so that 32-bit callers get the same layout.
+typedef struct
+{
+	uint32_t                format;    // mxcfb_damage_data_format
+	uint32_t                count;
+	mxcfb_damage_fixed_data data;
+} mxcfb_damage_inject;
+
+#define FBDAMAGE_INJECT _IOW(FBDAMAGE_IOCTL_MAGIC, 0x08, mxcfb_damage_inject)
+
+// Per open event filter (disabled by default, and an all-zero filter disables it again).
+// Every criterion is optional (0 disables it), an event has to match all the enabled ones to go through.
+// Filtered out events never wake you up, aren't handed out by read, and don't reach your coalesced rectangles
+// or your tile bitmap either. They're counted, though (c.f., FBDAMAGE_FETCH_FILTERED),
+// so that you can tell them apart from the ones you lost to an overflow (which read reports in overflow_notify).
+// NOTE: Records without any data (i.e., DAMAGE_UPDATE_DATA_UNKNOWN & DAMAGE_UPDATE_DATA_ERROR) always go through,
+//       since that damage could be anywhere. Completion events are filtered based on the data of their request.
+// NOTE: mmap consumers still see every record in the ring, the filter only affects wakeups & read.
+#define DAMAGE_FILTER_MAX_RECTS     16U
+#define DAMAGE_FILTER_MAX_WAVEFORMS 16U
+typedef struct
+{
+	uint32_t          nrects;          // The region has to intersect at least one of rects
+	uint32_t          nwaveforms;      // The waveform_mode has to be one of waveform_modes
+	uint32_t          update_modes;    // Bitmask of allowed update_mode values (i.e., bit n allows update_mode n)
+	uint32_t          min_area;        // The region has to be at least that large, in pixels
+	uint32_t          flags_mask;      // The update's flags have to match flags_value on every bit of flags_mask
+	uint32_t          flags_value;
+	uint32_t          waveform_modes[DAMAGE_FILTER_MAX_WAVEFORMS];
+	mxcfb_damage_rect rects[DAMAGE_FILTER_MAX_RECTS];
+} mxcfb_damage_filter;
+
+#define FBDAMAGE_SET_FILTER _IOW(FBDAMAGE_IOCTL_MAGIC, 0x09, mxcfb_damage_filter)
+// Fetches (and resets) the amount of events your filter has rejected
+#define FBDAMAGE_FETCH_FILTERED _IOR(FBDAMAGE_IOCTL_MAGIC, 0x0A, uint32_t)
+
+// Pixel snapshots (per open, disabled by default, pass a non-zero value to enable them):
+// while at least one reader asked for them, the pixels of every update_region are copied from the framebuffer
+// into a pixel arena when the refresh is requested, so that you get exactly the pixels that were refreshed,
+// even if the app has drawn something else in the meantime. The arena is a byte ring, mapped read-only via mmap
+// (c.f., mxcfb_damage_ring_header), and each record tells you where its snapshot lives (in v2 records & mmap slots).
+// A snapshot is never overwritten while a reader that asked for them still has its record queued:
+// if there's no room left, that event's snapshot is dropped instead (c.f., DAMAGE_PIXELS_DROPPED).
+// NOTE: Coalesced rectangles don't carry any snapshot.
+// NOTE: Only on mxc, and only if the module was loaded with a pixel_arena (-EOPNOTSUPP otherwise).
+#define FBDAMAGE_SET_SNAPSHOTS _IOW(FBDAMAGE_IOCTL_MAGIC, 0x0B, uint32_t)
+
+// Fetches the current layout (and its generation), so that you have something to start from (c.f., DAMAGE_EVENT_GEOMETRY)
+#define FBDAMAGE_GET_GEOMETRY _IOR(FBDAMAGE_IOCTL_MAGIC, 0x0D, mxcfb_damage_geometry)
+
 #endif
@@ -0,0 +1,256 @@
+/*
+	mxc_epdc_fb_damage: The damage ring itself, shared between the module and a userspace test harness
+	Kobo port copyright (C) 2021-2022 NiLuJe <ninuje@gmail.com>
+	SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#ifndef __MXCFB_DAMAGE_RING_H
+#define __MXCFB_DAMAGE_RING_H
+
+// NOTE: This builds both in the kernel and in userspace (c.f., utils/damage_ring_test.c),
+//       so that the lockless parts can be hammered (and benchmarked) under ThreadSanitizer on any old machine.
+//       In userspace, everything goes through the C11 memory model via the __atomic builtins
+//       (the structs are ABI, so they can't be made _Atomic).
+#ifdef __KERNEL__
+#	include <linux/atomic.h>
+#	include <linux/compiler.h>
+#	include <linux/version.h>
+#else
+#	include <sched.h>
+#	include <stdbool.h>
+#	include <stddef.h>
+#	include <stdint.h>
+#endif
+
+#include "mxc_epdc_fb_damage.h"
+
+// Ordering helpers, so that we don't have to sprinkle version checks around every single access to the ring indices
+#ifdef __KERNEL__
+#	if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
+#		define damage_load_acquire(p)     smp_load_acquire(p)
+#		define damage_store_release(p, v) smp_store_release(p, v)
+#	else
+#		define damage_load_acquire(p)                                                                           \
+			({                                                                                               \
+				__typeof__(*(p)) ___v = ACCESS_ONCE(*(p));                                               \
+				smp_mb();                                                                                \
+				___v;                                                                                    \
+			})
+#		define damage_store_release(p, v)                                                                       \
+			do {                                                                                             \
+				smp_mb();                                                                                \
+				ACCESS_ONCE(*(p)) = (v);                                                                 \
+			} while (0)
+#	endif
+#	if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+#		define damage_read_once(x)     READ_ONCE(x)
+#		define damage_write_once(x, v) WRITE_ONCE(x, v)
+#	else
+#		define damage_read_once(x)     ACCESS_ONCE(x)
+#		define damage_write_once(x, v) (ACCESS_ONCE(x) = (v))
+#	endif
+#	define damage_cmpxchg(p, old, new) cmpxchg(p, old, new)
+#	define damage_cpu_relax()          cpu_relax()
+#else
+#	define damage_load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#	define damage_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#	define damage_read_once(x)        __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#	define damage_write_once(x, v)    __atomic_store_n(&(x), v, __ATOMIC_RELAXED)
+#	define damage_cmpxchg(p, old, new)                                                                              \
+		({                                                                                                       \
+			__typeof__(*(p)) ___old = (old);                                                                 \
+			__atomic_compare_exchange_n(p, &___old, new, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);         \
+			___old;                                                                                          \
+		})
+// NOTE: Unlike a kernel producer, a userspace one may get preempted while another one is waiting on it
+#	define damage_cpu_relax() sched_yield()
+#endif
+
+// NOTE: head & tail are free-running sequence numbers, which means the whole ring is usable,
+//       and that the amount of events queued for a reader is simply head - tail (modulo 2^32).
+//       They live in pages shared with userspace, in order to allow consumers to drain the ring via mmap.
+//       There's a single ring, but every reader gets its own tail (and its own cursor page).
+//       Producers don't take any lock: they claim a sequence number via cmpxchg on reserved,
+//       fill their slot, and then publish head in sequence number order (c.f., damage_ring_commit).
+typedef struct
+{
+	mxcfb_damage_ring_header* header;      // Mapped read-only in userspace, head lives here
+	mxcfb_damage_slot*        slots;       // Follows the header page, in the same vmalloc area
+	uint32_t                  size;
+	uint32_t                  mask;
+	uint32_t                  reserved;    // Sequence number of the next record up for grabs by a producer
+	unsigned char*            pixels;      // The pixel arena (c.f., FBDAMAGE_SET_SNAPSHOTS), NULL if there isn't one
+	uint32_t                  pixels_mask;
+} mxcfb_damage_circ_buf;
+
+static inline mxcfb_damage_slot*
+    damage_ring_slot(const mxcfb_damage_circ_buf* circ, uint32_t seq)
+{
+	return &circ->slots[seq & circ->mask];
+}
+
+// If the producer lapped a reader, returns the oldest record still in the ring, tail otherwise
+static inline uint32_t
+    damage_ring_oldest(const mxcfb_damage_circ_buf* circ, uint32_t head, uint32_t tail)
+{
+	return head - tail > circ->size ? head - circ->size : tail;
+}
+
+// Amount of records waiting to be read by a reader (that may have been lapped)
+static inline uint32_t
+    damage_ring_queued(const mxcfb_damage_circ_buf* circ, uint32_t tail)
+{
+	const uint32_t head = damage_load_acquire(&circ->header->head);
+
+	return head - damage_ring_oldest(circ, head, tail);
+}
+
+// Waits until the slot the next record would land in isn't busy anymore, and returns its sequence number.
+// It's then up to the caller to decide whether it's allowed to write it (c.f., the overflow policies),
+// and to actually claim it (c.f., damage_ring_claim).
+static inline uint32_t
+    damage_ring_next(mxcfb_damage_circ_buf* circ)
+{
+	uint32_t next;
+
+	while (true) {
+		next = damage_read_once(circ->reserved);
+		// Don't lap a producer that's still busy with the slot we'd land in
+		if (next - damage_load_acquire(&circ->header->head) < circ->size) {
+			return next;
+		}
+		damage_cpu_relax();
+	}
+}
+
+// Returns false if another producer beat us to it (in which case, try again with the next one)
+static inline bool
+    damage_ring_claim(mxcfb_damage_circ_buf* circ, uint32_t seq)
+{
+	return damage_cmpxchg(&circ->reserved, seq, seq + 1U) == seq;
+}
+
+// Copies everything but the tag
+// NOTE: A reader may be copying the same slot at the same time (it'll notice, and throw its copy away).
+//       In the kernel, that's what the barriers are for. In userspace, that has to be a well-defined race,
+//       so it's copied one word at a time, with release stores (i.e., after the busy tag),
+//       and acquire loads (i.e., before the final check of the tag).
+#ifdef __KERNEL__
+static inline void
+    damage_ring_store_record(mxcfb_damage_slot* slot, const mxcfb_damage_slot* record)
+{
+	smp_wmb();
+	slot->event     = record->event;
+	slot->timestamp = record->timestamp;
+	slot->format    = record->format;
+	slot->data      = record->data;
+	slot->reserved  = record->reserved;
+	slot->latency   = record->latency;
+	slot->pixels    = record->pixels;
+	slot->call      = record->call;
+	slot->geometry  = record->geometry;
+}
+
+static inline void
+    damage_ring_load_record(mxcfb_damage_slot* record, const mxcfb_damage_slot* slot)
+{
+	record->event     = slot->event;
+	record->timestamp = slot->timestamp;
+	record->format    = slot->format;
+	record->data      = slot->data;
+	record->reserved  = slot->reserved;
+	record->latency   = slot->latency;
+	record->pixels    = slot->pixels;
+	record->call      = slot->call;
+	record->geometry  = slot->geometry;
+	/* Finish reading the record before checking the tag again */
+	smp_rmb();
+}
+#else
+#	define DMG_SLOT_WORDS (sizeof(mxcfb_damage_slot) / sizeof(uint32_t))
+#	define DMG_SLOT_FIRST (offsetof(mxcfb_damage_slot, event) / sizeof(uint32_t))
+
+static inline void
+    damage_ring_store_record(mxcfb_damage_slot* slot, const mxcfb_damage_slot* record)
+{
+	uint32_t*       dst = (uint32_t*) (void*) slot;
+	const uint32_t* src = (const uint32_t*) (const void*) record;
+
+	for (size_t i = DMG_SLOT_FIRST; i < DMG_SLOT_WORDS; i++) {
+		__atomic_store_n(&dst[i], src[i], __ATOMIC_RELEASE);
+	}
+}
+
+static inline void
+    damage_ring_load_record(mxcfb_damage_slot* record, const mxcfb_damage_slot* slot)
+{
+	uint32_t*       dst = (uint32_t*) (void*) record;
+	const uint32_t* src = (const uint32_t*) (const void*) slot;
+
+	for (size_t i = DMG_SLOT_FIRST; i < DMG_SLOT_WORDS; i++) {
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_ACQUIRE);
+	}
+}
+#endif
+
+// Waits for the producers that claimed the records before seq to publish them
+// (i.e., from then on, nobody else is going to touch head until we publish ours).
+static inline void
+    damage_ring_wait_turn(const mxcfb_damage_circ_buf* circ, uint32_t seq)
+{
+	while (damage_load_acquire(&circ->header->head) != seq) {
+		damage_cpu_relax();
+	}
+}
+
+// Writes a record in the slot we claimed, and publishes it.
+// NOTE: Safe to call from any number of producers at once, as long as they each claimed their own seq.
+//       In the kernel, preemption has to stay disabled from the claim up to here,
+//       so that the producers waiting for their turn to publish theirs are never waiting on a task that isn't running.
+static inline void
+    damage_ring_commit(mxcfb_damage_circ_buf* circ, uint32_t seq, const mxcfb_damage_slot* record)
+{
+	mxcfb_damage_slot* slot = damage_ring_slot(circ, seq);
+
+	// Flag the slot as busy first (no reader ever expects seq - 1 in this slot),
+	// so that a reader we're lapping can tell that the record changed under its feet.
+	damage_write_once(slot->seq, seq - 1U);
+	damage_ring_store_record(slot, record);
+	/* commit the item before incrementing the head */
+	damage_store_release(&slot->seq, seq);
+	// Readers never look past head, so it has to move in order:
+	// wait for the producers that claimed the previous records to publish them first.
+	damage_ring_wait_turn(circ, seq);
+	damage_store_release(&circ->header->head, seq + 1U);
+}
+
+// Copies the record at sequence number seq, returns false if it was overwritten by a producer in the meantime
+static inline bool
+    damage_ring_fetch(const mxcfb_damage_circ_buf* circ, uint32_t seq, mxcfb_damage_slot* record)
+{
+	const mxcfb_damage_slot* slot = damage_ring_slot(circ, seq);
+
+	if (damage_load_acquire(&slot->seq) != seq) {
+		return false;
+	}
+	damage_ring_load_record(record, slot);
+	record->seq = seq;
+	return damage_read_once(slot->seq) == seq;
+}
+
+// After a failed fetch of the record at tail, returns the oldest record that may still be around
+// (updating head along the way).
+// NOTE: With several producers, head may lag quite a bit behind the slot that's being overwritten
+//       (the producers in between may not be done yet), in which case we can only skip that one record.
+static inline uint32_t
+    damage_ring_resync(const mxcfb_damage_circ_buf* circ, uint32_t* head, uint32_t tail)
+{
+	uint32_t oldest;
+
+	*head  = damage_load_acquire(&circ->header->head);
+	// Skip the slot the producer may be busy with, too
+	oldest = *head - circ->size + 1U;
+	return (int32_t) (oldest - tail) > 0 ? oldest : tail + 1U;
+}
+
+#endif
@@ -0,0 +1,98 @@
+/*
+	mxc_epdc_fb_damage: Tracepoints (c.f., Documentation/trace/events.rst)
+	Kobo port copyright (C) 2021-2022 NiLuJe <ninuje@gmail.com>
+	SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fbdamage
+
+// NOTE: This one is included several times over by define_trace.h, hence the unusual guard.
+#if !defined(__MXCFB_DAMAGE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __MXCFB_DAMAGE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "mxc_epdc_fb_damage.h"
+
+// NOTE: clang-format can't make heads or tails of these, so they're laid out the way the kernel does it.
+// clang-format off
+
+// Everything we know about a damage event, plus how many records were waiting to be read at that point
+DECLARE_EVENT_CLASS(fbdamage_update,
+
+	TP_PROTO(int fbnode, uint32_t seq, const mxcfb_damage_update* update, uint32_t queued),
+
+	TP_ARGS(fbnode, seq, update, queued),
+
+	TP_STRUCT__entry(
+		__field(int,      fbnode)
+		__field(uint32_t, seq)
+		__field(uint32_t, format)
+		__field(uint32_t, top)
+		__field(uint32_t, left)
+		__field(uint32_t, width)
+		__field(uint32_t, height)
+		__field(uint32_t, waveform_mode)
+		__field(uint32_t, update_mode)
+		__field(uint32_t, update_marker)
+		__field(uint32_t, flags)
+		__field(u64,      timestamp)
+		__field(uint32_t, queued)
+	),
+
+	TP_fast_assign(
+		__entry->fbnode        = fbnode;
+		__entry->seq           = seq;
+		__entry->format        = update->format;
+		__entry->top           = update->data.update_region.top;
+		__entry->left          = update->data.update_region.left;
+		__entry->width         = update->data.update_region.width;
+		__entry->height        = update->data.update_region.height;
+		__entry->waveform_mode = update->data.waveform_mode;
+		__entry->update_mode   = update->data.update_mode;
+		__entry->update_marker = update->data.update_marker;
+		__entry->flags         = update->data.flags;
+		__entry->timestamp     = update->timestamp;
+		__entry->queued        = queued;
+	),
+
+	TP_printk("fb%d seq=%u format=%u region=%ux%u@%u,%u waveform_mode=%u update_mode=%u update_marker=%u "
+		  "flags=%#x timestamp=%llu queued=%u",
+		  __entry->fbnode, __entry->seq, __entry->format,
+		  __entry->width, __entry->height, __entry->left, __entry->top,
+		  __entry->waveform_mode, __entry->update_mode, __entry->update_marker, __entry->flags,
+		  (unsigned long long) __entry->timestamp, __entry->queued)
+);
+
+// A record made it to the ring (queued is the fullest ring reader's occupancy, this one included)
+DEFINE_EVENT(fbdamage_update, fbdamage_queue,
+	TP_PROTO(int fbnode, uint32_t seq, const mxcfb_damage_update* update, uint32_t queued),
+	TP_ARGS(fbnode, seq, update, queued)
+);
+
+// A record the ring couldn't hold, or had to overwrite before every reader that wanted it got to it
+// (c.f., the overflow policies)
+DEFINE_EVENT(fbdamage_update, fbdamage_drop,
+	TP_PROTO(int fbnode, uint32_t seq, const mxcfb_damage_update* update, uint32_t queued),
+	TP_ARGS(fbnode, seq, update, queued)
+);
+
+// A record read() handed out (queued is its queue_size)
+DEFINE_EVENT(fbdamage_update, fbdamage_read,
+	TP_PROTO(int fbnode, uint32_t seq, const mxcfb_damage_update* update, uint32_t queued),
+	TP_ARGS(fbnode, seq, update, queued)
+);
+
+// clang-format on
+
+#endif
+
+// NOTE: Relative to include/trace, hence the -I$(src) in Kbuild.
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mxc_epdc_fb_damage_trace
+
+// This part must be outside the guard
+#include <trace/define_trace.h>
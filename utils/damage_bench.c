@@ -0,0 +1,450 @@
+/*
+	damage_bench: Producer/consumer throughput benchmark for mxc_epdc_fb_damage.
+	Copyright (C) 2021-2022 NiLuJe <ninuje@gmail.com>
+	SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libfbdamage.h"
+
+// NOTE: This relies on the FBDAMAGE_INJECT ioctl, i.e., the module needs to be loaded with inject=1,
+//       and we need CAP_SYS_ADMIN. Any framebuffer will do (e.g., vfb), since nothing actually gets refreshed.
+
+// How many latency samples each reader keeps around (anything past that is still counted, just not sampled)
+#define MAX_SAMPLES (1U << 20U)
+// Matches the module's default ring size
+#define BATCH_SIZE  64U
+
+typedef struct
+{
+	pthread_t thread;
+	uint32_t  id;
+	uint64_t  injected;
+	uint64_t  cpu_ns;
+	bool      failed;
+} bench_writer;
+
+typedef struct
+{
+	pthread_t     thread;
+	int           fd;
+	fbdamage_ring ring;
+	uint64_t      received;
+	uint64_t      lost;
+	uint64_t*     samples;
+	uint32_t      sampled;
+	uint64_t      cpu_ns;
+	bool          failed;
+} bench_reader;
+
+// Knobs
+static uint32_t rate     = 0U;    // Per writer, in events per second (0 means as fast as possible)
+static uint32_t batch    = 1U;    // Events per ioctl
+static bool     use_mmap = false;
+
+static bool stop_writers = false;
+static bool stop_readers = false;
+
+static uint64_t
+    ts_to_ns(const struct timespec* ts)
+{
+	return (uint64_t) ts->tv_sec * NSEC_PER_SEC + (uint64_t) ts->tv_nsec;
+}
+
+static uint64_t
+    tv_to_us(const struct timeval* tv)
+{
+	return (uint64_t) tv->tv_sec * 1000000U + (uint64_t) tv->tv_usec;
+}
+
+static uint64_t
+    now_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts_to_ns(&ts);
+}
+
+static void*
+    writer_thread(void* arg)
+{
+	bench_writer* writer = arg;
+	const int     fd     = fbdamage_open(false);
+
+	if (fd < 0) {
+		errno = -fd;
+		perror("open");
+		writer->failed = true;
+		return NULL;
+	}
+
+	// Keep each writer in its own corner of the screen, with a zero marker, so that nobody expects a completion
+	mxcfb_damage_inject injection = {
+		.format = DAMAGE_UPDATE_DATA_V2,
+		.count  = batch,
+		.data   = {
+			.update_region = { .top = writer->id * 16U, .left = 0U, .width = 64U, .height = 16U },
+			.update_mode   = 0U,
+			.waveform_mode = 1U,
+		},
+	};
+	// In nanoseconds, per ioctl
+	const uint64_t  period = rate ? (uint64_t) batch * NSEC_PER_SEC / rate : 0U;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!__atomic_load_n(&stop_writers, __ATOMIC_RELAXED)) {
+		int n = ioctl(fd, FBDAMAGE_INJECT, &injection);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("ioctl");
+			writer->failed = true;
+			break;
+		}
+		writer->injected += (uint64_t) n;
+
+		if (period) {
+			uint64_t deadline = ts_to_ns(&next) + period;
+			next.tv_sec       = (time_t) (deadline / NSEC_PER_SEC);
+			next.tv_nsec      = (long) (deadline % NSEC_PER_SEC);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+				;
+			}
+		}
+	}
+
+	writer->cpu_ns = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	close(fd);
+	return NULL;
+}
+
+// Accounts for a record we got our hands on at now
+static void
+    reader_account(bench_reader* reader, uint64_t now, uint64_t timestamp)
+{
+	reader->received++;
+	if (reader->sampled < MAX_SAMPLES) {
+		reader->samples[reader->sampled++] = now > timestamp ? now - timestamp : 0U;
+	}
+}
+
+static void*
+    reader_thread(void* arg)
+{
+	bench_reader* reader = arg;
+	union
+	{
+		mxcfb_damage_update records[BATCH_SIZE];
+		mxcfb_damage_slot   slots[BATCH_SIZE];
+	} buffer;
+
+	while (!__atomic_load_n(&stop_readers, __ATOMIC_RELAXED)) {
+		// Short enough to notice that we're done in a timely fashion
+		int rc = fbdamage_wait(reader->fd, 50);
+		if (rc < 0) {
+			errno = -rc;
+			perror("poll");
+			reader->failed = true;
+			break;
+		} else if (rc == 0) {
+			continue;
+		}
+
+		while (true) {
+			int n;
+			if (use_mmap) {
+				uint32_t lapped = 0U;
+				uint32_t copied = fbdamage_ring_drain(&reader->ring, buffer.slots, BATCH_SIZE, &lapped);
+				n               = (int) copied;
+				reader->lost += lapped;
+			} else {
+				n = fbdamage_drain(reader->fd, buffer.records, sizeof(*buffer.records), BATCH_SIZE);
+				if (n < 0) {
+					errno = -n;
+					perror("read");
+					reader->failed = true;
+					break;
+				}
+			}
+
+			// That's when the records made it to us
+			const uint64_t now = now_ns(CLOCK_MONOTONIC);
+			for (int i = 0; i < n; i++) {
+				if (use_mmap) {
+					reader_account(reader, now, buffer.slots[i].timestamp);
+				} else {
+					reader->lost += buffer.records[i].overflow_notify;
+					reader_account(reader, now, buffer.records[i].timestamp);
+				}
+			}
+
+			if ((uint32_t) n < BATCH_SIZE) {
+				break;
+			}
+		}
+		if (reader->failed) {
+			break;
+		}
+	}
+
+	reader->cpu_ns = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	return NULL;
+}
+
+static int
+    compare_u64(const void* a, const void* b)
+{
+	const uint64_t x = *(const uint64_t*) a;
+	const uint64_t y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+// In µs
+static double
+    percentile(const uint64_t* samples, size_t count, double p)
+{
+	const size_t idx = (size_t) (p * (double) (count - 1U));
+	return (double) samples[idx] / 1000.0;
+}
+
+static double
+    ns_to_s(uint64_t ns)
+{
+	return (double) ns / (double) NSEC_PER_SEC;
+}
+
+static void
+    show_helpmsg(void)
+{
+	printf("Usage: damage_bench [-m] [-w writers] [-r readers] [-R rate] [-b batch] [-d seconds]\n"
+	       "\t-m\tDrain the damage ring via mmap instead of read()\n"
+	       "\t-w\tAmount of writer threads (defaults to 1)\n"
+	       "\t-r\tAmount of reader threads (defaults to 1)\n"
+	       "\t-R\tEvents per second, per writer (defaults to 0, i.e., as fast as possible)\n"
+	       "\t-b\tEvents per injection ioctl (defaults to 1, at most %u)\n"
+	       "\t-d\tDuration of the run, in seconds (defaults to 5)\n",
+	       FBDAMAGE_INJECT_MAX);
+}
+
+int
+    main(int argc, char* argv[])
+{
+	int           ret       = EXIT_SUCCESS;
+	uint32_t      n_writers = 1U;
+	uint32_t      n_readers = 1U;
+	uint32_t      duration  = 5U;
+	bench_writer* writers   = NULL;
+	bench_reader* readers   = NULL;
+	uint64_t*     samples   = NULL;
+	uint32_t      started_w = 0U;
+	uint32_t      started_r = 0U;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "hmw:r:R:b:d:")) != -1) {
+		switch (opt) {
+			case 'm':
+				use_mmap = true;
+				break;
+			case 'w':
+				n_writers = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				n_readers = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'R':
+				rate = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				batch = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				duration = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'h':
+				show_helpmsg();
+				return EXIT_SUCCESS;
+			default:
+				show_helpmsg();
+				return EXIT_FAILURE;
+		}
+	}
+	if (n_writers == 0U || n_readers == 0U || duration == 0U || batch == 0U || batch > FBDAMAGE_INJECT_MAX) {
+		show_helpmsg();
+		return EXIT_FAILURE;
+	}
+
+	writers = calloc(n_writers, sizeof(*writers));
+	readers = calloc(n_readers, sizeof(*readers));
+	if (!writers || !readers) {
+		perror("calloc");
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+
+	// Readers first, so that they don't miss anything
+	for (uint32_t i = 0U; i < n_readers; i++) {
+		bench_reader* reader = &readers[i];
+
+		reader->fd = fbdamage_open(true);
+		if (reader->fd < 0) {
+			errno = -reader->fd;
+			perror("open");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		if (use_mmap) {
+			int rc = fbdamage_ring_map(reader->fd, &reader->ring);
+			if (rc < 0) {
+				errno = -rc;
+				perror("mmap");
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+		}
+		reader->samples = malloc(MAX_SAMPLES * sizeof(*reader->samples));
+		if (!reader->samples) {
+			perror("malloc");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	struct rusage usage_start;
+	getrusage(RUSAGE_SELF, &usage_start);
+	const uint64_t start = now_ns(CLOCK_MONOTONIC);
+
+	for (; started_r < n_readers; started_r++) {
+		if ((errno = pthread_create(&readers[started_r].thread, NULL, reader_thread, &readers[started_r]))) {
+			perror("pthread_create");
+			ret = EXIT_FAILURE;
+			goto join;
+		}
+	}
+	for (; started_w < n_writers; started_w++) {
+		writers[started_w].id = started_w;
+		if ((errno = pthread_create(&writers[started_w].thread, NULL, writer_thread, &writers[started_w]))) {
+			perror("pthread_create");
+			ret = EXIT_FAILURE;
+			goto join;
+		}
+	}
+
+	sleep(duration);
+
+join:
+	__atomic_store_n(&stop_writers, true, __ATOMIC_RELAXED);
+	for (uint32_t i = 0U; i < started_w; i++) {
+		pthread_join(writers[i].thread, NULL);
+	}
+	const uint64_t elapsed = now_ns(CLOCK_MONOTONIC) - start;
+	// Give the readers a chance to catch up with the tail end of it
+	usleep(100U * 1000U);
+	__atomic_store_n(&stop_readers, true, __ATOMIC_RELAXED);
+	for (uint32_t i = 0U; i < started_r; i++) {
+		pthread_join(readers[i].thread, NULL);
+	}
+	struct rusage usage_end;
+	getrusage(RUSAGE_SELF, &usage_end);
+
+	if (ret != EXIT_SUCCESS) {
+		goto cleanup;
+	}
+
+	// Producers
+	uint64_t injected  = 0U;
+	uint64_t writer_ns = 0U;
+	for (uint32_t i = 0U; i < n_writers; i++) {
+		injected += writers[i].injected;
+		writer_ns += writers[i].cpu_ns;
+		if (writers[i].failed) {
+			ret = EXIT_FAILURE;
+		}
+	}
+	printf("Injected %llu events in %.3f s from %u writer(s): %.0f events/s\n",
+	       (unsigned long long) injected,
+	       ns_to_s(elapsed),
+	       n_writers,
+	       (double) injected / ns_to_s(elapsed));
+
+	// Consumers
+	uint64_t reader_ns = 0U;
+	size_t   sampled   = 0U;
+	for (uint32_t i = 0U; i < n_readers; i++) {
+		const bench_reader* reader = &readers[i];
+		printf("Reader %u: received %llu events (%.0f events/s), dropped %llu\n",
+		       i,
+		       (unsigned long long) reader->received,
+		       (double) reader->received / ns_to_s(elapsed),
+		       (unsigned long long) reader->lost);
+		reader_ns += reader->cpu_ns;
+		sampled += reader->sampled;
+		if (reader->failed) {
+			ret = EXIT_FAILURE;
+		}
+	}
+	if (use_mmap) {
+		printf("The ring itself dropped %u events\n", readers[0].ring.header->overflows);
+	}
+
+	// Wake to read latency, over every reader
+	if (sampled) {
+		samples = malloc(sampled * sizeof(*samples));
+		if (!samples) {
+			perror("malloc");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		size_t offset = 0U;
+		for (uint32_t i = 0U; i < n_readers; i++) {
+			memcpy(samples + offset, readers[i].samples, readers[i].sampled * sizeof(*samples));
+			offset += readers[i].sampled;
+		}
+		qsort(samples, sampled, sizeof(*samples), compare_u64);
+		printf("Event to read latency (us, over %zu samples): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+		       sampled,
+		       percentile(samples, sampled, 0.5),
+		       percentile(samples, sampled, 0.9),
+		       percentile(samples, sampled, 0.99),
+		       percentile(samples, sampled, 0.999),
+		       percentile(samples, sampled, 1.0));
+	}
+
+	// CPU time
+	const uint64_t user_us = tv_to_us(&usage_end.ru_utime) - tv_to_us(&usage_start.ru_utime);
+	const uint64_t sys_us  = tv_to_us(&usage_end.ru_stime) - tv_to_us(&usage_start.ru_stime);
+	printf("CPU time: %.3f s user, %.3f s sys (%.1f%% of one CPU); writers %.3f s, readers %.3f s\n",
+	       (double) user_us / 1000000.0,
+	       (double) sys_us / 1000000.0,
+	       (double) (user_us + sys_us) * 1000.0 * 100.0 / (double) elapsed,
+	       ns_to_s(writer_ns),
+	       ns_to_s(reader_ns));
+
+cleanup:
+	if (readers) {
+		for (uint32_t i = 0U; i < n_readers; i++) {
+			fbdamage_ring_unmap(&readers[i].ring);
+			if (readers[i].fd > 0) {
+				close(readers[i].fd);
+			}
+			free(readers[i].samples);
+		}
+	}
+	free(samples);
+	free(readers);
+	free(writers);
+
+	return ret;
+}
@@ -0,0 +1,293 @@
+/*
+	damage_record: Records damage events to a compact binary trace (c.f., damage_replay).
+	Copyright (C) 2021-2022 NiLuJe <ninuje@gmail.com>
+	SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fb.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "damage_trace.h"
+#include "libfbdamage.h"
+
+// Matches the module's default ring size
+#define BATCH_SIZE 64U
+
+// NOTE: Records are buffered, and only ever written out a whole block at a time,
+//       so that leaving this running costs next to nothing, and doesn't wear out flash storage.
+static unsigned char block[DAMAGE_TRACE_BLOCK_SIZE];
+static size_t        block_used = 0U;
+static uint64_t      written    = 0U;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void
+    on_signal(int sig __attribute__((unused)))
+{
+	interrupted = 1;
+}
+
+// Writes out whatever is buffered
+static int
+    flush_block(int fd)
+{
+	size_t done = 0U;
+
+	while (done < block_used) {
+		ssize_t len = write(fd, block + done, block_used - done);
+		if (len == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("write");
+			return -1;
+		}
+		done += (size_t) len;
+	}
+	written += block_used;
+	block_used = 0U;
+	return 0;
+}
+
+// Buffers data, and writes out every block it fills
+static int
+    append(int fd, const void* data, size_t size)
+{
+	const unsigned char* p = data;
+
+	while (size) {
+		const size_t chunk = size < sizeof(block) - block_used ? size : sizeof(block) - block_used;
+		memcpy(block + block_used, p, chunk);
+		block_used += chunk;
+		p += chunk;
+		size -= chunk;
+		if (block_used == sizeof(block) && flush_block(fd) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Fills in the framebuffer's identity & geometry (best effort, a trace is still useful without them)
+static void
+    probe_fb(uint32_t fbnode, damage_trace_header* header)
+{
+	char                     path[32];
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+
+	snprintf(path, sizeof(path), "/dev/fb%u", fbnode);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror("open");
+		return;
+	}
+	if (ioctl(fd, FBIOGET_VSCREENINFO, &var) == 0 && ioctl(fd, FBIOGET_FSCREENINFO, &fix) == 0) {
+		memcpy(header->device, fix.id, sizeof(header->device) - 1U);
+		header->xres   = var.xres;
+		header->yres   = var.yres;
+		header->bpp    = var.bits_per_pixel;
+		header->rotate = var.rotate;
+	} else {
+		perror("ioctl");
+	}
+	close(fd);
+}
+
+static void
+    show_helpmsg(void)
+{
+	printf("Usage: damage_record [-l] [-n fbnode] [-d device] trace\n"
+	       "\t-l\tAlso record refresh completions (so that damage_replay can reproduce them, too)\n"
+	       "\t-n\tFramebuffer whose geometry is saved in the trace (defaults to 0, i.e., fb0)\n"
+	       "\t-d\tDevice node to record from (defaults to /dev/fbdamage)\n"
+	       "Records until SIGINT or SIGTERM.\n");
+}
+
+int
+    main(int argc, char* argv[])
+{
+	int                 ret       = EXIT_SUCCESS;
+	int                 fd        = -1;
+	int                 out       = -1;
+	uint32_t            fbnode    = 0U;
+	damage_trace_header header    = { 0 };
+	uint64_t            recorded  = 0U;
+	uint64_t            lost      = 0U;
+	uint32_t            last_seq  = 0U;
+	bool                synced    = false;
+	bool                completed = false;
+	const char*         device    = "/dev/fbdamage";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "hln:d:")) != -1) {
+		switch (opt) {
+			case 'l':
+				completed = true;
+				break;
+			case 'n':
+				fbnode = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				device = optarg;
+				break;
+			case 'h':
+				show_helpmsg();
+				return EXIT_SUCCESS;
+			default:
+				show_helpmsg();
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		show_helpmsg();
+		return EXIT_FAILURE;
+	}
+
+	// Don't let SA_RESTART get in the way of noticing that we're done
+	struct sigaction sa = { .sa_handler = on_signal };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	fd = fbdamage_open_path(device, true);
+	if (fd < 0) {
+		errno = -fd;
+		perror("open");
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+
+	// Only as much of a v2 record as we actually store
+	mxcfb_damage_record_format format = { .version = DAMAGE_RECORD_V2, .size = DAMAGE_TRACE_RECORD_SIZE };
+	if (ioctl(fd, FBDAMAGE_SET_RECORD_FORMAT, &format) == -1) {
+		perror("ioctl");
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	// NOTE: v2 records don't have an overflow_notify field, so losses can only be inferred from sequence gaps.
+	//       Every record that gets a sequence number has to reach us for that to work,
+	//       so we ask for all of them (minus overflow summaries, which reuse the seq of a lost one),
+	//       and only keep the ones we were actually asked to record.
+	uint32_t events  = DAMAGE_EVENT_REFRESH | (completed ? DAMAGE_EVENT_COMPLETION : 0U);
+	uint32_t watched = DAMAGE_EVENT_REFRESH | DAMAGE_EVENT_COMPLETION | DAMAGE_EVENT_GEOMETRY;
+	if (ioctl(fd, FBDAMAGE_SET_EVENTS, &watched) == -1) {
+		perror("ioctl");
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+
+	out = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out == -1) {
+		perror("open");
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	memcpy(header.magic, DAMAGE_TRACE_MAGIC, sizeof(header.magic));
+	header.version     = DAMAGE_TRACE_VERSION;
+	header.header_size = sizeof(header);
+	header.record_size = DAMAGE_TRACE_RECORD_SIZE;
+	header.events      = events;
+	header.start       = (uint64_t) now.tv_sec * NSEC_PER_SEC + (uint64_t) now.tv_nsec;
+	probe_fb(fbnode, &header);
+	if (append(out, &header, sizeof(header)) == -1) {
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+
+	// NOTE: The records are only DAMAGE_TRACE_RECORD_SIZE bytes long, so they're packed in here.
+	static unsigned char records[BATCH_SIZE * DAMAGE_TRACE_RECORD_SIZE];
+	while (!interrupted) {
+		// Short enough to notice a signal in a timely fashion (fbdamage_wait retries on EINTR)
+		int rc = fbdamage_wait(fd, 250);
+		if (rc < 0) {
+			errno = -rc;
+			perror("poll");
+			ret = EXIT_FAILURE;
+			break;
+		} else if (rc == 0) {
+			continue;
+		}
+
+		while (true) {
+			int n = fbdamage_drain(fd, records, DAMAGE_TRACE_RECORD_SIZE, BATCH_SIZE);
+			if (n < 0) {
+				errno = -n;
+				perror("read");
+				ret = EXIT_FAILURE;
+				goto flush;
+			}
+
+			// Keep track of sequence gaps (i.e., events we lost to overflows),
+			// and pack the records we actually want to keep at the front of the batch
+			int kept = 0;
+			for (int i = 0; i < n; i++) {
+				uint32_t             seq;
+				uint8_t              fmt;
+				const unsigned char* record = records + (size_t) i * DAMAGE_TRACE_RECORD_SIZE;
+				memcpy(&seq, record + offsetof(mxcfb_damage_update_v2, seq), sizeof(seq));
+				memcpy(&fmt, record + offsetof(mxcfb_damage_update_v2, format), sizeof(fmt));
+				// Anything but a step forward (e.g., a reset) just means we start over from there
+				if (synced && (int32_t) (seq - last_seq) > 1) {
+					lost += seq - last_seq - 1U;
+				}
+				last_seq = seq;
+				synced   = true;
+
+				// These were only ever asked for to keep the sequence intact
+				if (fmt == DAMAGE_UPDATE_DATA_GEOMETRY ||
+				    (fmt == DAMAGE_UPDATE_DATA_COMPLETION && !completed)) {
+					continue;
+				}
+				if (kept != i) {
+					memmove(records + (size_t) kept * DAMAGE_TRACE_RECORD_SIZE,
+						record,
+						DAMAGE_TRACE_RECORD_SIZE);
+				}
+				kept++;
+				recorded++;
+			}
+			if (append(out, records, (size_t) kept * DAMAGE_TRACE_RECORD_SIZE) == -1) {
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+
+			if ((uint32_t) n < BATCH_SIZE) {
+				break;
+			}
+		}
+	}
+
+flush:
+	// Whatever is left of the last block
+	if (flush_block(out) == -1) {
+		ret = EXIT_FAILURE;
+	}
+	fprintf(stderr,
+		"Recorded %llu events (%llu bytes), %llu events were lost to overflows\n",
+		(unsigned long long) recorded,
+		(unsigned long long) written,
+		(unsigned long long) lost);
+
+cleanup:
+	if (out != -1) {
+		close(out);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return ret;
+}
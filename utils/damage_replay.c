@@ -0,0 +1,323 @@
+/*
+	damage_replay: Replays a trace recorded by damage_record.
+	Copyright (C) 2021-2022 NiLuJe <ninuje@gmail.com>
+	SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "damage_trace.h"
+#include "libfbdamage.h"
+
+// NOTE: By default, events go through the FBDAMAGE_INJECT ioctl, i.e., the module needs to be loaded with inject=1,
+//       and we need CAP_SYS_ADMIN. Consumers see them exactly as they would the real thing
+//       (save for the timestamps & sequence numbers, which are the kernel's).
+//       With -o, they're written as plain v2 records to whatever you point us to instead (e.g., a FIFO),
+//       which can stand in for /dev/fbdamage without the module.
+
+static uint64_t
+    ts_to_ns(const struct timespec* ts)
+{
+	return (uint64_t) ts->tv_sec * NSEC_PER_SEC + (uint64_t) ts->tv_nsec;
+}
+
+static uint64_t
+    now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_to_ns(&ts);
+}
+
+static void
+    sleep_until(uint64_t deadline)
+{
+	const struct timespec ts = { .tv_sec  = (time_t) (deadline / NSEC_PER_SEC),
+				     .tv_nsec = (long) (deadline % NSEC_PER_SEC) };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+		;
+	}
+}
+
+static double
+    ns_to_s(uint64_t ns)
+{
+	return (double) ns / (double) NSEC_PER_SEC;
+}
+
+// Slurps the whole trace, so that replaying it doesn't involve any I/O. Returns NULL on failure.
+static unsigned char*
+    load_trace(const char* path, size_t* size)
+{
+	unsigned char* trace = NULL;
+	struct stat    st;
+	size_t         done  = 0U;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror("open");
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		goto cleanup;
+	}
+	trace = malloc((size_t) st.st_size);
+	if (!trace) {
+		perror("malloc");
+		goto cleanup;
+	}
+	while (done < (size_t) st.st_size) {
+		ssize_t len = read(fd, trace + done, (size_t) st.st_size - done);
+		if (len == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read");
+			free(trace);
+			trace = NULL;
+			goto cleanup;
+		}
+		if (len == 0) {
+			// Truncated under our feet, make do with what we've got
+			break;
+		}
+		done += (size_t) len;
+	}
+	*size = done;
+
+cleanup:
+	close(fd);
+	return trace;
+}
+
+// Pushes an event through the module's injection path. Returns false on failure.
+static bool
+    replay_inject(int fd, const mxcfb_damage_update_v2* record)
+{
+	mxcfb_damage_inject injection = {
+		.format = record->format,
+		.count  = 1U,
+		.data   = {
+			.update_region = {
+				.top    = record->region.top,
+				.left   = record->region.left,
+				.width  = record->region.width,
+				.height = record->region.height,
+			},
+			.waveform_mode = record->waveform_mode,
+			.update_mode   = record->update_mode,
+			.update_marker = record->update_marker,
+			.flags         = record->flags,
+		},
+	};
+
+	while (ioctl(fd, FBDAMAGE_INJECT, &injection) == -1) {
+		if (errno == EINTR) {
+			continue;
+		}
+		perror("ioctl");
+		return false;
+	}
+	return true;
+}
+
+// Writes the event to the stand-in, as if it came straight from the kernel. Returns false on failure.
+static bool
+    replay_write(int fd, mxcfb_damage_update_v2* record, uint32_t seq)
+{
+	record->timestamp = now_ns();
+	record->seq       = seq;
+
+	while (write(fd, record, sizeof(*record)) == -1) {
+		if (errno == EINTR) {
+			continue;
+		}
+		perror("write");
+		return false;
+	}
+	return true;
+}
+
+static void
+    show_helpmsg(void)
+{
+	printf("Usage: damage_replay [-a] [-n loops] [-o stand-in] trace\n"
+	       "\t-a\tReplay as fast as possible, instead of with the original timing\n"
+	       "\t-n\tReplay the whole trace that many times (defaults to 1)\n"
+	       "\t-o\tWrite v2 records to that file (e.g., a FIFO) instead of injecting them\n");
+}
+
+int
+    main(int argc, char* argv[])
+{
+	int            ret        = EXIT_SUCCESS;
+	int            fd         = -1;
+	bool           asap       = false;
+	uint32_t       loops      = 1U;
+	const char*    stand_in   = NULL;
+	unsigned char* trace      = NULL;
+	size_t         trace_size = 0U;
+	uint64_t       replayed   = 0U;
+	uint64_t       skipped    = 0U;
+	uint64_t       max_late   = 0U;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "han:o:")) != -1) {
+		switch (opt) {
+			case 'a':
+				asap = true;
+				break;
+			case 'n':
+				loops = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'o':
+				stand_in = optarg;
+				break;
+			case 'h':
+				show_helpmsg();
+				return EXIT_SUCCESS;
+			default:
+				show_helpmsg();
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1 || loops == 0U) {
+		show_helpmsg();
+		return EXIT_FAILURE;
+	}
+
+	trace = load_trace(argv[optind], &trace_size);
+	if (!trace) {
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+
+	// NOTE: Later versions may append fields to the header & the records, but never move the existing ones.
+	damage_trace_header header;
+	if (trace_size < sizeof(header)) {
+		fprintf(stderr, "Not a damage trace!\n");
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	memcpy(&header, trace, sizeof(header));
+	if (memcmp(header.magic, DAMAGE_TRACE_MAGIC, sizeof(header.magic)) != 0 || header.header_size < sizeof(header) ||
+	    header.header_size > trace_size || header.record_size < DAMAGE_RECORD_V2_MIN_SIZE) {
+		fprintf(stderr, "Not a damage trace!\n");
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	if (header.version != DAMAGE_TRACE_VERSION) {
+		fprintf(stderr, "Unsupported trace version: %u\n", header.version);
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	header.device[sizeof(header.device) - 1U] = '\0';
+
+	const unsigned char* records = trace + header.header_size;
+	// A trailing partial record just means the recorder didn't get to finish
+	const size_t         count   = (trace_size - header.header_size) / header.record_size;
+	const size_t         v2_size = sizeof(mxcfb_damage_update_v2);
+	// Fields we don't know about are dropped
+	const size_t         copy    = header.record_size < v2_size ? header.record_size : v2_size;
+	printf("Replaying %zu events recorded on %s (%ux%u @ %ubpp, rotate %u), %u time(s)%s\n",
+	       count,
+	       header.device[0] ? header.device : "an unknown framebuffer",
+	       header.xres,
+	       header.yres,
+	       header.bpp,
+	       header.rotate,
+	       loops,
+	       asap ? ", as fast as possible" : "");
+	if (count == 0U) {
+		goto cleanup;
+	}
+
+	if (stand_in) {
+		fd = open(stand_in, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			perror("open");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	} else {
+		fd = fbdamage_open(false);
+		if (fd < 0) {
+			errno = -fd;
+			perror("open");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	mxcfb_damage_update_v2 record;
+	memcpy(&record, records, copy);
+	const uint64_t first = record.timestamp;
+	const uint64_t start = now_ns();
+	uint64_t       base  = start;
+
+	for (uint32_t loop = 0U; loop < loops; loop++) {
+		for (size_t i = 0U; i < count; i++) {
+			// Fields the recorder didn't know about are zeroed
+			memset(&record, 0, sizeof(record));
+			memcpy(&record, records + i * header.record_size, copy);
+
+			if (!asap) {
+				const uint64_t deadline = base + (record.timestamp - first);
+				sleep_until(deadline);
+				const uint64_t late = now_ns() - deadline;
+				max_late            = late > max_late ? late : max_late;
+			}
+
+			if (stand_in) {
+				if (!replay_write(fd, &record, (uint32_t) replayed)) {
+					ret = EXIT_FAILURE;
+					goto report;
+				}
+			} else {
+				// Records without any data can't be injected
+				if (record.format == DAMAGE_UPDATE_DATA_UNKNOWN ||
+				    record.format > DAMAGE_UPDATE_DATA_COMPLETION) {
+					skipped++;
+					continue;
+				}
+				if (!replay_inject(fd, &record)) {
+					ret = EXIT_FAILURE;
+					goto report;
+				}
+			}
+			replayed++;
+		}
+		// The next loop starts right where this one ended
+		base = now_ns();
+	}
+
+report:;
+	const uint64_t elapsed = now_ns() - start;
+	printf("Replayed %llu events (skipped %llu) in %.3f s: %.0f events/s",
+	       (unsigned long long) replayed,
+	       (unsigned long long) skipped,
+	       ns_to_s(elapsed),
+	       (double) replayed / ns_to_s(elapsed));
+	if (!asap) {
+		printf(", at most %.1f us behind schedule", (double) max_late / 1000.0);
+	}
+	putchar('\n');
+
+cleanup:
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(trace);
+	return ret;
+}
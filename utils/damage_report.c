@@ -6,34 +6,747 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
-#include "../mxc_epdc_fb_damage.h"
+#include "libfbdamage.h"
 
 // Cute trick from https://stackoverflow.com/a/7618231
 #define BOOL2STR(X) ({ ("false\0\0\0true" + 8 * !!(X)); })
 
+// Returns false on unknown data formats (or if we failed to format the timestamp)
+static bool
+    print_damage(const mxcfb_damage_update* damage)
+{
+	// Start with some timestamps (first, the actual event's timestamp, MONOTONIC)
+	printf("[%llu.%.9llu ->", damage->timestamp / NSEC_PER_SEC, damage->timestamp % NSEC_PER_SEC);
+
+	// Then now (REALTIME)
+	time_t     t   = time(NULL);
+	struct tm* tmp = localtime(&t);
+	char       time_str[64];
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-y2k"
+	if (strftime(time_str, sizeof(time_str), " %x %X] ", tmp) == 0) {
+#pragma GCC diagnostic pop
+		perror("strftime");
+		return false;
+	}
+	fputs(time_str, stdout);
+
+	if (damage->format == DAMAGE_UPDATE_DATA_V1_NTX) {
+		fputs("MXCFB_SEND_UPDATE_V1_NTX: ", stdout);
+	} else if (damage->format == DAMAGE_UPDATE_DATA_V1) {
+		fputs("MXCFB_SEND_UPDATE_V1: ", stdout);
+	} else if (damage->format == DAMAGE_UPDATE_DATA_V2) {
+		fputs("MXCFB_SEND_UPDATE_V2: ", stdout);
+	} else if (damage->format == DAMAGE_UPDATE_DATA_SUNXI_KOBO_DISP2) {
+		fputs("DISP_EINK_UPDATE2: ", stdout);
+	} else if (damage->format == DAMAGE_UPDATE_DATA_COMPLETION) {
+		// NOTE: The data is the request's, but the timestamp is the completion's
+		fputs("Completion: ", stdout);
+	} else if (damage->format == DAMAGE_UPDATE_DATA_OVERFLOW) {
+		// NOTE: The bounding box of everything we lost (c.f., -o)
+		fputs("Overflow summary: ", stdout);
+	} else if (damage->format == DAMAGE_UPDATE_DATA_GEOMETRY) {
+		// NOTE: That's all v1 records have room for (c.f., -g)
+		printf("Geometry change: %ux%u, rotate=%u\n",
+		       damage->data.update_region.width,
+		       damage->data.update_region.height,
+		       damage->data.rotate);
+		return true;
+	} else {
+		printf("Unknown damage data format: %u!\n", damage->format);
+		return false;
+	}
+
+	if (damage->format == DAMAGE_UPDATE_DATA_SUNXI_KOBO_DISP2) {
+		printf(
+		    "overflow_notify=%u, queue_size=%u {update_region={top=%u, left=%u, width=%u, height=%u}, waveform_mode=%#x, update_mode=%u, update_marker=%u, flags=%#x, rotate=%u}, pen_mode=%s\n",
+		    damage->overflow_notify,
+		    damage->queue_size,
+		    damage->data.update_region.top,
+		    damage->data.update_region.left,
+		    damage->data.update_region.width,
+		    damage->data.update_region.height,
+		    damage->data.waveform_mode,
+		    damage->data.update_mode,
+		    damage->data.update_marker,
+		    damage->data.flags,
+		    damage->data.rotate,
+		    BOOL2STR(damage->data.pen_mode));
+	} else {
+		// NOTE: For mxcfb, we print all the fields, no matter the actual data format
+		//       (the module ensures they're set to sane defaults).
+		printf(
+		    "overflow_notify=%u, queue_size=%u {update_region={top=%u, left=%u, width=%u, height=%u}, waveform_mode=%u, update_mode=%u, update_marker=%u, temp=%d, flags=%u, dither_mode=%d, quant_bit=%d, alt_buffer_data={virt_addr=%p, phys_addr=%u, width=%u, height=%u, alt_update_region={top=%u, left=%u, width=%u, height=%u}}}\n",
+		    damage->overflow_notify,
+		    damage->queue_size,
+		    damage->data.update_region.top,
+		    damage->data.update_region.left,
+		    damage->data.update_region.width,
+		    damage->data.update_region.height,
+		    damage->data.waveform_mode,
+		    damage->data.update_mode,
+		    damage->data.update_marker,
+		    damage->data.temp,
+		    damage->data.flags,
+		    damage->data.dither_mode,
+		    damage->data.quant_bit,
+		    damage->data.alt_buffer_data.virt_addr,
+		    damage->data.alt_buffer_data.phys_addr,
+		    damage->data.alt_buffer_data.width,
+		    damage->data.alt_buffer_data.height,
+		    damage->data.alt_buffer_data.alt_update_region.top,
+		    damage->data.alt_buffer_data.alt_update_region.left,
+		    damage->data.alt_buffer_data.alt_update_region.width,
+		    damage->data.alt_buffer_data.alt_update_region.height);
+	}
+
+	return true;
+}
+
+// Much terser, since there's much less to print ;).
+static void
+    print_damage_v2(const mxcfb_damage_update_v2* damage)
+{
+	printf(
+	    "[%llu.%.9llu] #%u: format=%u {update_region={top=%u, left=%u, width=%u, height=%u}, waveform_mode=%u, update_mode=%u, update_marker=%u, flags=%#x}\n",
+	    (unsigned long long) (damage->timestamp / NSEC_PER_SEC),
+	    (unsigned long long) (damage->timestamp % NSEC_PER_SEC),
+	    damage->seq,
+	    damage->format,
+	    damage->region.top,
+	    damage->region.left,
+	    damage->region.width,
+	    damage->region.height,
+	    damage->waveform_mode,
+	    damage->update_mode,
+	    damage->update_marker,
+	    damage->flags);
+	if (damage->format == DAMAGE_UPDATE_DATA_COMPLETION) {
+		printf("\tCompleted in %llu us\n", (unsigned long long) (damage->latency / 1000U));
+	} else if (damage->format == DAMAGE_UPDATE_DATA_OVERFLOW) {
+		puts("\tSummarizes the refreshes lost to an overflow");
+	} else if (damage->format == DAMAGE_UPDATE_DATA_GEOMETRY) {
+		puts("\tThe framebuffer's layout changed");
+	}
+}
+
+// Layout changes (c.f., -g), only reported once per generation
+static bool     layouts;
+static uint32_t layout_generation;
+
+// That's where you'd recompute whatever you derive from the layout (e.g., stride & rotation tables)
+static void
+    print_geometry(const mxcfb_damage_geometry* geometry)
+{
+	if (!layouts || geometry->generation == layout_generation) {
+		return;
+	}
+	layout_generation = geometry->generation;
+
+	printf("\tLayout #%u: %ux%u (%ux%u virtual), %u bpp, %u bytes per row, rotate=%u, grayscale=%u\n",
+	       geometry->generation,
+	       geometry->xres,
+	       geometry->yres,
+	       geometry->xres_virtual,
+	       geometry->yres_virtual,
+	       geometry->bits_per_pixel,
+	       geometry->line_length,
+	       geometry->rotate,
+	       geometry->grayscale);
+}
+
+// Pixel snapshots (c.f., -p), NULL buffer when disabled
+static fbdamage_arena arena;
+static void*          snapshot;
+
+// Make sure we can get at the snapshot, and say how it went
+static void
+    print_pixels(const mxcfb_damage_pixels* pixels)
+{
+	if (!snapshot) {
+		return;
+	}
+
+	if (pixels->status == DAMAGE_PIXELS_OK) {
+		// Copy it right away, the kernel is free to overwrite it now that we've consumed the record
+		int ret = fbdamage_arena_copy(&arena, pixels, snapshot, arena.size);
+		if (ret < 0) {
+			printf("\tSnapshot of %u bytes @ %u: %s\n", pixels->length, pixels->offset, strerror(-ret));
+		} else {
+			printf(
+			    "\tSnapshot of %u bytes (%u per row) @ %u\n", pixels->length, pixels->stride, pixels->offset);
+		}
+	} else if (pixels->status == DAMAGE_PIXELS_DROPPED) {
+		puts("\tSnapshot dropped (arena full)");
+	} else if (pixels->status == DAMAGE_PIXELS_UNSUPPORTED) {
+		puts("\tNo snapshot (unsupported)");
+	}
+}
+
+// How long the ioctl kept the submitting thread in the driver (zeroed for coalesced & injected records)
+static void
+    print_call(const mxcfb_damage_call* call)
+{
+	if (call->duration || call->ret) {
+		printf(
+		    "\tSpent %llu us in the driver (ret=%d)\n", (unsigned long long) (call->duration / 1000U), call->ret);
+	}
+}
+
+// Drain the ring via batched read() calls (a single one is enough unless we fill our whole buffer)
+static int
+    drain_read(int fd, bool compact)
+{
+	// Matches the module's default ring size
+	static union
+	{
+		mxcfb_damage_update    v1[64];
+		mxcfb_damage_update_v2 v2[64];
+	} damage;
+	const uint32_t record_size = compact ? sizeof(*damage.v2) : sizeof(*damage.v1);
+
+	while (true) {
+		int n = fbdamage_drain(fd, &damage, record_size, 64U);
+
+		if (n < 0) {
+			errno = -n;
+			perror("read");
+			return EXIT_FAILURE;
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (compact) {
+				print_damage_v2(&damage.v2[i]);
+				print_geometry(&damage.v2[i].geometry);
+				print_call(&damage.v2[i].call);
+				print_pixels(&damage.v2[i].pixels);
+			} else if (!print_damage(&damage.v1[i])) {
+				return EXIT_FAILURE;
+			}
+		}
+
+		// If we didn't fill our buffer, the kernel had nothing more to give us: back to poll!
+		if (n < 64) {
+			break;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// Drain the ring straight from the shared mapping, without a single syscall
+static int
+    drain_mmap(fbdamage_ring* ring, uint32_t* overflows)
+{
+	static mxcfb_damage_slot slots[64];
+
+	while (true) {
+		uint32_t lapped = 0U;
+		uint32_t n      = fbdamage_ring_drain(ring, slots, 64U, &lapped);
+
+		for (uint32_t i = 0U; i < n; i++) {
+			mxcfb_damage_update  update;
+			mxcfb_damage_update* damage = &update;
+			fbdamage_slot_update(&slots[i], damage);
+
+			// These are only filled by read(), but we can compute them ourselves
+			uint32_t lost           = __atomic_load_n(&ring->header->overflows, __ATOMIC_RELAXED);
+			damage->overflow_notify = lost - *overflows + (i == 0U ? lapped : 0U);
+			*overflows              = lost;
+			damage->queue_size      = n - i;
+
+			if (!print_damage(damage)) {
+				return EXIT_FAILURE;
+			}
+			// Unlike read(), the slots always carry the latency
+			if (damage->format == DAMAGE_UPDATE_DATA_COMPLETION) {
+				printf("\tCompleted in %llu us\n", (unsigned long long) (slots[i].latency / 1000U));
+			}
+			print_geometry(&slots[i].geometry);
+			print_call(&slots[i].call);
+			print_pixels(&slots[i].pixels);
+		}
+
+		// Same as above, if we didn't fill our buffer, we're done
+		if (n < 64U) {
+			break;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// Fetch (and clear) the tile bitmap
+static int
+    report_tiles(int fd, const mxcfb_damage_tiles_setup* setup, uint32_t* tiles)
+{
+	mxcfb_damage_tiles_fetch fetch = { .bitmap = (uint64_t) (uintptr_t) tiles, .words = setup->words };
+	if (ioctl(fd, FBDAMAGE_FETCH_TILES, &fetch) == -1) {
+		perror("ioctl");
+		return EXIT_FAILURE;
+	}
+
+	printf("%u/%u dirty %ux%u tiles\n", fetch.dirty, setup->cols * setup->rows, setup->tile_size, setup->tile_size);
+	return EXIT_SUCCESS;
+}
+
+// Report how many events our filter kept from us
+static int
+    report_filtered(int fd)
+{
+	uint32_t filtered = 0U;
+	if (ioctl(fd, FBDAMAGE_FETCH_FILTERED, &filtered) == -1) {
+		perror("ioctl");
+		return EXIT_FAILURE;
+	}
+
+	if (filtered) {
+		printf("%u events filtered out\n", filtered);
+	}
+	return EXIT_SUCCESS;
+}
+
+// --stats: everything is accumulated per window, and only formatted once per window
+// (i.e., there's no per-event syscall, allocation, or printf).
+// How many latency samples a window keeps around (anything past that is still counted, just not sampled)
+#define STATS_MAX_SAMPLES (1U << 16U)
+// Twice the module's default ring size, so that a full ring is always a single read()
+#define STATS_BATCH_SIZE  128U
+
+typedef struct
+{
+	uint64_t  start;        // CLOCK_MONOTONIC, in ns
+	uint64_t  events;
+	uint64_t  unknown;      // Records in a format we don't know about (they still count as events)
+	uint64_t  reads;        // i.e., bursts
+	uint64_t  burst_max;    // Largest queue_size a read started with
+	uint64_t  overflows;
+	uint64_t* samples;      // Delivery latency (read time - timestamp), in ns
+	uint32_t  sampled;
+} report_stats;
+
+static uint64_t
+    monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+static int
+    compare_u64(const void* a, const void* b)
+{
+	const uint64_t x = *(const uint64_t*) a;
+	const uint64_t y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+// In µs, samples must be sorted
+static double
+    percentile(const uint64_t* samples, size_t count, double p)
+{
+	const size_t idx = (size_t) (p * (double) (count - 1U));
+	return (double) samples[idx] / 1000.0;
+}
+
+static void
+    print_stats(report_stats* stats, uint64_t now, uint64_t* total_events, uint64_t* total_overflows)
+{
+	const double elapsed = (double) (now - stats->start) / (double) NSEC_PER_SEC;
+
+	*total_events += stats->events;
+	*total_overflows += stats->overflows;
+	printf("%.1f s: %llu events (%.1f/s)",
+	       elapsed,
+	       (unsigned long long) stats->events,
+	       elapsed > 0.0 ? (double) stats->events / elapsed : 0.0);
+	if (stats->sampled) {
+		qsort(stats->samples, stats->sampled, sizeof(*stats->samples), compare_u64);
+		printf(", latency (us): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f",
+		       percentile(stats->samples, stats->sampled, 0.5),
+		       percentile(stats->samples, stats->sampled, 0.9),
+		       percentile(stats->samples, stats->sampled, 0.99),
+		       percentile(stats->samples, stats->sampled, 1.0));
+	}
+	if (stats->reads) {
+		printf(", bursts: %llu (%.1f events on average, %llu at most)",
+		       (unsigned long long) stats->reads,
+		       (double) stats->events / (double) stats->reads,
+		       (unsigned long long) stats->burst_max);
+	}
+	printf(", overflows: %llu (%llu lost out of %llu overall)",
+	       (unsigned long long) stats->overflows,
+	       (unsigned long long) *total_overflows,
+	       (unsigned long long) (*total_events + *total_overflows));
+	if (stats->unknown) {
+		printf(", unknown formats: %llu", (unsigned long long) stats->unknown);
+	}
+	putchar('\n');
+	// Make it usable through a pipe
+	fflush(stdout);
+
+	stats->start     = now;
+	stats->events    = 0U;
+	stats->unknown   = 0U;
+	stats->reads     = 0U;
+	stats->burst_max = 0U;
+	stats->overflows = 0U;
+	stats->sampled   = 0U;
+}
+
+// Folds a batch of records read at now into the window
+static void
+    account_stats(report_stats* stats, const mxcfb_damage_update* damage, int n, uint64_t now)
+{
+	// NOTE: queue_size includes the record itself, so the first one of a batch is the size of the burst we woke up to
+	stats->reads++;
+	if (damage[0].queue_size > stats->burst_max) {
+		stats->burst_max = damage[0].queue_size;
+	}
+	for (int i = 0; i < n; i++) {
+		stats->overflows += damage[i].overflow_notify;
+		// Overflow summaries & layout changes aren't events in their own right, and their timestamps aren't ours
+		if (damage[i].format == DAMAGE_UPDATE_DATA_OVERFLOW || damage[i].format == DAMAGE_UPDATE_DATA_GEOMETRY) {
+			continue;
+		}
+		stats->events++;
+		if (damage[i].format > DAMAGE_UPDATE_DATA_GEOMETRY && damage[i].format != DAMAGE_UPDATE_DATA_ERROR) {
+			stats->unknown++;
+		}
+		if (stats->sampled < STATS_MAX_SAMPLES) {
+			// Same clock (i.e., CLOCK_MONOTONIC)
+			stats->samples[stats->sampled++] = now > damage[i].timestamp ? now - damage[i].timestamp : 0U;
+		}
+	}
+}
+
+// Reports delivery latency percentiles, event rate, burst sizes & overflows every window_s seconds
+static int
+    run_stats(int fd, uint32_t window_s)
+{
+	static mxcfb_damage_update damage[STATS_BATCH_SIZE];
+	const uint64_t             window_ns       = (uint64_t) window_s * NSEC_PER_SEC;
+	report_stats               stats           = { 0 };
+	uint64_t                   total_events    = 0U;
+	uint64_t                   total_overflows = 0U;
+	uint64_t                   now, deadline;
+
+	stats.samples = malloc(STATS_MAX_SAMPLES * sizeof(*stats.samples));
+	if (!stats.samples) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	stats.start = monotonic_ns();
+
+	while (true) {
+		// Wake up in time to report on the window, even if nothing happens
+		now      = monotonic_ns();
+		deadline = stats.start + window_ns;
+		if (now >= deadline) {
+			print_stats(&stats, now, &total_events, &total_overflows);
+			continue;
+		}
+		int rc = fbdamage_wait(fd, (int) ((deadline - now + 999999U) / 1000000U));
+		if (rc == -EINTR) {
+			// Same as the main loop, a signal doesn't end the run
+			continue;
+		} else if (rc < 0) {
+			errno = -rc;
+			perror("poll");
+			break;
+		}
+		if (rc == 0) {
+			continue;
+		}
+
+		while (true) {
+			int n = fbdamage_drain(fd, damage, sizeof(*damage), STATS_BATCH_SIZE);
+			if (n < 0) {
+				errno = -n;
+				perror("read");
+				free(stats.samples);
+				return EXIT_FAILURE;
+			}
+			if (n == 0) {
+				break;
+			}
+			// One timestamp per read, not per event
+			account_stats(&stats, damage, n, monotonic_ns());
+			if (n < (int) STATS_BATCH_SIZE) {
+				break;
+			}
+		}
+	}
+
+	free(stats.samples);
+	return EXIT_FAILURE;
+}
+
+static void
+    show_helpmsg(void)
+{
+	printf("Usage: damage_report [-m] [-2] [-l] [-o] [-g] [-p] [-c max_rects] [-t tile_size] [-H] [-f l,t,w,h]"
+	       " [-s [-w seconds]] [-d device]\n"
+	       "\t-m\tDrain the damage ring via mmap instead of read()\n"
+	       "\t-2\tread() compact v2 records\n"
+	       "\t-l\tAlso report refresh completions (and their latency, with -2 or -m)\n"
+	       "\t-o\tSummarize the refreshes lost to overflows, instead of just counting them (with read())\n"
+	       "\t-g\tAlso report layout changes (and the full layout, whenever it changes, with -2 or -m)\n"
+	       "\t-p\tAlso snapshot the pixels of every refresh (with -2 or -m)\n"
+	       "\t-c\tLet the kernel coalesce damage into at most max_rects rectangles between reads\n"
+	       "\t-t\tAlso report how many tiles of tile_size px got dirty between reads\n"
+	       "\t-H\tWith -t, only count the tiles whose content actually changed (mxc only)\n"
+	       "\t-f\tOnly report damage that intersects the rectangle at left,top of width x height\n"
+	       "\t-s, --stats\n"
+	       "\t\tInstead of printing every event, report delivery latency percentiles, event rate, burst sizes\n"
+	       "\t\tand overflows (with read(), and v1 records)\n"
+	       "\t-w, --window\n"
+	       "\t\tWith -s, how often to report, in seconds (defaults to 5)\n"
+	       "\t-d\tDevice node to read from (defaults to /dev/fbdamage)\n");
+}
+
 int
-    main(void)
+    main(int argc, char* argv[])
 {
-	int ret = EXIT_SUCCESS;
+	int                             ret       = EXIT_SUCCESS;
+	bool                            use_mmap  = false;
+	bool                            compact   = false;
+	bool                            completed = false;
+	bool                            summaries = false;
+	bool                            pixels    = false;
+	bool                            hashing   = false;
+	bool                            stats     = false;
+	uint32_t                        window    = 5U;
+	fbdamage_ring                   ring      = { 0 };
+	uint32_t                        overflows = 0U;
+	uint32_t                        max_rects = 0U;
+	mxcfb_damage_tiles_setup        tiling    = { 0 };
+	uint32_t*                       tiles     = NULL;
+	mxcfb_damage_filter             filter    = { 0 };
+	const char*                     device    = "/dev/fbdamage";
+
+	static const struct option long_opts[] = {
+		{ "stats", no_argument, NULL, 's' },
+		{ "window", required_argument, NULL, 'w' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "hm2logpc:t:Hf:sw:d:", long_opts, NULL)) != -1) {
+		switch (opt) {
+			case 'm':
+				use_mmap = true;
+				break;
+			case '2':
+				compact = true;
+				break;
+			case 'l':
+				completed = true;
+				break;
+			case 'o':
+				summaries = true;
+				break;
+			case 'g':
+				layouts = true;
+				break;
+			case 'p':
+				pixels = true;
+				break;
+			case 'c':
+				max_rects = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 't':
+				tiling.tile_size = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'H':
+				hashing = true;
+				break;
+			case 'f':
+				if (sscanf(optarg,
+					   "%u,%u,%u,%u",
+					   &filter.rects[0].left,
+					   &filter.rects[0].top,
+					   &filter.rects[0].width,
+					   &filter.rects[0].height) != 4) {
+					show_helpmsg();
+					return EXIT_FAILURE;
+				}
+				filter.nrects = 1U;
+				break;
+			case 's':
+				stats = true;
+				break;
+			case 'w':
+				window = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				device = optarg;
+				break;
+			case 'h':
+				show_helpmsg();
+				return EXIT_SUCCESS;
+			default:
+				show_helpmsg();
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (stats && (use_mmap || compact || pixels || max_rects || window == 0U)) {
+		fprintf(stderr, "--stats only works with read() & v1 records, over a window of at least a second!\n");
+		return EXIT_FAILURE;
+	}
 
 	// NOTE: This exercises a full NONBLOCK poll + read workflow (with, err, *extensive* error handling),
 	//       but you can also do blocking read() calls if that's more your speed ;).
-	int fd = open("/dev/fbdamage", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
-	if (fd == -1) {
+	int fd = fbdamage_open_path(device, true);
+	if (fd < 0) {
+		errno = -fd;
 		perror("open");
 		ret = EXIT_FAILURE;
 		goto cleanup;
 	}
 
+	if (max_rects) {
+		if (use_mmap) {
+			fprintf(stderr, "Coalesced damage can only be read()!\n");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		mxcfb_damage_coalesce_setup setup = { .max_rects = max_rects };
+		if (ioctl(fd, FBDAMAGE_SET_COALESCING, &setup) == -1) {
+			perror("ioctl");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	if (compact) {
+		mxcfb_damage_record_format format = { .version = DAMAGE_RECORD_V2, .size = sizeof(mxcfb_damage_update_v2) };
+		if (ioctl(fd, FBDAMAGE_SET_RECORD_FORMAT, &format) == -1) {
+			perror("ioctl");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	if (completed || summaries || layouts) {
+		uint32_t events = DAMAGE_EVENT_REFRESH | (completed ? DAMAGE_EVENT_COMPLETION : 0U) |
+				  (summaries ? DAMAGE_EVENT_OVERFLOW : 0U) | (layouts ? DAMAGE_EVENT_GEOMETRY : 0U);
+		if (ioctl(fd, FBDAMAGE_SET_EVENTS, &events) == -1) {
+			perror("ioctl");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	if (layouts) {
+		// Start from the current one, so that we only hear about actual changes
+		mxcfb_damage_geometry geometry;
+		if (ioctl(fd, FBDAMAGE_GET_GEOMETRY, &geometry) == -1) {
+			perror("ioctl");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		print_geometry(&geometry);
+	}
+
+	if (hashing) {
+		if (!tiling.tile_size) {
+			fprintf(stderr, "Content hashing only applies to tile tracking!\n");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		// NOTE: FBDAMAGE_SET_TILES takes the baseline
+		uint32_t enable = 1U;
+		if (ioctl(fd, FBDAMAGE_SET_TILE_HASHING, &enable) == -1) {
+			perror("ioctl");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	if (tiling.tile_size) {
+		if (ioctl(fd, FBDAMAGE_SET_TILES, &tiling) == -1) {
+			perror("ioctl");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		tiles = calloc(tiling.words, sizeof(*tiles));
+		if (!tiles) {
+			perror("calloc");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	if (filter.nrects) {
+		if (use_mmap) {
+			fprintf(stderr, "Filtering only applies to read()!\n");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		if (ioctl(fd, FBDAMAGE_SET_FILTER, &filter) == -1) {
+			perror("ioctl");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	if (pixels) {
+		if (max_rects || (!compact && !use_mmap)) {
+			fprintf(stderr, "Snapshots are only reported in v2 records & mmap slots!\n");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		int rc = fbdamage_arena_map(fd, &arena);
+		if (rc < 0) {
+			errno = -rc;
+			perror("mmap");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		uint32_t enable = 1U;
+		if (ioctl(fd, FBDAMAGE_SET_SNAPSHOTS, &enable) == -1) {
+			perror("ioctl");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		snapshot = malloc(arena.size);
+		if (!snapshot) {
+			perror("malloc");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+
+	if (use_mmap) {
+		int rc = fbdamage_ring_map(fd, &ring);
+		if (rc < 0) {
+			errno = -rc;
+			perror("mmap");
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		overflows = __atomic_load_n(&ring.header->overflows, __ATOMIC_RELAXED);
+	}
+
+	if (stats) {
+		ret = run_stats(fd, window);
+		goto cleanup;
+	}
+
 	struct pollfd pfd = { 0 };
 	pfd.fd            = fd;
 	pfd.events        = POLLIN;
@@ -53,116 +766,19 @@ int
 
 		if (poll_num > 0) {
 			if (pfd.revents & POLLIN) {
-				mxcfb_damage_update damage = { 0 };
-
-				while (true) {
-					ssize_t len = read(fd, &damage, sizeof(damage));
-
-					if (len < 0) {
-						if (errno == EINTR) {
-							continue;
-						} else if (errno == EAGAIN) {
-							// Damage ring buffer drained, back to poll!
-							break;
-						} else {
-							perror("read");
-							ret = EXIT_FAILURE;
-							goto cleanup;
-						}
-					}
-
-					if (len == 0) {
-						// Should never happen
-						errno = EPIPE;
-						perror("read");
-						ret = EXIT_FAILURE;
-						goto cleanup;
-					}
-
-					if (len != sizeof(damage)) {
-						// Should *also* never happen ;p.
-						errno = EINVAL;
-						perror("read");
-						ret = EXIT_FAILURE;
-						goto cleanup;
-					}
-
-					// Phew, we're good!
-					// Start with some timestamps (first, the actual event's timestamp, MONOTONIC)
-					printf("[%llu.%.9llu ->",
-					       damage.timestamp / NSEC_PER_SEC,
-					       damage.timestamp % NSEC_PER_SEC);
-
-					// Then now (REALTIME)
-					time_t     t   = time(NULL);
-					struct tm* tmp = localtime(&t);
-					char       time_str[64];
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-y2k"
-					if (strftime(time_str, sizeof(time_str), " %x %X] ", tmp) == 0) {
-#pragma GCC diagnostic pop
-						perror("strftime");
-						ret = EXIT_FAILURE;
-						goto cleanup;
-					}
-					fputs(time_str, stdout);
-
-					if (damage.format == DAMAGE_UPDATE_DATA_V1_NTX) {
-						fputs("MXCFB_SEND_UPDATE_V1_NTX: ", stdout);
-					} else if (damage.format == DAMAGE_UPDATE_DATA_V1) {
-						fputs("MXCFB_SEND_UPDATE_V1: ", stdout);
-					} else if (damage.format == DAMAGE_UPDATE_DATA_V2) {
-						fputs("MXCFB_SEND_UPDATE_V2: ", stdout);
-					} else if (damage.format == DAMAGE_UPDATE_DATA_SUNXI_KOBO_DISP2) {
-						fputs("DISP_EINK_UPDATE2: ", stdout);
-					} else {
-						printf("Unknown damage data format: %u!\n", damage.format);
-						ret = EXIT_FAILURE;
-						goto cleanup;
-					}
-
-					if (damage.format == DAMAGE_UPDATE_DATA_SUNXI_KOBO_DISP2) {
-						printf(
-						    "overflow_notify=%u, queue_size=%u {update_region={top=%u, left=%u, width=%u, height=%u}, waveform_mode=%#x, update_mode=%u, update_marker=%u, flags=%#x, rotate=%u}, pen_mode=%s\n",
-						    damage.overflow_notify,
-						    damage.queue_size,
-						    damage.data.update_region.top,
-						    damage.data.update_region.left,
-						    damage.data.update_region.width,
-						    damage.data.update_region.height,
-						    damage.data.waveform_mode,
-						    damage.data.update_mode,
-						    damage.data.update_marker,
-						    damage.data.flags,
-						    damage.data.rotate,
-						    BOOL2STR(damage.data.pen_mode));
-					} else {
-						// NOTE: For mxcfb, we print all the fields, no matter the actual data format
-						//       (the module ensures they're set to sane defaults).
-						printf(
-						    "overflow_notify=%u, queue_size=%u {update_region={top=%u, left=%u, width=%u, height=%u}, waveform_mode=%u, update_mode=%u, update_marker=%u, temp=%d, flags=%u, dither_mode=%d, quant_bit=%d, alt_buffer_data={virt_addr=%p, phys_addr=%u, width=%u, height=%u, alt_update_region={top=%u, left=%u, width=%u, height=%u}}}\n",
-						    damage.overflow_notify,
-						    damage.queue_size,
-						    damage.data.update_region.top,
-						    damage.data.update_region.left,
-						    damage.data.update_region.width,
-						    damage.data.update_region.height,
-						    damage.data.waveform_mode,
-						    damage.data.update_mode,
-						    damage.data.update_marker,
-						    damage.data.temp,
-						    damage.data.flags,
-						    damage.data.dither_mode,
-						    damage.data.quant_bit,
-						    damage.data.alt_buffer_data.virt_addr,
-						    damage.data.alt_buffer_data.phys_addr,
-						    damage.data.alt_buffer_data.width,
-						    damage.data.alt_buffer_data.height,
-						    damage.data.alt_buffer_data.alt_update_region.top,
-						    damage.data.alt_buffer_data.alt_update_region.left,
-						    damage.data.alt_buffer_data.alt_update_region.width,
-						    damage.data.alt_buffer_data.alt_update_region.height);
-					}
+				if (use_mmap) {
+					ret = drain_mmap(&ring, &overflows);
+				} else {
+					ret = drain_read(fd, compact);
+				}
+				if (ret == EXIT_SUCCESS && tiles) {
+					ret = report_tiles(fd, &tiling, tiles);
+				}
+				if (ret == EXIT_SUCCESS && filter.nrects) {
+					ret = report_filtered(fd);
+				}
+				if (ret != EXIT_SUCCESS) {
+					goto cleanup;
 				}
 			}
 		}
@@ -170,7 +786,11 @@ int
 
 	// Unreachable outside of gotos
 cleanup:
-	if (fd != -1) {
+	free(tiles);
+	free(snapshot);
+	fbdamage_arena_unmap(&arena);
+	fbdamage_ring_unmap(&ring);
+	if (fd >= 0) {
 		close(fd);
 	}
 	return ret;
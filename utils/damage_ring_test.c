@@ -0,0 +1,338 @@
+/*
+	damage_ring_test: Stress test & micro-benchmark of the module's ring, in userspace (c.f., make test & make bench).
+	Copyright (C) 2021-2022 NiLuJe <ninuje@gmail.com>
+	SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../mxc_epdc_fb_damage_ring.h"
+
+// NOTE: Producers & consumers go through the exact same code as the module's (c.f., mxc_epdc_fb_damage_ring.h),
+//       minus everything that's about the kernel (i.e., preemption, sleeping, and waking people up).
+//       Every consumer sees every record, like the module's readers do.
+//       By default, producers wait for the slowest consumer to make some room (much like DAMAGE_OVERFLOW_BLOCK),
+//       so every single record has to make it to every single consumer, in order, exactly once.
+//       With -o, they don't (i.e., DAMAGE_OVERFLOW_OVERWRITE_OLDEST), so consumers get lapped,
+//       and what they lose has to be accounted for exactly, instead.
+
+// Matches the module's default ring size
+#define DEFAULT_RING_SIZE 64U
+// Same as damage_bench
+#define BATCH_SIZE        64U
+#define MAX_THREADS       64U
+
+typedef struct
+{
+	pthread_t thread;
+	uint32_t  id;
+	uint64_t  ns;
+} ring_producer;
+
+typedef struct
+{
+	pthread_t thread;
+	uint32_t  id;
+	uint32_t  tail;    // Only ever written by its own thread, read by the producers
+	uint64_t  received;
+	uint64_t  lost;
+	uint64_t  ns;
+	uint64_t  errors;
+} ring_consumer;
+
+// Knobs
+static uint32_t nproducers = 4U;
+static uint32_t nconsumers = 2U;
+static uint32_t count      = 100000U;    // Per producer
+static bool     overwrite  = false;
+
+static mxcfb_damage_circ_buf circ;
+static uint32_t              event_seq;
+static ring_producer         producers[MAX_THREADS];
+static ring_consumer         consumers[MAX_THREADS];
+
+static uint64_t
+    now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+// Every field a consumer can double-check, so that a torn record doesn't go unnoticed
+static void
+    make_record(mxcfb_damage_slot* record, uint32_t producer, uint32_t n)
+{
+	memset(record, 0, sizeof(*record));
+	record->event                     = __atomic_fetch_add(&event_seq, 1U, __ATOMIC_RELAXED);
+	record->format                    = DAMAGE_UPDATE_DATA_V2;
+	record->data.update_marker        = producer;
+	record->data.update_region.top    = n;
+	record->data.update_region.left   = ~n;
+	record->data.update_region.width  = n * 2654435761U;
+	record->data.update_region.height = producer ^ n;
+	record->latency                   = ((uint64_t) producer << 32U) | n;
+	record->call.duration             = record->latency ^ UINT64_MAX;
+}
+
+static bool
+    check_record(const mxcfb_damage_slot* record, uint32_t* producer, uint32_t* n)
+{
+	*producer = record->data.update_marker;
+	*n        = record->data.update_region.top;
+	return *producer < nproducers && record->format == DAMAGE_UPDATE_DATA_V2 &&
+	       record->data.update_region.left == ~*n && record->data.update_region.width == *n * 2654435761U &&
+	       record->data.update_region.height == (*producer ^ *n) &&
+	       record->latency == (((uint64_t) *producer << 32U) | *n) &&
+	       record->call.duration == (record->latency ^ UINT64_MAX);
+}
+
+// c.f., damage_circ_full
+static bool
+    ring_full(uint32_t head)
+{
+	for (uint32_t i = 0U; i < nconsumers; i++) {
+		if (head - damage_read_once(consumers[i].tail) >= circ.size) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// c.f., damage_circ_claim & damage_circ_queue
+static void*
+    produce(void* arg)
+{
+	ring_producer*    producer = arg;
+	mxcfb_damage_slot record;
+	uint32_t          seq;
+
+	const uint64_t start = now_ns();
+	for (uint32_t n = 0U; n < count; n++) {
+		while (true) {
+			seq = damage_ring_next(&circ);
+			if (!overwrite && ring_full(seq)) {
+				damage_cpu_relax();
+				continue;
+			}
+			if (damage_ring_claim(&circ, seq)) {
+				break;
+			}
+		}
+		make_record(&record, producer->id, n);
+		damage_ring_commit(&circ, seq, &record);
+	}
+	producer->ns = now_ns() - start;
+	return NULL;
+}
+
+// c.f., fbdamage_drain
+static void*
+    consume(void* arg)
+{
+	ring_consumer*    consumer = arg;
+	const uint64_t    total    = (uint64_t) nproducers * count;
+	// Next n we expect from each producer
+	uint32_t          expected[MAX_THREADS] = { 0U };
+	mxcfb_damage_slot record;
+	uint32_t          head, tail, next, avail, i, producer, n;
+
+	const uint64_t start = now_ns();
+	tail                 = consumer->tail;
+	while (consumer->received + consumer->lost < total) {
+		head = damage_load_acquire(&circ.header->head);
+		if (head == tail) {
+			damage_cpu_relax();
+			continue;
+		}
+resync:
+		next = damage_ring_oldest(&circ, head, tail);
+		consumer->lost += next - tail;
+		tail = next;
+
+		avail = head - tail;
+		for (i = 0U; i < avail && i < BATCH_SIZE; i++) {
+			if (!damage_ring_fetch(&circ, tail + i, &record)) {
+				if (!overwrite) {
+					fprintf(stderr,
+						"Consumer %u: record %u was overwritten without -o!\n",
+						consumer->id,
+						tail + i);
+					consumer->errors++;
+				}
+				if (i > 0U) {
+					break;
+				}
+				next = damage_ring_resync(&circ, &head, tail);
+				consumer->lost += next - tail;
+				tail = next;
+				goto resync;
+			}
+			if (!check_record(&record, &producer, &n)) {
+				fprintf(stderr, "Consumer %u: record %u is torn!\n", consumer->id, tail + i);
+				consumer->errors++;
+				consumer->received++;
+				continue;
+			}
+			// A producer's records are always published in order, whatever the others are doing
+			if (overwrite ? n < expected[producer] : n != expected[producer]) {
+				fprintf(stderr,
+					"Consumer %u: got record %u from producer %u, expected %u!\n",
+					consumer->id,
+					n,
+					producer,
+					expected[producer]);
+				consumer->errors++;
+			}
+			expected[producer] = n + 1U;
+			consumer->received++;
+		}
+		tail += i;
+		/* Finish reading descriptors before incrementing tail. */
+		damage_store_release(&consumer->tail, tail);
+	}
+	consumer->ns = now_ns() - start;
+
+	if (!overwrite) {
+		for (producer = 0U; producer < nproducers; producer++) {
+			if (expected[producer] != count) {
+				fprintf(stderr,
+					"Consumer %u: only got %u records from producer %u!\n",
+					consumer->id,
+					expected[producer],
+					producer);
+				consumer->errors++;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void
+    show_helpmsg(void)
+{
+	printf("Usage: damage_ring_test [-p producers] [-c consumers] [-n count] [-s ring_size] [-o]\n"
+	       "\t-p\tAmount of producer threads (defaults to 4)\n"
+	       "\t-c\tAmount of consumer threads (defaults to 2)\n"
+	       "\t-n\tRecords per producer (defaults to 100000)\n"
+	       "\t-s\tRing size, must be a power of two (defaults to 64)\n"
+	       "\t-o\tLet producers overwrite the oldest records instead of waiting for the consumers\n"
+	       "Fails if any record is lost (or unaccounted for, with -o), duplicated, reordered, or torn.\n");
+}
+
+int
+    main(int argc, char* argv[])
+{
+	int                      ret        = EXIT_SUCCESS;
+	uint32_t                 ring_size  = DEFAULT_RING_SIZE;
+	mxcfb_damage_ring_header header     = { 0 };
+	uint64_t                 errors     = 0U;
+	uint64_t                 produce_ns = 0U;
+	uint64_t                 consume_ns = 0U;
+	uint64_t                 received   = 0U;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "hp:c:n:s:o")) != -1) {
+		switch (opt) {
+			case 'p':
+				nproducers = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'c':
+				nconsumers = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				count = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				ring_size = (uint32_t) strtoul(optarg, NULL, 10);
+				break;
+			case 'o':
+				overwrite = true;
+				break;
+			case 'h':
+				show_helpmsg();
+				return EXIT_SUCCESS;
+			default:
+				show_helpmsg();
+				return EXIT_FAILURE;
+		}
+	}
+	if (nproducers == 0U || nproducers > MAX_THREADS || nconsumers == 0U || nconsumers > MAX_THREADS ||
+	    count == 0U || ring_size < 2U || (ring_size & (ring_size - 1U))) {
+		show_helpmsg();
+		return EXIT_FAILURE;
+	}
+
+	circ.header = &header;
+	// NOTE: Zeroed, just like the module's (c.f., vmalloc_user in damage_circ_alloc):
+	//       a pristine slot 0 looks like record 0, but readers never look past head, so that's fine.
+	circ.slots  = calloc(ring_size, sizeof(*circ.slots));
+	if (!circ.slots) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	circ.size = ring_size;
+	circ.mask = ring_size - 1U;
+
+	for (uint32_t i = 0U; i < nconsumers; i++) {
+		consumers[i].id = i;
+		if ((errno = pthread_create(&consumers[i].thread, NULL, consume, &consumers[i]))) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (uint32_t i = 0U; i < nproducers; i++) {
+		producers[i].id = i;
+		if ((errno = pthread_create(&producers[i].thread, NULL, produce, &producers[i]))) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (uint32_t i = 0U; i < nproducers; i++) {
+		pthread_join(producers[i].thread, NULL);
+		produce_ns += producers[i].ns;
+	}
+	for (uint32_t i = 0U; i < nconsumers; i++) {
+		pthread_join(consumers[i].thread, NULL);
+		consume_ns += consumers[i].ns;
+		received += consumers[i].received;
+		errors += consumers[i].errors;
+		printf("Consumer %u: received %llu records, lost %llu\n",
+		       i,
+		       (unsigned long long) consumers[i].received,
+		       (unsigned long long) consumers[i].lost);
+	}
+	if (header.head != (uint32_t) ((uint64_t) nproducers * count)) {
+		fprintf(stderr, "head is %u, expected %llu!\n", header.head, (unsigned long long) nproducers * count);
+		errors++;
+	}
+
+	// NOTE: Without -o, that includes the time spent waiting on the consumers (and vice versa)
+	printf("%u producers, %u consumers, %u records per producer, ring of %u%s: "
+	       "%.1f ns per enqueue, %.1f ns per dequeue\n",
+	       nproducers,
+	       nconsumers,
+	       count,
+	       ring_size,
+	       overwrite ? " (overwriting)" : "",
+	       (double) produce_ns / ((double) nproducers * count),
+	       received ? (double) consume_ns / (double) received : 0.0);
+	if (errors) {
+		fprintf(stderr, "FAILED: %llu errors\n", (unsigned long long) errors);
+		ret = EXIT_FAILURE;
+	} else {
+		puts("OK");
+	}
+
+	free(circ.slots);
+	return ret;
+}
@@ -0,0 +1,42 @@
+/*
+	damage_trace: On-disk format of the traces written by damage_record, and read by damage_replay.
+	Copyright (C) 2021-2022 NiLuJe <ninuje@gmail.com>
+	SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#ifndef __DAMAGE_TRACE_H
+#define __DAMAGE_TRACE_H
+
+#include "../mxc_epdc_fb_damage.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A trace is a damage_trace_header, followed by a plain stream of records, until EOF.
+// NOTE: Everything is in native byte order, a trace is meant to be replayed on the kind of device it was recorded on.
+#define DAMAGE_TRACE_MAGIC   "FBDMGTRC"
+#define DAMAGE_TRACE_VERSION 1U
+
+// Records are the start of an mxcfb_damage_update_v2, up to (and including) the latency
+// (a pixel snapshot doesn't mean anything outside of the live arena).
+#define DAMAGE_TRACE_RECORD_SIZE offsetof(mxcfb_damage_update_v2, pixels)
+
+// damage_record only ever writes whole blocks (except for the very last one)
+#define DAMAGE_TRACE_BLOCK_SIZE (64U * 1024U)
+
+typedef struct
+{
+	char     magic[8];       // DAMAGE_TRACE_MAGIC (not NUL-terminated)
+	uint32_t version;        // DAMAGE_TRACE_VERSION
+	uint32_t header_size;    // i.e., where the records start
+	uint32_t record_size;    // Stride of the records, in bytes (i.e., DAMAGE_TRACE_RECORD_SIZE when it was recorded)
+	uint32_t events;         // The mxcfb_damage_event_mask it was recorded with
+	uint64_t start;          // When the recording started, in nanoseconds, time reference is CLOCK_MONOTONIC
+	char     device[16];     // The framebuffer's id (e.g., mxc_epdc_fb), NUL-terminated
+	uint32_t xres;           // The framebuffer's geometry when the recording started (all 0 if we couldn't tell)
+	uint32_t yres;
+	uint32_t bpp;
+	uint32_t rotate;
+} damage_trace_header;
+
+#endif
@@ -0,0 +1,421 @@
+/*
+	libfbdamage: Consumer-side helpers for mxc_epdc_fb_damage.
+	Copyright (C) 2021-2022 NiLuJe <ninuje@gmail.com>
+	SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libfbdamage.h"
+
+int
+    fbdamage_open(bool nonblock)
+{
+	return fbdamage_open_path("/dev/fbdamage", nonblock);
+}
+
+int
+    fbdamage_open_path(const char* path, bool nonblock)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC | (nonblock ? O_NONBLOCK : 0));
+	if (fd == -1) {
+		return -errno;
+	}
+	return fd;
+}
+
+int
+    fbdamage_wait(int fd, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	while (true) {
+		int ret = poll(&pfd, 1, timeout_ms);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (ret > 0 && !(pfd.revents & POLLIN)) {
+			// POLLERR, POLLNVAL & co
+			return -EIO;
+		}
+		return ret;
+	}
+}
+
+int
+    fbdamage_drain(int fd, void* records, uint32_t record_size, uint32_t capacity)
+{
+	if (record_size == 0U || capacity == 0U) {
+		return -EINVAL;
+	}
+
+	while (true) {
+		// NOTE: The kernel copies straight into the caller's array, no bounce buffer involved.
+		ssize_t len = read(fd, records, (size_t) record_size * capacity);
+
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN) {
+				// Nothing to read
+				return 0;
+			}
+			return -errno;
+		}
+
+		if (len == 0) {
+			// Should never happen
+			return -EPIPE;
+		}
+		if ((size_t) len % record_size != 0U) {
+			// Should *also* never happen ;p.
+			return -EINVAL;
+		}
+		return (int) ((size_t) len / record_size);
+	}
+}
+
+int
+    fbdamage_ring_map(int fd, fbdamage_ring* ring)
+{
+	// Map the header first, to learn about the actual layout of the mapping...
+	const mxcfb_damage_ring_header* probe = mmap(NULL, sizeof(*probe), PROT_READ, MAP_SHARED, fd, 0);
+	if (probe == MAP_FAILED) {
+		return -errno;
+	}
+	const size_t map_size   = probe->map_size;
+	const off_t  cursor_off = (off_t) probe->cursor_offset;
+	munmap((void*) (uintptr_t) probe, sizeof(*probe));
+
+	// ...then the whole thing.
+	const mxcfb_damage_ring_header* header = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		return -errno;
+	}
+	mxcfb_damage_ring_cursor* cursor =
+	    mmap(NULL, sizeof(*cursor), PROT_READ | PROT_WRITE, MAP_SHARED, fd, cursor_off);
+	if (cursor == MAP_FAILED) {
+		int ret = -errno;
+		munmap((void*) (uintptr_t) header, map_size);
+		return ret;
+	}
+
+	ring->header   = header;
+	ring->cursor   = cursor;
+	ring->map_size = map_size;
+	return 0;
+}
+
+void
+    fbdamage_ring_unmap(fbdamage_ring* ring)
+{
+	if (ring->cursor) {
+		munmap(ring->cursor, sizeof(*ring->cursor));
+		ring->cursor = NULL;
+	}
+	if (ring->header) {
+		munmap((void*) (uintptr_t) ring->header, ring->map_size);
+		ring->header = NULL;
+	}
+	ring->map_size = 0U;
+}
+
+uint32_t
+    fbdamage_ring_drain(fbdamage_ring* ring, mxcfb_damage_slot* slots, uint32_t capacity, uint32_t* lost)
+{
+	const mxcfb_damage_ring_header* header  = ring->header;
+	const unsigned char*            records = (const unsigned char*) header + header->records_offset;
+	const uint32_t                  size    = header->ring_size;
+	const uint32_t                  mask    = size - 1U;
+	// NOTE: The slot may grow new fields, copy what we both know about, and zero the rest
+	const size_t                    stride  = header->record_size;
+	const size_t                    copy    = stride < sizeof(*slots) ? stride : sizeof(*slots);
+	uint32_t                        missed  = 0U;
+	uint32_t                        n       = 0U;
+
+	// Pairs with the kernel's release store of head once it's done writing a record
+	uint32_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	// We're the only ones writing to the tail
+	uint32_t tail = ring->cursor->tail;
+
+	while (tail != head && n < capacity) {
+		// If we've been lapped, skip ahead to the oldest record still around
+		if (head - tail > size) {
+			missed += head - tail - size;
+			tail = head - size;
+		}
+
+		const mxcfb_damage_slot* slot =
+		    (const mxcfb_damage_slot*) (const void*) (records + (tail & mask) * stride);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == tail) {
+			memcpy(&slots[n], slot, copy);
+			// Finish reading the record before checking the tag again
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == tail) {
+				memset((unsigned char*) &slots[n] + copy, 0, sizeof(*slots) - copy);
+				n++;
+				tail++;
+				continue;
+			}
+		}
+
+		// Overwritten (or still being written) by the kernel,
+		// catch up with head (skipping the slot it may be busy with)
+		// NOTE: With several producers, head may lag behind the slot that's being overwritten,
+		//       in which case we can only skip that one record (c.f., damage_ring_resync).
+		head                  = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+		const uint32_t oldest = head - size + 1U;
+		const uint32_t next   = (int32_t) (oldest - tail) > 0 ? oldest : tail + 1U;
+		missed += next - tail;
+		tail = next;
+	}
+
+	// Let the kernel know we're done with these
+	__atomic_store_n(&ring->cursor->tail, tail, __ATOMIC_RELEASE);
+	if (lost) {
+		*lost += missed;
+	}
+	return n;
+}
+
+void
+    fbdamage_slot_update(const mxcfb_damage_slot* slot, mxcfb_damage_update* update)
+{
+	const mxcfb_damage_fixed_data* data = &slot->data;
+
+	memset(update, 0, sizeof(*update));
+	update->timestamp                              = slot->timestamp;
+	update->format                                 = (mxcfb_damage_data_format) slot->format;
+	update->data.update_region                     = data->update_region;
+	update->data.waveform_mode                     = data->waveform_mode;
+	update->data.update_mode                       = data->update_mode;
+	update->data.update_marker                     = data->update_marker;
+	update->data.temp                              = data->temp;
+	update->data.flags                             = data->flags;
+	update->data.dither_mode                       = data->dither_mode;
+	update->data.quant_bit                         = data->quant_bit;
+	update->data.alt_buffer_data.phys_addr         = data->alt_phys_addr;
+	update->data.alt_buffer_data.width             = data->alt_width;
+	update->data.alt_buffer_data.height            = data->alt_height;
+	update->data.alt_buffer_data.alt_update_region = data->alt_update_region;
+	update->data.rotate                            = data->rotate;
+	update->data.pen_mode                          = !!data->pen_mode;
+}
+
+int
+    fbdamage_arena_map(int fd, fbdamage_arena* arena)
+{
+	// We keep the header around, since that's where pixels_head lives
+	const mxcfb_damage_ring_header* header = mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		return -errno;
+	}
+	if (header->pixels_offset == 0U) {
+		munmap((void*) (uintptr_t) header, sizeof(*header));
+		return -EOPNOTSUPP;
+	}
+
+	const unsigned char* pixels =
+	    mmap(NULL, header->pixels_size, PROT_READ, MAP_SHARED, fd, (off_t) header->pixels_offset);
+	if (pixels == MAP_FAILED) {
+		int ret = -errno;
+		munmap((void*) (uintptr_t) header, sizeof(*header));
+		return ret;
+	}
+
+	arena->header = header;
+	arena->pixels = pixels;
+	arena->size   = header->pixels_size;
+	return 0;
+}
+
+void
+    fbdamage_arena_unmap(fbdamage_arena* arena)
+{
+	if (arena->pixels) {
+		munmap((void*) (uintptr_t) arena->pixels, arena->size);
+		arena->pixels = NULL;
+	}
+	if (arena->header) {
+		munmap((void*) (uintptr_t) arena->header, sizeof(*arena->header));
+		arena->header = NULL;
+	}
+	arena->size = 0U;
+}
+
+int
+    fbdamage_arena_copy(const fbdamage_arena* arena, const mxcfb_damage_pixels* pixels, void* buf, uint32_t capacity)
+{
+	if (pixels->status != DAMAGE_PIXELS_OK) {
+		return -ENODATA;
+	}
+	if (pixels->length > arena->size || (pixels->offset & (arena->size - 1U)) + pixels->length > arena->size) {
+		return -EINVAL;
+	}
+	if (pixels->length > capacity) {
+		return -ENOSPC;
+	}
+
+	// NOTE: The kernel moves pixels_head *before* it overwrites anything,
+	//       so once it's more than a whole arena ahead of us, what we're after is (or is about to be) gone.
+	if (__atomic_load_n(&arena->header->pixels_head, __ATOMIC_ACQUIRE) - pixels->offset > arena->size) {
+		return -ESTALE;
+	}
+	memcpy(buf, arena->pixels + (pixels->offset & (arena->size - 1U)), pixels->length);
+	// Finish reading the pixels before checking head again
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&arena->header->pixels_head, __ATOMIC_RELAXED) - pixels->offset > arena->size) {
+		return -ESTALE;
+	}
+	return (int) pixels->length;
+}
+
+static bool
+    rect_touches(const mxcfb_damage_rect* a, const mxcfb_damage_rect* b)
+{
+	// NOTE: Touching edges count, too, much like in the kernel
+	return a->left <= b->left + b->width && b->left <= a->left + a->width && a->top <= b->top + b->height &&
+	       b->top <= a->top + a->height;
+}
+
+static void
+    rect_union(mxcfb_damage_rect* a, const mxcfb_damage_rect* b)
+{
+	const uint32_t right  = a->left + a->width > b->left + b->width ? a->left + a->width : b->left + b->width;
+	const uint32_t bottom = a->top + a->height > b->top + b->height ? a->top + a->height : b->top + b->height;
+
+	a->left   = a->left < b->left ? a->left : b->left;
+	a->top    = a->top < b->top ? a->top : b->top;
+	a->width  = right - a->left;
+	a->height = bottom - a->top;
+}
+
+// Returns false if they don't overlap (in which case out is left alone)
+static bool
+    rect_intersect(const mxcfb_damage_rect* a, const mxcfb_damage_rect* b, mxcfb_damage_rect* out)
+{
+	const uint32_t left   = a->left > b->left ? a->left : b->left;
+	const uint32_t top    = a->top > b->top ? a->top : b->top;
+	const uint32_t right  = a->left + a->width < b->left + b->width ? a->left + a->width : b->left + b->width;
+	const uint32_t bottom = a->top + a->height < b->top + b->height ? a->top + a->height : b->top + b->height;
+
+	if (right <= left || bottom <= top) {
+		return false;
+	}
+	out->left   = left;
+	out->top    = top;
+	out->width  = right - left;
+	out->height = bottom - top;
+	return true;
+}
+
+void
+    fbdamage_region_init(fbdamage_region* region, uint32_t capacity)
+{
+	region->count    = 0U;
+	region->capacity = capacity == 0U || capacity > FBDAMAGE_REGION_MAX_RECTS ? FBDAMAGE_REGION_MAX_RECTS : capacity;
+}
+
+void
+    fbdamage_region_clear(fbdamage_region* region)
+{
+	region->count = 0U;
+}
+
+void
+    fbdamage_region_add(fbdamage_region* region, const mxcfb_damage_rect* rect)
+{
+	mxcfb_damage_rect merged = *rect;
+	uint32_t          i;
+
+	if (rect->width == 0U || rect->height == 0U) {
+		return;
+	}
+
+	// Swallow every rectangle we touch, and start over each time, since the merged one keeps growing.
+	i = 0U;
+	while (i < region->count) {
+		if (rect_touches(&region->rects[i], &merged)) {
+			rect_union(&merged, &region->rects[i]);
+			// Plug the hole with the last one
+			region->rects[i] = region->rects[--region->count];
+			i                = 0U;
+		} else {
+			i++;
+		}
+	}
+
+	// Past the limit, collapse everything into a single bounding box
+	if (region->count >= region->capacity) {
+		for (i = 0U; i < region->count; i++) {
+			rect_union(&merged, &region->rects[i]);
+		}
+		region->count = 0U;
+	}
+	region->rects[region->count++] = merged;
+}
+
+void
+    fbdamage_region_union(fbdamage_region* region, const fbdamage_region* other)
+{
+	for (uint32_t i = 0U; i < other->count; i++) {
+		fbdamage_region_add(region, &other->rects[i]);
+	}
+}
+
+void
+    fbdamage_region_intersect(fbdamage_region* region, const fbdamage_region* other)
+{
+	fbdamage_region   out;
+	mxcfb_damage_rect piece;
+
+	fbdamage_region_init(&out, region->capacity);
+	// Both sets are made of non-overlapping rectangles, so the pairwise intersections don't overlap either
+	for (uint32_t i = 0U; i < region->count; i++) {
+		for (uint32_t j = 0U; j < other->count; j++) {
+			if (rect_intersect(&region->rects[i], &other->rects[j], &piece)) {
+				fbdamage_region_add(&out, &piece);
+			}
+		}
+	}
+
+	region->count = out.count;
+	memcpy(region->rects, out.rects, out.count * sizeof(*out.rects));
+}
+
+void
+    fbdamage_region_clip(fbdamage_region* region, const mxcfb_damage_rect* clip)
+{
+	uint32_t n = 0U;
+
+	// Clipping can't make two rectangles overlap, so this can be done in place
+	for (uint32_t i = 0U; i < region->count; i++) {
+		if (rect_intersect(&region->rects[i], clip, &region->rects[n])) {
+			n++;
+		}
+	}
+	region->count = n;
+}
+
+bool
+    fbdamage_region_bounds(const fbdamage_region* region, mxcfb_damage_rect* bounds)
+{
+	if (region->count == 0U) {
+		memset(bounds, 0, sizeof(*bounds));
+		return false;
+	}
+
+	*bounds = region->rects[0];
+	for (uint32_t i = 1U; i < region->count; i++) {
+		rect_union(bounds, &region->rects[i]);
+	}
+	return true;
+}
@@ -0,0 +1,119 @@
+/*
+	libfbdamage: Consumer-side helpers for mxc_epdc_fb_damage.
+	Copyright (C) 2021-2022 NiLuJe <ninuje@gmail.com>
+	SPDX-License-Identifier: GPL-2.0-only
+*/
+
+#ifndef __LIBFBDAMAGE_H
+#define __LIBFBDAMAGE_H
+
+#include "../mxc_epdc_fb_damage.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// NOTE: Everything in here sticks to plain fixed-size types, caller-allocated structs & integer return codes
+//       (0 or a positive count on success, -errno on failure), so that it's trivial to bind via an FFI.
+
+#define FBDAMAGE_API __attribute__((visibility("default")))
+
+// Opens /dev/fbdamage (read-only & close-on-exec), optionally in non-blocking mode.
+// NOTE: With a blocking fd, fbdamage_drain blocks until there's something to read, instead of returning 0.
+// Returns the fd, or -errno.
+FBDAMAGE_API int fbdamage_open(bool nonblock);
+
+// Same, but for a specific device node (e.g., /dev/fbdamage1, when the module tracks more than one framebuffer).
+FBDAMAGE_API int fbdamage_open_path(const char* path, bool nonblock);
+
+// Waits for up to timeout_ms (-1 means forever) for something to read (transparently retrying on EINTR).
+// Returns 1 if there is, 0 on timeout, or -errno.
+FBDAMAGE_API int fbdamage_wait(int fd, int timeout_ms);
+
+// Reads as many records as there are queued (and fit in capacity) straight into records,
+// which is an array of capacity records of record_size bytes each
+// (i.e., sizeof(mxcfb_damage_update), or the size you negotiated via FBDAMAGE_SET_RECORD_FORMAT).
+// Since the kernel hands out every queued record that fits in one go, that's a single read(2) in the common case.
+// Returns the amount of records read (0 if there were none, i.e., EAGAIN), or -errno.
+FBDAMAGE_API int fbdamage_drain(int fd, void* records, uint32_t record_size, uint32_t capacity);
+
+// The mmap'ed ring (c.f., mxcfb_damage_ring_header), drained without a single syscall.
+typedef struct
+{
+	const mxcfb_damage_ring_header* header;
+	mxcfb_damage_ring_cursor*       cursor;
+	size_t                          map_size;
+} fbdamage_ring;
+
+// Maps the ring & our cursor. Returns 0, or -errno.
+FBDAMAGE_API int  fbdamage_ring_map(int fd, fbdamage_ring* ring);
+FBDAMAGE_API void fbdamage_ring_unmap(fbdamage_ring* ring);
+
+// Copies as many queued slots as fit in capacity, and releases them.
+// If the kernel lapped us, we skip ahead to the oldest slot still around, and add the amount of records we missed to
+// *lost (if not NULL; that's on top of the header's overflows counter, which accounts for the records the ring dropped).
+// Returns the amount of slots copied.
+FBDAMAGE_API uint32_t fbdamage_ring_drain(fbdamage_ring*      ring,
+					  mxcfb_damage_slot* slots,
+					  uint32_t           capacity,
+					  uint32_t*          lost);
+
+// Unpacks a slot's event into an mxcfb_damage_update, i.e., what read() would have handed out
+// (minus overflow_notify & queue_size, which are zeroed).
+FBDAMAGE_API void fbdamage_slot_update(const mxcfb_damage_slot* slot, mxcfb_damage_update* update);
+
+// The mmap'ed pixel arena (c.f., FBDAMAGE_SET_SNAPSHOTS).
+typedef struct
+{
+	const mxcfb_damage_ring_header* header;    // Just the header page, for pixels_head
+	const unsigned char*            pixels;
+	uint32_t                        size;
+} fbdamage_arena;
+
+// Maps the pixel arena. Returns 0, -EOPNOTSUPP if the module wasn't loaded with one, or -errno.
+// NOTE: Snapshots are only taken once you've enabled them via FBDAMAGE_SET_SNAPSHOTS.
+FBDAMAGE_API int  fbdamage_arena_map(int fd, fbdamage_arena* arena);
+FBDAMAGE_API void fbdamage_arena_unmap(fbdamage_arena* arena);
+
+// Copies the snapshot a record points to into buf (which can hold capacity bytes).
+// Returns the amount of bytes copied, -ENODATA if the record doesn't have a snapshot, -ENOSPC if it doesn't fit,
+// -ESTALE if it was overwritten before (or while) we copied it (only once the record was consumed, so, copy early),
+// or -EINVAL if it doesn't make any sense.
+FBDAMAGE_API int
+    fbdamage_arena_copy(const fbdamage_arena* arena, const mxcfb_damage_pixels* pixels, void* buf, uint32_t capacity);
+
+// A fixed-capacity set of non-overlapping rectangles (no allocations, ever).
+// Rectangles that overlap or touch are merged, and once the set is full, everything collapses into its bounding box,
+// so it only ever over-approximates, never loses any damage (which is the exact same logic as the kernel's coalescing).
+#define FBDAMAGE_REGION_MAX_RECTS 64U
+
+typedef struct
+{
+	uint32_t          count;
+	uint32_t          capacity;    // At most FBDAMAGE_REGION_MAX_RECTS
+	mxcfb_damage_rect rects[FBDAMAGE_REGION_MAX_RECTS];
+} fbdamage_region;
+
+// Empties the region, and sets its capacity (0 or anything above FBDAMAGE_REGION_MAX_RECTS means the max)
+FBDAMAGE_API void fbdamage_region_init(fbdamage_region* region, uint32_t capacity);
+FBDAMAGE_API void fbdamage_region_clear(fbdamage_region* region);
+// Adds a rectangle to the region (empty ones are ignored)
+FBDAMAGE_API void fbdamage_region_add(fbdamage_region* region, const mxcfb_damage_rect* rect);
+// Adds every rectangle of other to the region
+FBDAMAGE_API void fbdamage_region_union(fbdamage_region* region, const fbdamage_region* other);
+// Only keeps the parts of the region that are also in other
+FBDAMAGE_API void fbdamage_region_intersect(fbdamage_region* region, const fbdamage_region* other);
+// Only keeps the parts of the region that are inside clip (e.g., the screen, or a widget you care about)
+FBDAMAGE_API void fbdamage_region_clip(fbdamage_region* region, const mxcfb_damage_rect* clip);
+// Sets bounds to the bounding box of the region. Returns false (and zeroes bounds) if the region is empty.
+FBDAMAGE_API bool fbdamage_region_bounds(const fbdamage_region* region, mxcfb_damage_rect* bounds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif